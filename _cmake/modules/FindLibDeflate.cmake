@@ -0,0 +1,45 @@
+set(PKG_CONFIG_USE_CMAKE_PREFIX_PATH ON)
+
+find_package(PkgConfig QUIET)
+include(FindPackageHandleStandardArgs)
+include(FeatureSummary)
+
+if(PKG_CONFIG_FOUND)
+    pkg_check_modules(PKG_LIBDEFLATE QUIET libdeflate)
+endif()
+
+if(NOT PKG_LIBDEFLATE_FOUND)
+    # older libdeflate versions don't install a pkg-config file
+    find_path(LIBDEFLATE_INCLUDE_DIR libdeflate.h)
+    find_library(LIBDEFLATE_LIBRARIES NAMES deflate libdeflate)
+    set(LIBDEFLATE_VERSION "")
+    set(LIBDEFLATE_LIBRARY_LDFLAGS "")
+else()
+    set(LIBDEFLATE_DEFINITIONS ${PKG_LIBDEFLATE_CFLAGS_OTHER})
+    set(LIBDEFLATE_VERSION ${PKG_LIBDEFLATE_VERSION})
+    find_path(LIBDEFLATE_INCLUDE_DIR libdeflate.h HINTS ${PKG_LIBDEFLATE_INCLUDEDIR} ${PKG_LIBDEFLATE_INCLUDE_DIRS})
+    set(LIBDEFLATE_LIBRARIES ${PKG_LIBDEFLATE_LIBRARIES})
+    if(PKG_LIBDEFLATE_LIBRARY_DIRS)
+        set(LIBDEFLATE_LIBRARY_LDFLAGS "-L${PKG_LIBDEFLATE_LIBRARY_DIRS}")
+    else()
+        set(LIBDEFLATE_LIBRARY_LDFLAGS "")
+    endif()
+endif()
+
+find_package_handle_standard_args(LibDeflate
+    FOUND_VAR
+        LIBDEFLATE_FOUND
+    REQUIRED_VARS
+        LIBDEFLATE_INCLUDE_DIR
+        LIBDEFLATE_LIBRARIES
+    VERSION_VAR
+        LIBDEFLATE_VERSION
+)
+
+mark_as_advanced(LIBDEFLATE_INCLUDE_DIR LIBDEFLATE_LIBRARIES)
+
+set_package_properties(LibDeflate PROPERTIES
+                      DESCRIPTION "Heavily optimized whole-buffer DEFLATE/zlib compression library"
+                      TYPE OPTIONAL
+                      PURPOSE "Faster ZLIB (de)compression of the 64Kb chunks"
+                      URL "https://github.com/ebiggers/libdeflate")
@@ -16,6 +16,10 @@
 
 #include <algorithm>
 #include <cmath>
+#include <functional>
+#include <queue>
+
+#include <unistd.h>
 
 #include "ParallelProcess_p.hpp"
 #include "ParallelProcess.h"
@@ -46,6 +50,9 @@ FileEntry::FileEntry( const char *name, const struct stat *finfo, FolderInfo &di
 }
 
 FileEntry::FileEntry(const FileEntry &ref)
+	:folderInfo(NULL)
+	,freeFolderInfo(false)
+	,compressedSize(0)
 {
 	*this = ref;
 }
@@ -77,6 +84,7 @@ FileEntry &FileEntry::operator =(const FileEntry &ref)
 		folderInfo = ref.folderInfo;
 	}
 	freeFolderInfo = ref.freeFolderInfo;
+	compressedSize = ref.compressedSize;
 	return *this;
 }
 
@@ -114,9 +122,30 @@ ParallelFileProcessor::ParallelFileProcessor(int n, int r, int verbose)
 	nProcessed = 0;
 	allDoneEvent = NULL;
 	ioLock = new CRITSECTLOCK(4000);
-	ioLockedFlag = false;
-	ioLockingThread = 0;
+	ioWidth = 1;
+	taskLock = new CRITSECTLOCK(4000);
+	chunkTaskEvent = CreateEvent( NULL, true, false, NULL );
+	chunkTaskDoneEvent = CreateEvent( NULL, false, false, NULL );
+	nChunkTaskGroups = 0;
 	verboseLevel = verbose;
+	costScheduling = false;
+	predictedMakespan = estimatedWork = 0;
+	streaming = false;
+	windowCount = 0;
+	windowLimit = 0;
+	windowBySize = false;
+	itemAddedEvent = itemTakenEvent = NULL;
+	nQueued = 0;
+	startTime = 0;
+	dataSetLock = new CRITSECTLOCK(4000);
+	autoScaling = false;
+	activeWorkers = n;
+	scaleTime = scaleWork = scaleCPUTime = scaleThroughput = 0;
+	scaleDirection = 1;
+	minActiveWorkers = maxActiveWorkers = nScaleChanges = 0;
+	memoryBudget = memoryReserved = memoryPeak = 0;
+	memoryWaits = memoryDeferrals = 0;
+	memoryReleasedEvent = CreateEvent( NULL, false, false, NULL );
 	memset( &jobInfo, 0, sizeof(jobInfo) );
 	z_dataSetInfo.set_empty_key(std::string());
 	z_dataSetInfoForFile.set_empty_key(std::string());
@@ -127,12 +156,44 @@ ParallelFileProcessor::ParallelFileProcessor(int n, int r, int verbose)
 }
 
 ParallelFileProcessor::~ParallelFileProcessor()
-{
-	if( verboseLevel > 1 && (listLockConflicts() || ioLock->lockCounter) ){
-		fprintf( stderr, "Queue lock contention: %lux ; IO lock contention %lux\n",
-				 listLockConflicts(), ioLock->lockCounter );
+{ unsigned long ioContention = 0;
+	for( auto &it : ioDeviceForName ){
+		ioContention += it.second->contention;
+	}
+	if( verboseLevel > 1 && (claimConflictCount() || stolenItemCount() || ioContention) ){
+		fprintf( stderr, "Queue claim conflicts: %lux ; %lu items stolen ; IO lock contention %lux\n",
+				 claimConflictCount(), stolenItemCount(), ioContention );
 	}
+	// list the devices when there are several, or when their widths were chosen automatically
+	if( verboseLevel > 1 && (ioDeviceForName.size() > 1 || ioWidth <= 0) ){
+		for( auto &it : ioDeviceForName ){
+			fprintf( stderr, "\t%s: %d I/O token(s), waited for %ldx\n",
+					 it.first.c_str(), it.second->width, it.second->contention );
+		}
+	}
+	for( auto &it : ioDeviceForName ){
+		delete it.second;
+	}
+	CloseHandle(memoryReleasedEvent);
 	delete ioLock;
+	delete taskLock;
+	delete dataSetLock;
+	for( auto &it : itemWindow ){
+		delete it.second;
+	}
+	itemWindow.clear();
+	if( itemAddedEvent ){
+		CloseHandle(itemAddedEvent);
+	}
+	if( itemTakenEvent ){
+		CloseHandle(itemTakenEvent);
+	}
+	if( chunkTaskEvent ){
+		CloseHandle(chunkTaskEvent);
+	}
+	if( chunkTaskDoneEvent ){
+		CloseHandle(chunkTaskDoneEvent);
+	}
 	if( allDoneEvent ){
 		CloseHandle(allDoneEvent);
 	}
@@ -155,33 +216,85 @@ ParallelFileProcessor *createParallelProcessor(int n, int r, int verboseLevel)
 	return new ParallelFileProcessor(n, r, verboseLevel);
 }
 
-// attempt to lock the ioLock; returns a success value
-bool ParallelFileProcessor::lockIO()
-{ DWORD pid = GetCurrentThreadId();
-	if( ioLock ){
-		bool wasLocked = (ioLock->IsLocked() && (ioLockingThread != pid));
-		ioLock->Lock(ioLockedFlag);
-		if( wasLocked ){
-			ioLock->lockCounter += 1;
+void IODevice::acquire()
+{
+	for( ;; ){
+	 long n = available;
+		if( n > 0 ){
+			if( __sync_bool_compare_and_swap( &available, n, n - 1 ) ){
+				return;
+			}
+		}
+		else{
+			_InterlockedIncrement(&contention);
+			// the timeout covers a token returned between the test and the wait
+			WaitForSingleObject( tokenReturned, 100 );
 		}
 	}
-	if( ioLockedFlag ){
-		ioLockingThread = pid;
-	}
-	return ioLockedFlag;
 }
 
-// unlock the ioLock
-bool ParallelFileProcessor::unLockIO()
+void IODevice::release()
 {
-	if( ioLock ){
-		ioLock->Unlock(ioLockedFlag);
-		ioLockedFlag = ioLock->IsLocked();
+	_InterlockedIncrement(&available);
+	SetEvent(tokenReturned);
+}
+
+IODevice *ParallelFileProcessor::ioDevice(dev_t dev)
+{ CRITSECTLOCK::Scope scope(ioLock);
+  auto it = ioDeviceForDev.find(dev);
+	if( it != ioDeviceForDev.end() ){
+		return it->second;
+	}
+	std::string name;
+	auto group = ioGroupForDev.find(dev);
+	if( group != ioGroupForDev.end() ){
+		name = group->second;
 	}
-	if( !ioLockedFlag && ioLockingThread == GetCurrentThreadId() ){
-		ioLockingThread = 0;
+	else{
+	 char devName[64];
+		snprintf( devName, sizeof(devName), "device 0x%llx", (unsigned long long) dev );
+		name = devName;
+	}
+	IODevice *device;
+	auto named = ioDeviceForName.find(name);
+	if( named != ioDeviceForName.end() ){
+		device = named->second;
+	}
+	else{
+	 int width = ioWidth;
+		if( width <= 0 ){
+			// exclusive I/O for spinning disks and devices we know nothing about (they may well
+			// be backed by spinning disks), as many workers as the device queues for the others.
+		 device_info info;
+			width = 1;
+			if( getDeviceInfo(dev, &info) ){
+				if( info.rotational ){
+					name += " (rotational)";
+				}
+				else{
+					width = (info.queueDepth > 0 && info.queueDepth < nJobs)? info.queueDepth : nJobs;
+					name += " (solid state)";
+				}
+			}
+		}
+		device = ioDeviceForName[name] = new IODevice(name, width);
 	}
-	return ioLockedFlag;
+	ioDeviceForDev[dev] = device;
+	return device;
+}
+
+void ParallelFileProcessor::setIODeviceGroup(dev_t dev, const std::string &group)
+{ CRITSECTLOCK::Scope scope(ioLock);
+	ioGroupForDev[dev] = group;
+}
+
+bool ParallelFileProcessor::setIOWidth(int width)
+{
+	if( width >= 0 && ioDeviceForName.empty() ){
+		ioWidth = width;
+		return true;
+	}
+	return false;
 }
 
 // change the number of jobs
@@ -195,13 +308,139 @@ bool ParallelFileProcessor::setJobs(int n, int r)
 	return false;
 }
 
-int ParallelFileProcessor::run()
-{ FileEntry entry;
-  int i, nRequested = nJobs;
-  double N = size(), prevPerc = 0;
+double ParallelFileProcessor::estimatedCost(const FileEntry &entry)
+{
+	// single-thread throughput in Mb/s when compressing 64Kb chunks: measured with deflatebench
+	// for ZLIB (by level), typical figures for LZVN and LZFSE. Other types (zfsctool) only
+	// rewrite the file, which is bound by the disk.
+	static const double zlibRate[10] = { 82, 82, 100, 70, 55, 43, 32, 28, 21, 20 };
+	const FolderInfo *info = entry.folderInfo;
+	double rate;
+	switch( info ? info->compressiontype : NONE ){
+		case ZLIB:
+			rate = zlibRate[(info->compressionlevel >= 1 && info->compressionlevel <= 9)? info->compressionlevel : 5];
+			break;
+		case LZVN:
+			rate = 250;
+			break;
+		case LZFSE:
+			rate = 100;
+			break;
+		default:
+			rate = 200;
+			break;
+	}
+	// plus a fixed overhead for opening, checking and replacing each file
+	return 0.0003 + entry.fileInfo.st_size / (rate * 1e6);
+}
+
+long long ParallelFileProcessor::memoryReservation(const FileEntry &entry)
+{
+	const FolderInfo *info = entry.folderInfo;
+	long long size = entry.fileInfo.st_size;
+	if( info && info->streamWindow > 0 && size > info->streamWindow ){
+		// only a window of the file is in memory at any time
+		size = info->streamWindow;
+	}
+	// the file itself, and when compressing to HFS its compressed image, which is at most
+	// about as large. zfsctool only rewrites the file.
+	return ((info && info->compressiontype != NONE)? 2 * size : size) + 0x10000;
+}
+
+bool ParallelFileProcessor::setMemoryBudget(long long budget)
+{
+	if( threadPool.empty() ){
+		memoryBudget = (budget > 0)? budget : 0;
+		return true;
+	}
+	return false;
+}
+
+bool ParallelFileProcessor::reserveMemory(long long amount, bool wait)
+{
+	if( memoryBudget <= 0 ){
+		return true;
+	}
+	bool waited = false;
+	for( ;; ){
+	 long long reserved = memoryReserved;
+		if( reserved == 0 || reserved + amount <= memoryBudget ){
+			if( __sync_bool_compare_and_swap( &memoryReserved, reserved, reserved + amount ) ){
+				for( long long peak = memoryPeak ; reserved + amount > peak ; peak = memoryPeak ){
+					__sync_bool_compare_and_swap( &memoryPeak, peak, reserved + amount );
+				}
+				return true;
+			}
+			continue;
+		}
+		if( !wait || quitRequested() ){
+			return false;
+		}
+		if( !waited ){
+			_InterlockedIncrement(&memoryWaits);
+			waited = true;
+		}
+		// the timeout covers memory released between the test and the wait
+		WaitForSingleObject( memoryReleasedEvent, 100 );
+	}
+}
+
+void ParallelFileProcessor::releaseMemory(long long amount)
+{
+	if( memoryBudget > 0 ){
+		__sync_fetch_and_sub( &memoryReserved, amount );
+		SetEvent(memoryReleasedEvent);
+	}
+}
+
+static bool costLess(const FileEntry &a, const FileEntry &b)
+{
+	return ParallelFileProcessor::estimatedCost(a) < ParallelFileProcessor::estimatedCost(b);
+}
+
+bool ParallelFileProcessor::sortByCost()
+{
+	if( threadPool.empty() ){
+		std::sort(itemList.begin(), itemList.end(), costLess);
+		costScheduling = true;
+		return true;
+	}
+	return false;
+}
+
+// the makespan of <items>, sorted by increasing cost, on <nJobs> workers that each take the
+// costliest item left as soon as they're done with the previous one. Ignores the help
+// workers get with the chunks of large files. Returns the total estimated work in <total>.
+static double lptMakespan(const std::deque<FileEntry> &items, int nJobs, double &total)
+{ std::priority_queue<double, std::vector<double>, std::greater<double> > finish;
+	total = 0;
+	for( int i = 0 ; i < nJobs ; ++i ){
+		finish.push(0);
+	}
+	for( auto it = items.rbegin() ; it != items.rend() ; ++it ){
+	 const double cost = ParallelFileProcessor::estimatedCost(*it);
+	 const double start = finish.top();
+		finish.pop();
+		finish.push(start + cost);
+		total += cost;
+	}
+	double makespan = 0;
+	while( !finish.empty() ){
+		makespan = finish.top();
+		finish.pop();
+	}
+	return makespan;
+}
+
+void ParallelFileProcessor::spawnWorkers()
+{ int i, nRequested = nJobs;
 	if( nJobs >= 1 ){
 		allDoneEvent = CreateEvent( NULL, false, false, NULL );
 	}
+	if( costScheduling ){
+		// everybody takes the costliest item that's left
+		nReverse = nJobs;
+	}
 	for( i = 0 ; i < nJobs ; ++i ){
 		// workers attacking the item list rear are created last
 		// (not that this makes any difference except in the stats summary print out...)
@@ -217,10 +456,188 @@ int ParallelFileProcessor::run()
 	if( nJobs != nRequested ){
 		fprintf( stderr, "Parallel processing with %ld instead of %d threads\n", nJobs, nRequested );
 	}
-	const double startTime = HRTime_Time();
+	{ CRITSECTLOCK::Scope scope(listLock);
+		startClaiming(nRequested);
+		for( auto thread : threadPool ){
+			claimSlots[thread->procID].fromRear = thread->isBackwards;
+		}
+		if( costScheduling ){
+			// a batch would keep the costly items it contains from the other workers
+			maxClaimBatch = 1;
+			predictedMakespan = lptMakespan(itemList, nJobs, estimatedWork);
+		}
+	}
+	activeWorkers = nJobs;
+	if( autoScaling ){
+		// start with a worker per CPU; the measurements will tell if more or fewer do better
+	 long nCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+		if( nCPUs > 0 && nCPUs < activeWorkers ){
+			activeWorkers = nCPUs;
+		}
+		minActiveWorkers = maxActiveWorkers = activeWorkers;
+	}
+	if( !placementCPUs.empty() ){
+		for( i = 0 ; i < nJobs ; ++i ){
+			threadPool[i]->cpu = placementCPUs[i % placementCPUs.size()];
+			threadPool[i]->node = placementNodes[i % placementNodes.size()];
+		}
+	}
+	startTime = scaleTime = HRTime_Time();
 	for( i = 0 ; i < nJobs ; ++i ){
 		threadPool[i]->Start();
 	}
+}
+
+bool ParallelFileProcessor::setCPUPlacement(const char *cpuList)
+{
+	if( threadPool.empty() ){
+	 std::vector<int> cpus(CPU_PLACEMENT_MAX), nodes(CPU_PLACEMENT_MAX);
+	 int n = numaCPUPlacement(cpuList, cpus.data(), nodes.data(), CPU_PLACEMENT_MAX);
+		if( n > 0 ){
+			placementCPUs.assign(cpus.begin(), cpus.begin() + n);
+			placementNodes.assign(nodes.begin(), nodes.begin() + n);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ParallelFileProcessor::setAutoScaling(bool enable)
+{
+	if( threadPool.empty() ){
+		autoScaling = enable;
+		return true;
+	}
+	return false;
+}
+
+bool ParallelFileProcessor::queueDrained()
+{
+	return !streaming && windowCount == 0 && unclaimedItems() == 0;
+}
+
+void ParallelFileProcessor::adjustActiveWorkers(double now)
+{ double work = 0, cpuTime = 0;
+  const double interval = now - scaleTime;
+	if( interval < 1 || queueDrained() ){
+		return;
+	}
+	for( auto thread : threadPool ){
+		work += thread->workDone;
+		if( thread->hasInfo ){
+			cpuTime += thread->userTime + thread->systemTime;
+		}
+	}
+	// the throughput in estimated seconds of work per second, which weighs the number
+	// of files and their sizes; and the fraction of the time the active workers were on a CPU.
+ const double throughput = (work - scaleWork) / interval;
+ const double utilisation = (cpuTime - scaleCPUTime) / (interval * activeWorkers);
+	if( scaleThroughput > 0 ){
+		if( throughput < scaleThroughput * 0.95 ){
+			// the last change made things worse: undo it
+			scaleDirection = -scaleDirection;
+		}
+		else if( throughput < scaleThroughput * 1.05 ){
+			// no significant difference: use fewer workers when they mostly wait for I/O, more otherwise
+			scaleDirection = (utilisation < 0.5)? -1 : 1;
+		}
+		// else: keep going in the same direction
+	}
+ const long active = std::max(1L, std::min((long) nJobs, activeWorkers + scaleDirection));
+	if( active != activeWorkers ){
+		activeWorkers = active;
+		if( scaleDirection > 0 ){
+			SetEvent(threadPool[active - 1]->unparkEvent);
+		}
+		minActiveWorkers = std::min(minActiveWorkers, active);
+		maxActiveWorkers = std::max(maxActiveWorkers, active);
+		nScaleChanges += 1;
+	}
+	scaleTime = now, scaleWork = work, scaleCPUTime = cpuTime, scaleThroughput = throughput;
+}
+
+bool ParallelFileProcessor::start(bool sortBySize, size_t limit)
+{
+	if( !threadPool.empty() || costScheduling || nJobs < 1 || limit == 0 ){
+		return false;
+	}
+	windowBySize = sortBySize;
+	windowLimit = limit;
+	itemAddedEvent = CreateEvent( NULL, false, false, NULL );
+	itemTakenEvent = CreateEvent( NULL, false, false, NULL );
+	streaming = true;
+	spawnWorkers();
+	return true;
+}
+
+bool ParallelFileProcessor::addItem(const FileEntry &entry)
+{
+	if( !streaming ){
+		itemList.push_back(entry);
+		nQueued += 1;
+		return true;
+	}
+ FileEntry *item = new FileEntry(entry);
+	for( ;; ){
+		{ CRITSECTLOCK::Scope scope(listLock);
+			if( itemWindow.size() < windowLimit ){
+				itemWindow.insert( std::make_pair( windowBySize ? double(item->fileInfo.st_size) : double(nQueued), item ) );
+				windowCount = itemWindow.size();
+				nQueued += 1;
+				// workers only wait for items when the window is empty
+				if( windowCount <= nJobs ){
+					SetEvent(itemAddedEvent);
+				}
+				return true;
+			}
+		}
+		// backpressure: wait for a worker to take an item
+		if( quitRequested() ){
+			delete item;
+			return false;
+		}
+		WaitForSingleObject( itemTakenEvent, 100 );
+	}
+}
+
+FileEntry *ParallelFileProcessor::nextItem(FileProcessor *worker, bool &owned)
+{
+	if( streaming || windowCount > 0 ){
+	 CRITSECTLOCK::Scope scope(listLock);
+		if( !itemWindow.empty() ){
+		 auto it = worker->isBackwards ? std::prev(itemWindow.end()) : itemWindow.begin();
+		 FileEntry *item = it->second;
+			// the scan only waits for room when the window is full
+			if( itemWindow.size() == windowLimit ){
+				SetEvent(itemTakenEvent);
+			}
+			itemWindow.erase(it);
+			windowCount = itemWindow.size();
+			owned = true;
+			return item;
+		}
+	}
+	owned = false;
+	return claimItem(worker->procID, worker->isBackwards);
+}
+
+int ParallelFileProcessor::run()
+{ int i;
+  double N, prevPerc = 0;
+	if( streaming ){
+		// all items have been added
+	 CRITSECTLOCK::Scope scope(listLock);
+		streaming = false;
+		SetEvent(itemAddedEvent);
+	}
+	else{
+		spawnWorkers();
+	}
+	{ CRITSECTLOCK::Scope scope(listLock);
+		// the filename -> FileEntry map only serves to weed out duplicates while the list is built
+		itemMapForName.clear();
+	}
+	N = nQueued;
 	if( allDoneEvent ){
 	 DWORD waitResult = ~WAIT_OBJECT_0;
 		// contrary to what one might expect, we should NOT use size()==0 as a stopping criterium.
@@ -249,6 +666,9 @@ int ParallelFileProcessor::run()
 					 prevPerc = perc;
 				 }
 			}
+			if( autoScaling ){
+				adjustActiveWorkers(HRTime_Time());
+			}
 			waitResult = WaitForSingleObject( allDoneEvent, 2000 );
 		}
 		if( (quitRequested() && !threadPool.empty()) || nProcessing > 0 ){
@@ -268,16 +688,18 @@ int ParallelFileProcessor::run()
 	}
 	i = 0;
 	double totalUTime = 0, totalSTime = 0;
+	double firstFinish = HUGE_VAL, lastFinish = 0;
 	// forced verbose mode: prints out statistics even if some aren't meaningful when
 	// verboseLevel==0 (like compression ratios in zfsctool).
 	int verbose = verboseLevel;
 	if (getenv("VERBOSE")) {
 		verbose = atoi(getenv("VERBOSE"));
 	}
+	std::string placement;
 	while( !threadPool.empty() ){
 	 FileProcessor *thread = threadPool.front();
 		if( thread->GetExitCode() == (THREAD_RETURN)STILL_ACTIVE ){
-			fprintf( stderr, "Stopping worker thread #%d that is still %s!\n", i, (thread->scope)? "processing" : "active" );
+			fprintf( stderr, "Stopping worker thread #%d that is still %s!\n", i, (thread->currentEntry)? "processing" : "active" );
 			std::string currentFileName = thread->currentFileName();
 			if( currentFileName.c_str()[0] ){
 				fprintf( stderr, "\tcurrent file: %s\n", currentFileName.c_str() );
@@ -295,6 +717,13 @@ int ParallelFileProcessor::run()
 				if( thread->isBackwards ){
 					fprintf( stderr, " [reverse]");
 				}
+				if( thread->nChunkTasks ){
+					fprintf( stderr, "; helped with %ld chunk tasks", thread->nChunkTasks );
+				}
+				if( thread->arena.allocationsAvoided ){
+					fprintf( stderr, "; recycled %0.2lf Kb in buffers, avoiding %llu allocations",
+						thread->arena.bytesRecycled/1024.0, thread->arena.allocationsAvoided );
+				}
 				if( verbose > 1 ){
 					if( thread->hasInfo ){
 						fprintf( stderr, "\n\t%gs user + %gs system",
@@ -320,6 +749,21 @@ int ParallelFileProcessor::run()
 				fputc( '\n', stderr );
 			}
 		}
+		if( thread->finishTime > 0 ){
+			firstFinish = std::min(firstFinish, thread->finishTime);
+			lastFinish = std::max(lastFinish, thread->finishTime);
+		}
+		if( !placementCPUs.empty() ){
+		 char where[64];
+			if( thread->cpu >= 0 ){
+				snprintf( where, sizeof(where), "%s#%d: CPU %d (node %d)",
+					(i > 0)? ", " : "", i, thread->cpu, thread->node );
+			}
+			else{
+				snprintf( where, sizeof(where), "%s#%d: not pinned", (i > 0)? ", " : "", i );
+			}
+			placement += where;
+		}
 		delete thread;
 		threadPool.pop_front();
 		i++;
@@ -330,9 +774,86 @@ int ParallelFileProcessor::run()
 		fprintf(stderr, "Total %gs user + %gs system; %gs total; %0.2lf%% CPU\n",
 				totalUTime, totalSTime, endTime - startTime, totalCPUUsage);
 	}
+	if( verbose && memoryBudget > 0 ){
+		fprintf( stderr, "Memory budget: %lld Mb, at most %lld Mb reserved; %ld items waited for memory, %ld were set aside for a smaller one\n",
+			memoryBudget / (1024 * 1024), memoryPeak / (1024 * 1024), memoryWaits, memoryDeferrals );
+	}
+	if( verbose && !placement.empty() ){
+		fprintf( stderr, "Placement: %s\n", placement.c_str() );
+	}
+	if( verbose && autoScaling ){
+		fprintf( stderr, "Autoscaling: %ld to %ld active workers, %ld at the end after %ld changes\n",
+			minActiveWorkers, maxActiveWorkers, activeWorkers, nScaleChanges );
+	}
+	if( verbose && costScheduling ){
+		fprintf( stderr, "Makespan: predicted %gs for %gs of estimated work, actual %gs; workers finished within %gs of each other\n",
+			predictedMakespan, estimatedWork, endTime - startTime, lastFinish - firstFinish );
+	}
 	return nProcessed;
 }
 
+bool ParallelFileProcessor::runChunkTasks(FileProcessor *worker, ChunkTaskGroup &group)
+{
+	group.owner = worker;
+	group.nextTask = 0;
+	group.nDone = 0;
+	group.failed = false;
+	if( group.nTasks <= 0 ){
+		return true;
+	}
+	{ CRITSECTLOCK::Scope scope(taskLock);
+		chunkTaskGroups.push_back(&group);
+		nChunkTaskGroups = chunkTaskGroups.size();
+		SetEvent(chunkTaskEvent);
+	}
+	// the posting worker executes tasks too, not necessarily from its own group,
+	// until all of its own tasks have completed.
+	while( group.nDone < group.nTasks ){
+		if( !runPendingChunkTask(worker) ){
+			WaitForSingleObject( chunkTaskDoneEvent, 5 );
+		}
+	}
+	// make sure we see all results
+	__sync_synchronize();
+	return !group.failed;
+}
+
+bool ParallelFileProcessor::runPendingChunkTask(FileProcessor *executor)
+{ ChunkTaskGroup *group = NULL;
+  long task = -1;
+	if( !nChunkTaskGroups ){
+		return false;
+	}
+	{ CRITSECTLOCK::Scope scope(taskLock);
+		if( !chunkTaskGroups.empty() ){
+			group = chunkTaskGroups.front();
+			task = group->nextTask++;
+			if( group->nextTask >= group->nTasks ){
+				// all tasks from this group have been started
+				chunkTaskGroups.pop_front();
+				nChunkTaskGroups = chunkTaskGroups.size();
+				if( chunkTaskGroups.empty() ){
+					ResetEvent(chunkTaskEvent);
+				}
+			}
+		}
+	}
+	if( !group ){
+		return false;
+	}
+	// tasks from a group that failed are cancelled but still need to be accounted for.
+	if( !group->failed && !(*group->task)(group->context, task, executor) ){
+		group->failed = true;
+	}
+	if( executor != group->owner ){
+		executor->nChunkTasks += 1;
+	}
+	// the group may go out of scope as soon as the last task has been accounted for
+	_InterlockedIncrement(&group->nDone);
+	SetEvent(chunkTaskDoneEvent);
+	return true;
+}
+
 int ParallelFileProcessor::workerDone(FileProcessor */*worker*/)
 { CRITSECTLOCK::Scope scope(threadLock);
 // 	char name[17];
@@ -349,6 +870,7 @@ int ParallelFileProcessor::workerDone(FileProcessor */*worker*/)
 
 iZFSDataSetCompressionInfo *ParallelFileProcessor::z_dataSetForFile(const std::string &fileName)
 {
+	CRITSECTLOCK::Scope scope(dataSetLock);
 	return z_dataSetInfoForFile.count(fileName) ? z_dataSetInfoForFile[fileName] : nullptr;
 }
 
@@ -360,6 +882,7 @@ iZFSDataSetCompressionInfo *ParallelFileProcessor::z_dataSetForFile(const char *
 
 iZFSDataSetCompressionInfo *ParallelFileProcessor::z_dataSet(const std::string &name)
 {
+	CRITSECTLOCK::Scope scope(dataSetLock);
 	return z_dataSetInfo.count(name) ? z_dataSetInfo[name] : nullptr;
 }
 
@@ -371,8 +894,9 @@ iZFSDataSetCompressionInfo *ParallelFileProcessor::z_dataSet(const char *name)
 
 void ParallelFileProcessor::z_addDataSet(const std::string &fileName, iZFSDataSetCompressionInfo *info)
 {
+	CRITSECTLOCK::Scope scope(dataSetLock);
 	// iZFSDataSetCompressionInfo inherits std::string so we can do this:
-	auto old = z_dataSet(*info);
+	auto old = z_dataSetInfo.count(*info) ? z_dataSetInfo[*info] : nullptr;
 	if (old && old != info) {
 		delete old;
 	}
@@ -385,26 +909,97 @@ void ParallelFileProcessor::z_addDataSet(const std::string &fileName, iZFSDataSe
 DWORD FileProcessor::Run(LPVOID /*arg*/)
 {
 	if( PP ){
-	 FileEntry entry;
+	 FileEntry *entry, *deferred = NULL;
+	 bool ownEntry, ownDeferred = false;
+	 int passedOver = 0;
+	 long long reservation = 0;
 		nProcessed = 0;
-		while( !PP->quitRequested() && (isBackwards ? PP->getBack(entry) : PP->getFront(entry)) ){
-		 // create a scoped lock without closing it immediately
-		 CRITSECTLOCK::Scope scp(PP->ioLock, 0);
-			scope = &scp;
-			currentEntry = &entry;
+		while( !PP->quitRequested() ){
+			if( procID >= PP->activeWorkers && !deferred && !PP->queueDrained() ){
+				// parked by the autoscaler
+				WaitForSingleObject( unparkEvent, 250 );
+				continue;
+			}
+			// lend a hand with the chunks of large files that are being compressed
+			// before starting on a new file.
+			if( PP->runPendingChunkTask(this) ){
+				continue;
+			}
+			entry = NULL;
+			if( deferred ){
+				// first retry the item that was set aside because it didn't fit in the memory
+				// budget, waiting for the memory once it has been passed over often enough.
+			 const bool wait = passedOver >= ParallelFileProcessor::MEMORY_DEFER_LIMIT;
+				reservation = ParallelFileProcessor::memoryReservation(*deferred);
+				if( PP->reserveMemory(reservation, wait) ){
+					entry = deferred, ownEntry = ownDeferred;
+					deferred = NULL;
+				}
+				else if( wait ){
+					// asked to quit
+					break;
+				}
+			}
+			if( !entry ){
+				// read this before looking for an item: when not set, no item can be added after that
+			 const bool streaming = PP->streaming;
+				if( !(entry = PP->nextItem(this, ownEntry)) ){
+					if( deferred ){
+						// nothing left to take instead
+						passedOver = ParallelFileProcessor::MEMORY_DEFER_LIMIT;
+						continue;
+					}
+					if( streaming ){
+						WaitForSingleObject( PP->itemAddedEvent, 50 );
+						continue;
+					}
+					// the queue is empty but other workers may still post chunk tasks
+					// as long as they're processing files.
+					if( PP->nProcessing > 0 ){
+						WaitForSingleObject( PP->chunkTaskEvent, 50 );
+						continue;
+					}
+					break;
+				}
+				reservation = ParallelFileProcessor::memoryReservation(*entry);
+				// a worker sets aside a single item at most
+				if( !PP->reserveMemory(reservation, deferred != NULL) ){
+					if( deferred ){
+						if( ownEntry ){
+							delete entry;
+						}
+						break;
+					}
+					deferred = entry, ownDeferred = ownEntry;
+					passedOver = 0;
+					_InterlockedIncrement(&PP->memoryDeferrals);
+					continue;
+				}
+				if( deferred ){
+					passedOver += 1;
+				}
+			}
+			if( !ioDevice || entry->fileInfo.st_dev != ioDeviceID ){
+				ioDevice = PP->ioDevice(entry->fileInfo.st_dev);
+				ioDeviceID = entry->fileInfo.st_dev;
+			}
+			currentEntry = entry;
 			_InterlockedIncrement(&PP->nProcessing);
-			entry.compress( this, PP );
+			entry->compress( this, PP );
 			_InterlockedDecrement(&PP->nProcessing);
 			_InterlockedIncrement(&PP->nProcessed);
 			currentEntry = NULL;
 			nProcessed += 1;
-			scope = NULL;
+			// return the I/O token when the item's processing didn't
+			unLockScope();
 
-			// be tidy and remove the entry from the filename -> FileEntry map
-			PP->itemForName().erase(entry.fileName);
-
-			runningTotalRaw += entry.fileInfo.st_size;
-			runningTotalCompressed += (entry.compressedSize > 0)? entry.compressedSize : entry.fileInfo.st_size;
+			runningTotalRaw += entry->fileInfo.st_size;
+			runningTotalCompressed += (entry->compressedSize > 0)? entry->compressedSize : entry->fileInfo.st_size;
+			workDone += ParallelFileProcessor::estimatedCost(*entry);
+			PP->releaseMemory(reservation);
+			if( ownEntry ){
+				delete entry;
+			}
 			/*if( PP->verbose() > 1 )*/{
 #if defined(__MACH__)
                 mach_port_t thread = mach_thread_self();
@@ -441,6 +1036,10 @@ DWORD FileProcessor::Run(LPVOID /*arg*/)
 #endif
 			}
 		}
+		if( deferred && ownDeferred ){
+			delete deferred;
+		}
+		finishTime = HRTime_Time();
 	}
 	return DWORD(nProcessed);
 }
@@ -457,33 +1056,34 @@ void FileProcessor::InitThread()
 	pthread_setname_np(thread, name);
 #endif
 	hasInfo = false;
+	if( cpu >= 0 ){
+		// pin before allocating anything, and have the buffers land on our node
+		if( pinThreadToCPU(cpu) ){
+			arena.firstTouch = true;
+		}
+		else{
+			fprintf( stderr, "Worker #%d: cannot pin to CPU %d (%s)\n", procID, cpu, strerror(errno) );
+			cpu = node = -1;
+		}
+	}
 }
 
 bool FileProcessor::lockScope()
 {
-	if( PP ){
-		if( scope ){
-			bool wasLocked = scope->IsLocked();
-			PP->ioLockedFlag = scope->Lock();
-			if( wasLocked && scope->Parent() ){
-				scope->Parent()->lockCounter += 1;
-			}
-		}
-		return PP->ioLockedFlag;
+	if( currentEntry && ioDevice && !ioLocked ){
+		ioDevice->acquire();
+		ioLocked = true;
 	}
-	return false;
+	return ioLocked;
 }
 
 bool FileProcessor::unLockScope()
 {
-	if( PP ){
-		if( scope ){
-			scope->Unlock();
-			PP->ioLockedFlag = *scope;
-		}
-		return PP->ioLockedFlag;
+	if( ioLocked ){
+		ioDevice->release();
+		ioLocked = false;
 	}
-	return false;
+	return ioLocked;
 }
 
 // ================================= C interface functions =================================
@@ -499,7 +1099,9 @@ bool addFileToParallelProcessor(ParallelFileProcessor *p, const char *inFile, co
 	if( p && inFile && inFileInfo && folderInfo && !p->itemForName().count(inFile) ){
 		const auto &entry = ownInfo ? FileEntry( inFile, inFileInfo, new FolderInfo(*folderInfo), ownInfo )
 			: FileEntry( inFile, inFileInfo, folderInfo, ownInfo );
-		p->items().push_back(entry);
+		if( !p->addItem(entry) ){
+			return false;
+		}
 		p->itemForName()[inFile] = &entry;
 		return true;
 	}
@@ -530,17 +1132,54 @@ bool sortFilesInParallelProcessorBySize(ParallelFileProcessor *p)
 	}
 }
 
+bool sortFilesInParallelProcessorByCost(ParallelFileProcessor *p)
+{
+	if( p && p->itemCount() > 0 ){
+		fprintf(stderr, "Scheduling %lu entries by estimated cost ...", p->itemCount()); fflush(stderr);
+		bool ret = p->sortByCost();
+		fprintf( stderr, " done\n" );
+		return ret;
+	}
+	else{
+		return false;
+	}
+}
+
 size_t filesInParallelProcessor(ParallelFileProcessor *p)
 {
 	if( p ){
-		return p->itemCount();
+		return p->queuedItems();
 	}
 	else{
 		return 0;
 	}
 }
 
-// attempt to lock the ioLock; returns a success value
+bool setParallelProcessorIOWidth(ParallelFileProcessor *p, int width)
+{
+	if( p ){
+		return p->setIOWidth(width);
+	}
+	return false;
+}
+
+bool setParallelProcessorCPUPlacement(ParallelFileProcessor *p, const char *cpuList)
+{
+	if( p ){
+		return p->setCPUPlacement(cpuList);
+	}
+	return false;
+}
+
+bool setParallelProcessorMemoryBudget(ParallelFileProcessor *p, long long budget)
+{
+	if( p ){
+		return p->setMemoryBudget(budget);
+	}
+	return false;
+}
+
+// take an I/O token for the device of the worker's current file; returns a success value
 bool lockParallelProcessorIO(FileProcessor *worker)
 { bool locked = false;
 	if( worker ){
@@ -549,7 +1188,7 @@ bool lockParallelProcessorIO(FileProcessor *worker)
 	return locked;
 }
 
-// unlock the ioLock
+// return the I/O token
 bool unLockParallelProcessorIO(FileProcessor *worker)
 { bool locked = false;
 	if( worker ){
@@ -567,6 +1206,38 @@ int currentParallelProcessorID(FileProcessor *worker)
 	return procID;
 }
 
+int parallelProcessorJobs(FileProcessor *worker)
+{ int n = 0;
+	if( worker && worker->controller() ){
+		n = worker->controller()->jobs();
+	}
+	return n;
+}
+
+bool runParallelChunkTasks(FileProcessor *worker, int nTasks, ParallelChunkTask task, void *context)
+{
+	if( worker && worker->controller() ){
+		ChunkTaskGroup group;
+		group.task = task;
+		group.context = context;
+		group.nTasks = nTasks;
+		return worker->controller()->runChunkTasks(worker, group);
+	}
+	else{
+		// no workers to share with: do it all ourselves
+		bool ok = true;
+		for( int i = 0 ; i < nTasks && ok ; ++i ){
+			ok = (*task)(context, i, worker);
+		}
+		return ok;
+	}
+}
+
+buffer_arena *parallelProcessorArena(FileProcessor *worker)
+{
+	return (worker)? worker->bufferArena() : NULL;
+}
+
 bool changeParallelProcessorJobs(ParallelFileProcessor *p, const int n, const int r)
 {
 	if( p ){
@@ -575,6 +1246,27 @@ bool changeParallelProcessorJobs(ParallelFileProcessor *p, const int n, const in
 	return false;
 }
 
+bool setParallelProcessorAutoScaling(ParallelFileProcessor *p, bool enable)
+{
+	if( p ){
+		return p->setAutoScaling(enable);
+	}
+	return false;
+}
+
+bool startParallelProcessor(ParallelFileProcessor *p, bool sortBySize, size_t queueLimit)
+{
+	if( p ){
+		return p->start(sortBySize, queueLimit);
+	}
+	return false;
+}
+
+bool parallelProcessorIsStreaming(ParallelFileProcessor *p)
+{
+	return p && p->isStreaming();
+}
+
 int runParallelProcessor(ParallelFileProcessor *p)
 { int ret = -1;
 	if( p ){
@@ -20,6 +20,11 @@ class FileProcessor;
 
 #endif // __cplusplus
 
+struct buffer_arena;
+
+// the default number of files that can be queued while the workers process them during the scan
+#define PARALLEL_QUEUE_LIMIT	65536
+
 // =============== Functions exported to C code =============== //
 #ifdef __cplusplus
 extern "C" {
@@ -30,14 +35,55 @@ void releaseParallelProcessor(ParallelFileProcessor *p);
 bool addFileToParallelProcessor(ParallelFileProcessor *p, const char *inFile,
 								const struct stat *inFileInfo, struct folder_info *folderinfo,
 								const bool ownInfo);
+// the number of files queued so far
 size_t filesInParallelProcessor(ParallelFileProcessor *p);
 bool sortFilesInParallelProcessorBySize(ParallelFileProcessor *p);
-// attempt to lock the ioLock; returns a success value that should be passed to unLockParallelProcessorIO()
+// sort the items by estimated processing time and have all workers take the costliest one left,
+// so that the workers finish at about the same time. Overrides the reverse job count.
+bool sortFilesInParallelProcessorByCost(ParallelFileProcessor *p);
+// set the number of workers that can read or write files on the same device at the same time
+// (default 1), or 0 to have a single worker on spinning disks and as many as the device
+// queues on solid state devices. Must be called before any file is processed.
+bool setParallelProcessorIOWidth(ParallelFileProcessor *p, int width);
+// pin the workers to the CPUs in <cpuList> ("0-7,16-23"; NULL or "" for all the CPUs we may run on),
+// placing consecutive workers on different NUMA nodes. Their buffers are allocated on their node.
+// Must be called before starting the workers; returns false when pinning isn't possible.
+bool setParallelProcessorCPUPlacement(ParallelFileProcessor *p, const char *cpuList);
+// limit the memory the files being processed take together to <budget> bytes (0: no limit), as
+// estimated from their sizes. Workers set a file that doesn't fit aside to take a smaller one, or
+// wait for memory to be released. Must be called before starting the workers.
+bool setParallelProcessorMemoryBudget(ParallelFileProcessor *p, long long budget);
+// take one of the I/O tokens for the device holding the worker's current file, waiting
+// until one is available; returns a success value that should be passed to unLockParallelProcessorIO()
 bool lockParallelProcessorIO(FileProcessor *worker);
-// unlock the ioLock if it was previously locked by a call to lockParallelProcessorIO()
+// return the I/O token if it was previously taken by a call to lockParallelProcessorIO()
 bool unLockParallelProcessorIO(FileProcessor *worker);
 int currentParallelProcessorID(FileProcessor *worker);
+// the number of worker threads in the processor <worker> belongs to
+int parallelProcessorJobs(FileProcessor *worker);
+// a function executing task number <task> of a group of chunk tasks, on behalf of
+// <executor> which is not necessarily the worker that posted the group.
+// Returns false on failure, which cancels the tasks from the group that haven't been started.
+typedef bool (*ParallelChunkTask)(void *context, int task, FileProcessor *executor);
+// run <nTasks> chunk tasks, sharing them with the other workers as soon as those
+// are idle or between files. The calling worker participates and the function returns
+// when all tasks have completed, with true when none of them failed.
+bool runParallelChunkTasks(FileProcessor *worker, int nTasks, ParallelChunkTask task, void *context);
+// the buffer arena owned by <worker>, for use from that worker's thread only
+struct buffer_arena *parallelProcessorArena(FileProcessor *worker);
 bool changeParallelProcessorJobs(ParallelFileProcessor *p, const int n, const int r);
+// let the number of active workers follow the measured throughput, between 1 and the number
+// of jobs; the others are parked. Must be called before starting the workers.
+bool setParallelProcessorAutoScaling(ParallelFileProcessor *p, bool enable);
+// start the workers before the files are added, so they process the files while the
+// scan for them is still running. Files are queued in a window of at most <queueLimit>
+// entries, which is ordered by size when <sortBySize> is set. Adding a file blocks while
+// the window is full. The names of all files added are still kept until runParallelProcessor(),
+// to weed out duplicates. Cannot be combined with sortFilesInParallelProcessorByCost().
+bool startParallelProcessor(ParallelFileProcessor *p, bool sortBySize, size_t queueLimit);
+// whether the workers are running while files are still being added
+bool parallelProcessorIsStreaming(ParallelFileProcessor *p);
+// process the queued files, after starting the workers if startParallelProcessor() didn't already.
 int runParallelProcessor(ParallelFileProcessor *p);
 void stopParallelProcessor(ParallelFileProcessor *p);
 struct folder_info *getParallelProcessorJobInfo(ParallelFileProcessor *p);
@@ -9,9 +9,14 @@
 #ifndef _PARALLELPROCESS_P_H
 
 #include "fsctool.h"
+#include "ParallelProcess.h"
+#include "utils.h"
 
+#include <algorithm>
 #include <deque>
+#include <map>
 #include <string>
+#include <vector>
 
 #include <sparsehash/dense_hash_map>
 
@@ -24,6 +29,10 @@
 #include <mach/thread_info.h>
 #endif
 
+// The items are collected before processing starts and are then claimed without locking:
+// each worker takes a batch from the front (or the rear) of the unclaimed part of the list
+// and works through it, while idle workers steal from the other end of those batches.
+// Item indices are limited to 32 bits.
 template <typename T>
 class ParallelProcessor
 {
@@ -39,6 +48,10 @@ public:
 		listLock = new CRITSECTLOCK(4000);
 		threadLock = new CRITSECTLOCK(4000);
 		quitRequestedFlag = false;
+		claimRange = 0;
+		maxClaimBatch = MAX_CLAIM_BATCH;
+		claimConflicts = 0;
+		claimsStolen = 0;
 		itemMapForName.set_empty_key(std::string());
 		// pick a file that can't be compressed as the deleted key
 		itemMapForName.set_deleted_key("/dev/null");
@@ -48,10 +61,11 @@ public:
 	{
 		if( !itemList.empty() ){
 		 CRITSECTLOCK::Scope scope(listLock, 2500);
-			fprintf( stderr, "~ParallelProcessor(%p): clearing itemList[%lu]\n", this, itemList.size() );
-			while( !itemList.empty() ){
-				itemList.pop_front();
+		 size_t unclaimed = unclaimedItems();
+			if( unclaimed ){
+				fprintf( stderr, "~ParallelProcessor(%p): clearing itemList[%lu]\n", this, unclaimed );
 			}
+			itemList.clear();
 		}
 		delete listLock;
 		delete threadLock;
@@ -83,34 +97,44 @@ public:
 		return itemList.size();
 	}
 
-	bool getFront(T &value)
-	{ bool ret = false;
-	  bool wasLocked = listLock->IsLocked();
-		CRITSECTLOCK::Scope scope(listLock);
-		if( wasLocked ){
-			listLock->lockCounter += 1;
-		}
-		if( !itemList.empty() ){
-			value = itemList.front();
-			itemList.pop_front();
-			ret = true;
-		}
-		return ret;
+	// prepare the lock-free claiming of the items by up to <nSlots> workers, which then
+	// set the direction of their slot. The itemList cannot be modified after this.
+	void startClaiming(int nSlots)
+	{
+		claimSlots.assign(nSlots, ClaimSlot());
+		claimBatchDivider = 8 * nSlots;
+		claimRange = packRange(0, itemList.size());
 	}
 
-	bool getBack(T &value)
-	{ bool ret = false;
-	  bool wasLocked = listLock->IsLocked();
-		CRITSECTLOCK::Scope scope(listLock);
-		if( wasLocked ){
-			listLock->lockCounter += 1;
+	// claim an item for the worker using slot <slot>: the next one from its own batch,
+	// the first of a new batch or one stolen from another worker. The items are handed out
+	// in place; returns NULL when there is nothing left.
+	T *claimItem(int slot, bool fromRear)
+	{ size_t first, n;
+	  ClaimSlot &own = claimSlots[slot];
+		if( takeFromRange(own.range, fromRear, 1, first) ){
+			return &itemList[first];
 		}
-		if( !itemList.empty() ){
-			value = itemList.back();
-			itemList.pop_back();
-			ret = true;
+		// the batches shrink as the list empties so that everyone gets a share of the last items
+		const unsigned long long shared = claimRange;
+		n = (rangeHigh(shared) > rangeLow(shared))? (rangeHigh(shared) - rangeLow(shared)) / claimBatchDivider : 0;
+		if( (n = takeFromRange(claimRange, fromRear, std::min(std::max(n, size_t(1)), maxClaimBatch), first)) ){
+			// our own range is empty, so thieves can't be updating it; keep all but the
+			// item we process now where they can steal it.
+			if( n > 1 ){
+				own.range = fromRear ? packRange(first, first + n - 1) : packRange(first + 1, first + n);
+			}
+			return &itemList[fromRear ? first + n - 1 : first];
 		}
-		return ret;
+		// steal from the end of another worker's batch that its owner will get to last
+		for( size_t i = 1 ; i < claimSlots.size() ; ++i ){
+		 ClaimSlot &victim = claimSlots[(slot + i) % claimSlots.size()];
+			if( takeFromRange(victim.range, !victim.fromRear, 1, first) ){
+				__sync_fetch_and_add(&claimsStolen, 1);
+				return &itemList[first];
+			}
+		}
+		return NULL;
 	}
 
 	bool quitRequested()
@@ -129,12 +153,90 @@ public:
 		return listLock->lockCounter;
 	}
 
+	// the number of times a worker had to retry claiming an item
+	inline unsigned long claimConflictCount() const
+	{
+		return claimConflicts;
+	}
+
+	inline unsigned long stolenItemCount() const
+	{
+		return claimsStolen;
+	}
+
 protected:
+	// the largest number of items a worker claims at once
+	enum { MAX_CLAIM_BATCH = 64 };
+	// a range [low,high) of itemList indices packed into a single word,
+	// so that either end can be claimed with a single compare-and-swap
+	static inline unsigned long long packRange(size_t low, size_t high)
+	{
+		return ((unsigned long long) high << 32) | (unsigned long long) low;
+	}
+	static inline size_t rangeLow(unsigned long long range)
+	{
+		return size_t(range & 0xffffffffULL);
+	}
+	static inline size_t rangeHigh(unsigned long long range)
+	{
+		return size_t(range >> 32);
+	}
+	// take up to <n> items from the front or the rear of <range>; returns the number
+	// taken, <first> being the lowest index among them.
+	size_t takeFromRange(volatile unsigned long long &range, bool fromRear, size_t n, size_t &first)
+	{ unsigned long long current = range;
+		for( ;; ){
+		 const size_t low = rangeLow(current), high = rangeHigh(current);
+			if( low >= high ){
+				return 0;
+			}
+		 const size_t taken = std::min(n, high - low);
+		 const unsigned long long next = fromRear ? packRange(low, high - taken) : packRange(low + taken, high);
+		 const unsigned long long seen = __sync_val_compare_and_swap(&range, current, next);
+			if( seen == current ){
+				first = fromRear ? high - taken : low;
+				return taken;
+			}
+			__sync_fetch_and_add(&claimConflicts, 1);
+			current = seen;
+		}
+	}
+	// the number of items that haven't been claimed yet
+	size_t unclaimedItems() const
+	{
+		if( claimSlots.empty() ){
+			return itemList.size();
+		}
+	 size_t n = rangeHigh(claimRange) - rangeLow(claimRange);
+		for( const auto &slot : claimSlots ){
+			n += rangeHigh(slot.range) - rangeLow(slot.range);
+		}
+		return n;
+	}
+
+	// the batch of items a worker claimed, which the owner works through from
+	// its end of the list and the others steal from the opposite end.
+	// Padded so that the slots of different workers don't share a cache line.
+	struct ClaimSlot {
+		volatile unsigned long long range;
+		bool fromRear;
+		char padding[64 - sizeof(unsigned long long) - sizeof(bool)];
+		ClaimSlot()
+			: range(0)
+			, fromRear(false)
+		{}
+	};
+
 	ItemQueue itemList;
 	CRITSECTLOCK *listLock;
 	CRITSECTLOCK *threadLock;
 	bool quitRequestedFlag;
 	NameToItemMap itemMapForName;
+	// the part of itemList that hasn't been handed out in batches yet
+	volatile unsigned long long claimRange;
+	std::vector<ClaimSlot> claimSlots;
+	size_t claimBatchDivider, maxClaimBatch;
+	volatile unsigned long claimConflicts, claimsStolen;
 };
 
 typedef struct folder_info FolderInfo;
@@ -184,6 +286,51 @@ protected:
 
 typedef google::dense_hash_map<std::string,iZFSDataSetCompressionInfo*> iZFSDataSetCompressionInfoForName;
 
+// the I/O tokens of a device, or of a group of devices sharing the same disks (a ZFS pool).
+// A worker holds one while it reads or writes a file on the device, so that at most <width>
+// workers do I/O on it at any time while the other devices remain available.
+class IODevice
+{
+public:
+	IODevice(const std::string &name, int width)
+		: name(name)
+		, width(width)
+		, contention(0)
+		, available(width)
+	{
+		tokenReturned = CreateEvent( NULL, false, false, NULL );
+	}
+	~IODevice()
+	{
+		CloseHandle(tokenReturned);
+	}
+	// take a token, waiting for one to be returned if necessary
+	void acquire();
+	void release();
+
+	const std::string name;
+	const int width;
+	// the number of times a worker had to wait for a token
+	volatile long contention;
+protected:
+	volatile long available;
+	// signalled when a token is returned, for one of the waiting workers
+	HANDLE tokenReturned;
+};
+
+// a group of tasks posted by a worker that splits up the compression of a large file.
+// Lives on the stack of the posting worker until all its tasks have completed.
+typedef struct ChunkTaskGroup {
+	ParallelChunkTask task;
+	void *context;
+	FileProcessor *owner;
+	long nTasks;
+	// the next task to start; only accessed with the taskLock held
+	long nextTask;
+	volatile long nDone;
+	volatile bool failed;
+} ChunkTaskGroup;
+
 class ParallelFileProcessor : public ParallelProcessor<FileEntry>
 {
 	typedef std::deque<FileProcessor*> PoolType;
@@ -192,17 +339,48 @@ public:
 	ParallelFileProcessor(int n=1, int r=0, int verboseLevel=0);
 	virtual ~ParallelFileProcessor();
 
-	// attempt to lock the ioLock; returns a success value
-	bool lockIO();
-	// unlock the ioLock
-	bool unLockIO();
+	// the I/O tokens for the files on device <dev>; created with the configured width
+	// the first time a file on the device is processed
+	IODevice *ioDevice(dev_t dev);
+	// have the files on device <dev> share the tokens of <group>, e.g. the ZFS pool
+	// the device belongs to. Must be done before any of those files are processed.
+	void setIODeviceGroup(dev_t dev, const std::string &group);
+	// set the number of workers that can do I/O on each device at the same time,
+	// or 0 to choose it per device from the device type
+	bool setIOWidth(int width);
+	// pin the workers to the CPUs in <cpuList> (all the CPUs we may run on when NULL or empty),
+	// spreading them over the NUMA nodes. Returns false if that's not possible.
+	bool setCPUPlacement(const char *cpuList);
+	// limit the memory the items being processed may take together to <budget> bytes
+	// (0: no limit). Can only be done before the workers are started.
+	bool setMemoryBudget(long long budget);
 
 	// change the number of jobs. Can only be done before calling run()
 	bool setJobs(int n, int r);
 
-	// spawn the requested number of worker threads and let them
-	// empty the queue. After spawning the workers, run() waits
-	// on allDoneEvent before exiting.
+	// spawn the worker threads before the items are known, for them to process the items as
+	// they are added. Items are queued in a window of at most <limit> items that is ordered
+	// by file size when <sortBySize> is set, in the order they were added otherwise;
+	// adding an item blocks while the window is full.
+	bool start(bool sortBySize, size_t limit);
+	// queue <entry>, into the window when the workers have been started
+	bool addItem(const FileEntry &entry);
+	// let the number of active workers follow the measured throughput, between 1 and
+	// the number of jobs. Can only be done before calling start() or run().
+	bool setAutoScaling(bool enable);
+
+	// the number of items queued so far
+	inline size_t queuedItems() const
+	{
+		return nQueued;
+	}
+	inline bool isStreaming() const
+	{
+		return streaming;
+	}
+
+	// spawn the requested number of worker threads, unless start() did already,
+	// and let them empty the queue. After that, run() waits on allDoneEvent before exiting.
 	int run();
 
 	inline int verbose() const
@@ -210,6 +388,35 @@ public:
 		return verboseLevel;
 	}
 
+	inline int jobs() const
+	{
+		return nJobs;
+	}
+
+	// the next item for <worker> to process, from the window or from the item list.
+	// <owned> is set when the caller has to delete the item when done.
+	FileEntry *nextItem(FileProcessor *worker, bool &owned);
+
+	// sort the items by their estimated processing time and have all workers take the
+	// costliest remaining item (longest-processing-time-first scheduling).
+	bool sortByCost();
+	// the estimated processing time of <entry>, in seconds
+	static double estimatedCost(const FileEntry &entry);
+	// the estimated memory needed to process <entry>, in bytes
+	static long long memoryReservation(const FileEntry &entry);
+	// reserve <amount> bytes of the memory budget, waiting for other items to release
+	// enough of it when <wait> is set. An item is always admitted when nothing is reserved,
+	// even if it needs more than the budget. Returns false if the memory isn't available
+	// (or the processor is asked to quit while waiting).
+	bool reserveMemory(long long amount, bool wait);
+	void releaseMemory(long long amount);
+
+	// post a group of chunk tasks and help executing them; returns when all tasks have completed.
+	bool runChunkTasks(FileProcessor *worker, ChunkTaskGroup &group);
+	// start one of the pending chunk tasks on behalf of <executor>, if there is any.
+	// Returns false if there was nothing to do.
+	bool runPendingChunkTask(FileProcessor *executor);
+
 	// lookup the ZFS dataset info for file <name>.
 	iZFSDataSetCompressionInfo *z_dataSetForFile(const std::string &fileName);
 	// lookup the ZFS dataset info for file <name>
@@ -225,6 +432,12 @@ public:
 
 	FolderInfo jobInfo;
 protected:
+	// create the worker threads and start them
+	void spawnWorkers();
+	// measure the throughput since the previous call and park or unpark a worker accordingly
+	void adjustActiveWorkers(double now);
+	// whether all queued items have been handed out
+	bool queueDrained();
 	int workerDone(FileProcessor *worker);
 	// the number of configured or active worker threads
 	volatile long nJobs;
@@ -238,10 +451,58 @@ protected:
 	PoolType threadPool;
 	// the event that signals that all work has been done
 	HANDLE allDoneEvent;
+	// the I/O tokens per device and per name, and the lock protecting the maps
+	std::map<dev_t,IODevice*> ioDeviceForDev;
+	std::map<std::string,IODevice*> ioDeviceForName;
+	std::map<dev_t,std::string> ioGroupForDev;
 	CRITSECTLOCK *ioLock;
-	bool ioLockedFlag;
-	DWORD ioLockingThread;
+	int ioWidth;
+	// the CPUs the workers are pinned to, in order of worker ID (wrapping around), and their nodes
+	enum { CPU_PLACEMENT_MAX = 4096 };
+	std::vector<int> placementCPUs, placementNodes;
+	// the in-flight memory budget (0: none), the memory reserved by the items being processed
+	// and its peak, and how often a worker waited for memory or set an item aside for a smaller one
+	long long memoryBudget;
+	volatile long long memoryReserved, memoryPeak;
+	volatile long memoryWaits, memoryDeferrals;
+	HANDLE memoryReleasedEvent;
+	// the number of items a worker may take instead of the one it set aside
+	enum { MEMORY_DEFER_LIMIT = 16 };
+	// the chunk task groups that still have tasks to be started, and their lock
+	std::deque<ChunkTaskGroup*> chunkTaskGroups;
+	CRITSECTLOCK *taskLock;
+	// set as long as there are chunk tasks to be started
+	HANDLE chunkTaskEvent;
+	// signalled each time a chunk task completes
+	HANDLE chunkTaskDoneEvent;
+	volatile long nChunkTaskGroups;
 	int verboseLevel;
+	// the items are sorted by estimated cost and handed out costliest first
+	bool costScheduling;
+	// the makespan and the total work the cost model predicts for the run, in seconds
+	double predictedMakespan, estimatedWork;
+	// set while items are added to the window, with the workers running (start())
+	volatile bool streaming;
+	// the window of items queued while streaming, ordered on their size or on the order in which
+	// they were added, and the largest number of items it can hold. Protected by the listLock.
+	std::multimap<double,FileEntry*> itemWindow;
+	volatile long windowCount;
+	size_t windowLimit;
+	bool windowBySize;
+	// signalled when an item is added to, respectively taken from the window
+	HANDLE itemAddedEvent, itemTakenEvent;
+	size_t nQueued;
+	double startTime;
+	// protects the ZFS dataset maps, which the workers consult while files are still being added
+	CRITSECTLOCK *dataSetLock;
+	bool autoScaling;
+	// workers with a higher ID park once they're done with their current item
+	volatile long activeWorkers;
+	// the autoscaler state: the previous measurement, the direction of the last change
+	// and the range of active workers used so far
+	double scaleTime, scaleWork, scaleCPUTime, scaleThroughput;
+	int scaleDirection;
+	long minActiveWorkers, maxActiveWorkers, nScaleChanges;
 
 	// a dataset name -> info map
 	iZFSDataSetCompressionInfoForName z_dataSetInfo;
@@ -261,18 +522,30 @@ public:
 		, runningTotalRaw(0)
 		, runningTotalCompressed(0)
 		, avCPUUsage(0.0)
+		, nChunkTasks(0)
+		, finishTime(0)
+		, workDone(0)
 		, cleanedUp(false)
 		, isBackwards(isReverse)
 		, procID(procID)
-		, scope(NULL)
+		, ioDevice(NULL)
+		, ioDeviceID(0)
+		, ioLocked(false)
+		, cpu(-1)
+		, node(-1)
 		, currentEntry(NULL)
-	{}
+	{
+		initBufferArena(&arena, BUFFER_ARENA_MAX_RETAINED);
+		unparkEvent = CreateEvent( NULL, false, false, NULL );
+	}
 	~FileProcessor()
     {
 		// better be safe than sorry
 		CleanupThread();
+		CloseHandle(unparkEvent);
+		releaseBufferArena(&arena);
 		PP = NULL;
-		scope = NULL;
+		ioDevice = NULL;
 		currentEntry = NULL;
     }
 	bool lockScope();
@@ -292,6 +565,11 @@ public:
 	{
 		return PP;
 	}
+
+	inline buffer_arena *bufferArena()
+	{
+		return &arena;
+	}
 protected:
 	DWORD Run(LPVOID arg);
 	void InitThread();
@@ -308,10 +586,26 @@ protected:
 	volatile long nProcessed;
 	volatile long long runningTotalRaw, runningTotalCompressed;
 	volatile double avCPUUsage, userTime, systemTime;
+	// the number of chunk tasks executed on behalf of other workers
+	volatile long nChunkTasks;
+	// when the worker ran out of items
+	double finishTime;
+	// the estimated cost of the items processed, in seconds (see estimatedCost())
+	volatile double workDone;
+	// signalled when the autoscaler activates this worker while it is parked
+	HANDLE unparkEvent;
+	// the buffers this worker reuses from one file to the next
+	buffer_arena arena;
 	bool cleanedUp;
 	const bool isBackwards;
 	const int procID;
-	CRITSECTLOCK::Scope *scope;
+	// the I/O tokens of the device of the current item (kept for the next item on the same
+	// device), and whether this worker holds one of them
+	IODevice *ioDevice;
+	dev_t ioDeviceID;
+	bool ioLocked;
+	// the CPU this worker is pinned to and its NUMA node, or -1
+	int cpu, node;
 	bool hasInfo;
 #ifdef __MACH__
 	thread_basic_info_data_t threadInfo;
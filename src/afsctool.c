@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <signal.h>
+#include <time.h>
 
 #include <zlib.h>
 #ifdef HAS_LZVN
@@ -68,6 +69,8 @@
 #endif
 #include "afsctool_fullversion.h"
 #include "utils.h"
+#include "codecs.h"
+#include "blobcache.h"
 
 #define xfree(x)		if((x)){free((x)); (x)=NULL;}
 #define xclose(x)		if((x)!=-1){close((x)); (x)=-1;}
@@ -100,6 +103,15 @@ const long long int sizeunit2[sizeunits] = {1024, 1024 * 1024, 1024 * 1024 * 102
 	(long long int) 1024 * 1024 * 1024 * 1024 * 1024, (long long int) 1024 * 1024 * 1024 * 1024 * 1024 * 1024};
 
 static long long num_skipped = 0;
+// files rejected for insufficient savings by the sampling prefilter or while being compressed,
+// and the estimated CPU time (in microseconds) that saved. Updated atomically.
+static long long num_prefiltered = 0, num_aborted = 0, prefilterSavedUSec = 0, abortSavedUSec = 0;
+// files skipped because they look incompressible
+static long long num_incompressible = 0;
+// chunks that didn't need to be stored because they're identical to another chunk of the same file
+static long long num_shared_chunks = 0;
+// files whose compressed image was taken from the cache, and the CPU time (in microseconds) that saved
+static long long num_cache_hits = 0, cacheSavedUSec = 0;
 int printVerbose = 0;
 static size_t maxOutBufSize = 0;
 void printFileInfo(const char *filepath, struct stat *fileinfo, bool appliedcomp, bool onAPFS);
@@ -238,6 +250,7 @@ bool fileIsCompressable(const char *inFile, struct stat *inFileInfo, int comptyp
 		return false;
 	}
 #endif
+#endif // APPLE
 #ifdef HAS_LZVN
 	// the LZVN compressor we use fails on buffers that are too small, so we need to verify
 	// if the file gets to be split into chunks that are all large enough.
@@ -252,6 +265,7 @@ bool fileIsCompressable(const char *inFile, struct stat *inFileInfo, int comptyp
 		}
 	}
 #endif
+#ifdef __APPLE__
 #ifdef VOL_CAP_FMT_DECMPFS_COMPRESSION
 	// https://opensource.apple.com/source/copyfile/copyfile-146/copyfile.c.auto.html
 	int rv;
@@ -341,6 +355,504 @@ const char *compressionTypeName(int type)
 	return name;
 }
 
+// 64Kb block size (HFS compression is "64K chunked")
+static const int compblksize = DECMPFS_CHUNK_SIZE;
+#ifdef SUPPORT_PARALLEL
+// the number of chunks compressed by a single parallel chunk task
+#	define CHUNK_TASK_BLOCKS	32
+#endif
+
+// the buffer arena used when not running as a worker thread
+static buffer_arena serialArena = {.maxRetained = BUFFER_ARENA_MAX_RETAINED};
+
+// the compressibility prefilter (see chooseSampleChunks()) rejects files when the
+// sampled savings are less than this fraction of the required savings
+#define PREFILTER_CONFIDENCE	0.5
+
+// the CPU time used by the calling thread, in seconds
+static double threadCPUTime()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != -1) {
+		return ts.tv_sec + ts.tv_nsec * 1e-9;
+	}
+#endif
+	return (double) clock() / CLOCKS_PER_SEC;
+}
+
+#ifdef SUPPORT_PARALLEL
+/**
+ * a file's chunks, compressed in ranges of CHUNK_TASK_BLOCKS by parallel chunk tasks.
+ */
+typedef struct chunk_task_job {
+	const char *inFile;
+	const void *inBuf;
+	off_t filesize;
+	unsigned int numBlocks;
+	int comptype, compressionlevel;
+	bool allowLargeBlocks;
+	// the compressed chunks of each range, for up to nRanges ranges
+	chunk_range_result *results;
+	unsigned int nRanges;
+	// the compressed size of each chunk
+	unsigned long *chunkSizes;
+	// the tasks give up once the compressed chunks add up to sizeLimit bytes (0 = no limit),
+	// setting <aborted>. Updated atomically: the total compressed size, the number of chunks
+	// compressed and the CPU time spent on them (in microseconds), over all runs of the job.
+	size_t sizeLimit;
+	volatile bool aborted;
+	size_t compressedSize;
+	unsigned int processedBlocks;
+	long long cpuUSec;
+} chunk_task_job;
+
+static void freeChunkTaskJob(chunk_task_job *job)
+{
+	if (job) {
+		if (job->results) {
+			unsigned int i;
+			for (i = 0 ; i < job->nRanges ; ++i) {
+				xfree(job->results[i].buf);
+			}
+			free(job->results);
+		}
+		xfree(job->chunkSizes);
+		free(job);
+	}
+}
+
+static chunk_task_job *createChunkTaskJob(const char *inFile, const void *inBuf, off_t filesize, unsigned int numBlocks,
+										  int comptype, int compressionlevel, bool allowLargeBlocks)
+{
+	unsigned int nTasks = (numBlocks + CHUNK_TASK_BLOCKS - 1) / CHUNK_TASK_BLOCKS;
+	chunk_task_job *job = calloc(1, sizeof(chunk_task_job));
+	if (job) {
+		job->inFile = inFile;
+		job->inBuf = inBuf;
+		job->filesize = filesize;
+		job->numBlocks = numBlocks;
+		job->comptype = comptype;
+		job->compressionlevel = compressionlevel;
+		job->allowLargeBlocks = allowLargeBlocks;
+		job->results = calloc(nTasks, sizeof(chunk_range_result));
+		job->nRanges = nTasks;
+		job->chunkSizes = calloc(numBlocks, sizeof(unsigned long));
+		if (!job->results || !job->chunkSizes) {
+			freeChunkTaskJob(job);
+			job = NULL;
+		}
+	}
+	if (!job) {
+		fprintf(stderr, "%s: malloc error, unable to allocate the chunk tasks for %u chunks (%s)\n",
+				inFile, numBlocks, strerror(errno));
+	}
+	return job;
+}
+
+/**
+ * ParallelChunkTask compressing the <task>th range of chunks of a chunk_task_job.
+ */
+static bool compressChunkRange(void *context, int task, FileProcessor *executor)
+{
+	chunk_task_job *job = (chunk_task_job*) context;
+	chunk_range_result *result = &job->results[task];
+	unsigned int blockNr = task * CHUNK_TASK_BLOCKS, lastBlock = blockNr + CHUNK_TASK_BLOCKS;
+	chunk_compressor compressor;
+	bool ok = true;
+	double startTime = threadCPUTime();
+
+	if (job->aborted) {
+		return false;
+	}
+	if (lastBlock > job->numBlocks) {
+		lastBlock = job->numBlocks;
+	}
+	if (!initChunkCompressor(&compressor, job->inFile, parallelProcessorArena(executor),
+							 job->comptype, job->compressionlevel, job->allowLargeBlocks)) {
+		return false;
+	}
+	// start with room for the range compressed 2:1 and grow geometrically as required.
+	// The buffer is reused when the job is run again (on the next window of a streamed file).
+	if (result->capacity < (lastBlock - blockNr) * compblksize / 2) {
+		result->capacity = (lastBlock - blockNr) * compblksize / 2;
+		xfree(result->buf);
+	}
+	result->size = 0;
+	for ( ; ok && blockNr < lastBlock ; ++blockNr) {
+		off_t inBufPos = (off_t) blockNr * compblksize;
+		uLong len = ((job->filesize - inBufPos) > compblksize) ? compblksize : job->filesize - inBufPos;
+		unsigned long cmpedsize;
+		if ((ok = compressChunk(&compressor, job->inBuf + inBufPos, len, blockNr, job->numBlocks, &cmpedsize))) {
+			if (!result->buf || result->size + cmpedsize > result->capacity) {
+				while (result->size + cmpedsize > result->capacity) {
+					result->capacity *= 2;
+				}
+				if (!(result->buf = reallocf(result->buf, result->capacity))) {
+					fprintf(stderr, "%s: malloc error, unable to increase chunk task buffer to %lu bytes (%s)\n",
+							job->inFile, (unsigned long) result->capacity, strerror(errno));
+					result->capacity = 0;
+					ok = false;
+					break;
+				}
+			}
+			memcpy(result->buf + result->size, compressor.outBufBlock, cmpedsize);
+			result->size += cmpedsize;
+			job->chunkSizes[blockNr] = cmpedsize;
+			__sync_fetch_and_add(&job->processedBlocks, 1);
+			if (job->sizeLimit && __sync_add_and_fetch(&job->compressedSize, cmpedsize) >= job->sizeLimit) {
+				// the file can no longer give the required savings
+				job->aborted = true;
+				ok = false;
+			}
+		}
+	}
+	releaseChunkCompressor(&compressor);
+	__sync_fetch_and_add(&job->cpuUSec, (long long) ((threadCPUTime() - startTime) * 1e6));
+	return ok;
+}
+#endif
+
+/**
+ * a compressed image checked against the data it was built from before it is written, by
+ * decoding it in memory in ranges of CHUNK_TASK_BLOCKS chunks (possibly by parallel chunk tasks).
+ */
+typedef struct image_check_job {
+	const char *inFile;
+	const compressed_image *image;
+	int comptype;
+	off_t filesize;
+	unsigned int numBlocks;
+	// the original data, or for a streamed file the checksums of its chunks
+	const void *inBuf;
+	const UInt64 *checksums;
+	// the first chunk found to differ, numBlocks if none did
+	volatile unsigned int badBlock;
+} image_check_job;
+
+static bool checkImageRange(image_check_job *job, unsigned int task, buffer_arena *arena)
+{
+	unsigned int first = task * CHUNK_TASK_BLOCKS, last = MIN(first + CHUNK_TASK_BLOCKS, job->numBlocks), bad;
+	void *chunkBuf = arenaBuffer(arena, ARENA_CHUNK, compblksize);
+
+	if (!chunkBuf) {
+		fprintf(stderr, "%s: malloc error, unable to allocate the verification buffer (%s)\n",
+				job->inFile, strerror(errno));
+		return false;
+	}
+	bad = checkImageChunks(job->image, job->comptype, job->filesize, job->inBuf, job->checksums, first, last, chunkBuf, arena);
+	if (bad < last) {
+		__sync_val_compare_and_swap(&job->badBlock, job->numBlocks, bad);
+		return false;
+	}
+	return true;
+}
+
+#ifdef SUPPORT_PARALLEL
+// ParallelChunkTask checking the <task>th range of chunks of an image_check_job.
+static bool checkImageTask(void *context, int task, FileProcessor *executor)
+{
+	return checkImageRange((image_check_job*) context, task, (executor)? parallelProcessorArena(executor) : &serialArena);
+}
+#endif
+
+#ifdef __APPLE__
+/**
+ * write the original content of a streamed file back to <fd>: copy it from the backup
+ * if there is one, or else decode the compressed image.
+ */
+static bool restoreStreamedFile(const char *inFile, int fd, const char *backupName,
+								const compressed_image *image, int comptype)
+{
+	if (backupName) {
+		int backupFd = open(backupName, O_RDONLY);
+		char *buf = malloc(compblksize);
+		ssize_t n = -1;
+		if (backupFd != -1 && buf) {
+			while ((n = read(backupFd, buf, compblksize)) > 0) {
+				if (write(fd, buf, n) != n) {
+					n = -1;
+					break;
+				}
+			}
+		}
+		xclose(backupFd);
+		xfree(buf);
+		if (n == 0) {
+			return true;
+		}
+		fprintf(stderr, "%s: Error restoring file from backup %s (%s); decoding the compressed data instead\n",
+				inFile, backupName, strerror(errno));
+		if (lseek(fd, 0, SEEK_SET) != 0 || ftruncate(fd, 0) != 0) {
+			return false;
+		}
+	}
+	return writeDecodedImage(image, comptype, fd, inFile);
+}
+#endif
+
+// a sample of a file's chunks, read into the ARENA_SAMPLE buffer
+typedef struct file_sample {
+	char *data;
+	unsigned int numBlocks, blockNr[PREFILTER_SAMPLES];
+	uLong len[PREFILTER_SAMPLES];
+	// the number of sampled chunks that look incompressible
+	unsigned int incompressible;
+} file_sample;
+
+/**
+ * take a sample of a file's chunks: the first, the last and a few chosen at random in between.
+ * Returns false when no sample could be taken; errors are left to be reported by the full pass.
+ */
+static bool sampleFile(int fd, struct stat *inFileInfo, unsigned int numBlocks, buffer_arena *arena,
+					   file_sample *sample)
+{
+	const off_t filesize = inFileInfo->st_size;
+	unsigned int i;
+
+	sample->numBlocks = numBlocks;
+	sample->incompressible = 0;
+	if (!(sample->data = arenaBuffer(arena, ARENA_SAMPLE, PREFILTER_SAMPLES * compblksize))) {
+		return false;
+	}
+	// a reproducible choice of chunks for a given file
+	chooseSampleChunks(numBlocks, (unsigned int) (inFileInfo->st_ino ^ filesize), sample->blockNr);
+	for (i = 0 ; i < PREFILTER_SAMPLES ; ++i) {
+		off_t offset = (off_t) sample->blockNr[i] * compblksize;
+		sample->len[i] = ((filesize - offset) > compblksize) ? compblksize : filesize - offset;
+		if (pread(fd, sample->data + i * compblksize, sample->len[i], offset) != (ssize_t) sample->len[i]) {
+			return false;
+		}
+		if (chunkLooksIncompressible(sample->data + i * compblksize, sample->len[i])) {
+			sample->incompressible += 1;
+		}
+	}
+	return true;
+}
+
+/**
+ * predict the savings percentage compressing a file with the given settings will give by
+ * compressing a sample of it. The prediction is returned in <savings> (100 when no prediction
+ * could be made), together with the CPU time this took per sampled byte (<cpuPerByte>) and the
+ * number of sampled bytes (<sampledBytes>).
+ * Returns false if a sampled chunk cannot be compressed, which means the file cannot be either.
+ */
+static bool compressSample(const char *inFile, const file_sample *sample,
+						   int comptype, int compressionlevel, bool allowLargeBlocks, buffer_arena *arena,
+						   double *savings, double *cpuPerByte, off_t *sampledBytes)
+{
+	unsigned long sampledCompressed = 0;
+	chunk_compressor compressor;
+	double startTime = threadCPUTime();
+	bool ok = true;
+	unsigned int i;
+
+	*savings = 100;
+	*sampledBytes = 0;
+	*cpuPerByte = 0;
+	if (!initChunkCompressor(&compressor, inFile, arena, comptype, compressionlevel, allowLargeBlocks)) {
+		return true;
+	}
+	for (i = 0 ; i < PREFILTER_SAMPLES ; ++i) {
+		unsigned long cmpedsize;
+		if (!(ok = compressChunk(&compressor, sample->data + i * compblksize, sample->len[i],
+								 sample->blockNr[i], sample->numBlocks, &cmpedsize))) {
+			break;
+		}
+		*sampledBytes += sample->len[i];
+		sampledCompressed += cmpedsize;
+	}
+	releaseChunkCompressor(&compressor);
+	if (ok) {
+		*savings = (1.0 - (double) sampledCompressed / *sampledBytes) * 100.0;
+		*cpuPerByte = (threadCPUTime() - startTime) / *sampledBytes;
+	}
+	return ok;
+}
+
+// the settings the auto mode (-T auto) chooses from, in order of increasing cost
+static const struct compression_setting {
+	compression_type comptype;
+	int level;
+	const char *name;
+} autoSettings[] = {
+#ifdef HAS_LZVN
+	{LZVN, 0, "LZVN"},
+#endif
+	{ZLIB, 1, "ZLIB level 1"},
+#ifdef HAS_LZFSE
+	{LZFSE, 0, "LZFSE"},
+#endif
+	{ZLIB, 5, "ZLIB level 5"},
+	{ZLIB, 9, "ZLIB level 9"},
+};
+#define AUTO_SETTINGS	(sizeof(autoSettings) / sizeof(autoSettings[0]))
+// the auto mode only moves to a more expensive setting when it saves at least this much more (percent)
+#define AUTO_MIN_GAIN	1.0
+// files smaller than this many chunks use the setting chosen most often for their extension,
+// once it has been chosen for AUTO_CLASS_TRIALS sampled files
+#define AUTO_CLASS_BLOCKS	(16 * PREFILTER_SAMPLES)
+#define AUTO_CLASS_TRIALS	4
+// the default CPU budget of the auto mode, in seconds per Gb
+#define AUTO_DEFAULT_BUDGET	30.0
+
+static bool settingApplies(const struct compression_setting *setting, off_t filesize)
+{
+#ifdef HAS_LZVN
+	if (setting->comptype == LZVN) {
+		// see fileIsCompressable()
+		int lastChunkSize = filesize % compblksize;
+		return lastChunkSize == 0 || lastChunkSize >= LZVN_ENCODE_MIN_SRC_SIZE;
+	}
+#else
+	(void) setting;
+	(void) filesize;
+#endif
+	return true;
+}
+
+/**
+ * the auto mode: choose the compression type and level for a file. The sample (if any) is compressed
+ * with increasingly expensive settings for as long as that gains at least AUTO_MIN_GAIN percent savings
+ * without costing more than <cpuBudget> seconds per Gb. Files without a sample, or too small to justify
+ * the trials once enough of them have been done for files of the same extension, get the setting
+ * chosen most often for that extension. <savings>, <cpuPerByte> and <sampledBytes> return the
+ * prediction for the chosen setting (see compressSample()).
+ */
+static bool chooseCompression(const char *inFile, off_t filesize, const file_sample *sample,
+							  double cpuBudget, bool allowLargeBlocks, buffer_arena *arena,
+							  int *comptype, int *compressionlevel,
+							  double *savings, double *cpuPerByte, off_t *sampledBytes)
+{
+	const char *extension = strrchr(lbasename(inFile), '.');
+	const char *className = (extension) ? extension + 1 : "";
+	unsigned int tally, i;
+	int choice = classChoice(className, &tally);
+
+	*savings = 100;
+	*cpuPerByte = 0;
+	*sampledBytes = 0;
+	if (!sample || (sample->numBlocks < AUTO_CLASS_BLOCKS && tally >= AUTO_CLASS_TRIALS)) {
+		if (choice < 0 || !settingApplies(&autoSettings[choice], filesize)) {
+			// use the default, which applies to every file
+			return true;
+		}
+		*comptype = autoSettings[choice].comptype;
+		*compressionlevel = autoSettings[choice].level;
+		if (printVerbose > 1) {
+			fprintf(stderr, "%s: using %s like for other .%s files\n", inFile,
+					autoSettings[choice].name, className);
+		}
+		return true;
+	}
+	choice = -1;
+	for (i = 0 ; i < AUTO_SETTINGS ; ++i) {
+		double s, c;
+		off_t n;
+		if (!settingApplies(&autoSettings[i], filesize)) {
+			continue;
+		}
+		if (!compressSample(inFile, sample, autoSettings[i].comptype, autoSettings[i].level,
+							allowLargeBlocks, arena, &s, &c, &n)) {
+			return false;
+		}
+		if (choice >= 0 && (c * 1e9 > cpuBudget || s < *savings + AUTO_MIN_GAIN)) {
+			// not worth it, and the more expensive settings won't be either
+			break;
+		}
+		choice = i;
+		*savings = s;
+		*cpuPerByte = c;
+		*sampledBytes = n;
+	}
+	if (choice < 0) {
+		return true;
+	}
+	*comptype = autoSettings[choice].comptype;
+	*compressionlevel = autoSettings[choice].level;
+	tallyClassChoice(className, choice);
+	if (printVerbose > 1) {
+		fprintf(stderr, "%s: using %s (sampled savings %.1f%% at %.1fs CPU/Gb)\n", inFile,
+				autoSettings[choice].name, *savings, *cpuPerByte * 1e9);
+	}
+	return true;
+}
+
+/**
+ * account for a file whose compression was abandoned after <processedBlocks> chunks
+ * because it could no longer give the required savings; <cpuTime> is the time that took.
+ */
+static void abortedFile(const char *inFile, off_t filesize, unsigned int processedBlocks, double cpuTime)
+{
+	off_t processedBytes = (off_t) processedBlocks * compblksize;
+	if (processedBytes > filesize) {
+		processedBytes = filesize;
+	}
+	__sync_fetch_and_add(&num_aborted, 1);
+	if (processedBytes > 0) {
+		__sync_fetch_and_add(&abortSavedUSec, (long long) (cpuTime * (filesize - processedBytes) / processedBytes * 1e6));
+	}
+	if (printVerbose > 2) {
+		fprintf(stderr, "%s: abandoned after %lld of %lld bytes: cannot give the required savings\n",
+				inFile, (long long) processedBytes, (long long) filesize);
+	}
+}
+
+// what compressFile() needs to do with every window of a streamed file
+typedef struct stream_context {
+	// the backup file being written, or NULL
+	FILE *backup;
+#ifdef SUPPORT_PARALLEL
+	FileProcessor *worker;
+	// the chunk tasks compressing each window in parallel, or NULL
+	chunk_task_job *chunkJob;
+#endif
+	precompressed_chunks precompressed;
+} stream_context;
+
+static bool loadStreamWindow(chunk_stream *stream, unsigned int blockNr, const precompressed_chunks **precompressed)
+{
+	stream_context *context = (stream_context*) stream->context;
+	bool ok;
+#ifdef SUPPORT_PARALLEL
+	bool locked = false;
+	if (exclusive_io && context->worker) {
+		locked = lockParallelProcessorIO(context->worker);
+	}
+#endif
+	ok = readChunkWindow(stream, blockNr);
+#ifdef SUPPORT_PARALLEL
+	if (locked) {
+		unLockParallelProcessorIO(context->worker);
+	}
+#endif
+	if (!ok) {
+		return false;
+	}
+	if (context->backup && fwrite(stream->window, stream->windowLength, 1, context->backup) != 1) {
+		fprintf(stderr, "%s: Error writing to backup file (%lu bytes; %s)\n",
+				stream->inFile, (unsigned long) stream->windowLength, strerror(errno));
+		return false;
+	}
+#ifdef SUPPORT_PARALLEL
+	chunk_task_job *job = context->chunkJob;
+	if (job) {
+		job->inBuf = stream->window;
+		job->filesize = stream->windowLength;
+		job->numBlocks = stream->windowBlocks;
+		if (!runParallelChunkTasks(context->worker, (job->numBlocks + CHUNK_TASK_BLOCKS - 1) / CHUNK_TASK_BLOCKS,
+								   compressChunkRange, job)) {
+			return false;
+		}
+		context->precompressed.rangeBlocks = CHUNK_TASK_BLOCKS;
+		context->precompressed.ranges = job->results;
+		context->precompressed.chunkSizes = job->chunkSizes;
+		*precompressed = &context->precompressed;
+	}
+#endif
+	return true;
+}
+
 #ifdef SUPPORT_PARALLEL
 void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_info *folderinfo, FileProcessor *worker )
 #else
@@ -353,27 +865,38 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 	bool allowLargeBlocks = folderinfo->allowLargeBlocks;
 	double minSavings = folderinfo->minSavings;
 	bool checkFiles = folderinfo->check_files;
+	bool checkOnDisk = checkFiles && folderinfo->check_on_disk;
 	bool backupFile = folderinfo->backup_file;
 
 	BlockMutable int fdIn;
 	BlockMutable char *backupName = NULL;
 
-	// 64Kb block size (HFS compression is "64K chunked")
-	const int compblksize = 0x10000;
 	unsigned int numBlocks, outdecmpfsSize = 0;
-	void *inBuf = NULL, *outBuf = NULL, *outBufBlock = NULL, *outdecmpfsBuf = NULL, *currBlock = NULL, *blockStart = NULL;
-	long long int inBufPos;
+	void *inBuf = NULL, *outBuf = NULL, *outdecmpfsBuf = NULL;
 	off_t filesize = inFileInfo->st_size;
-	unsigned long int cmpedsize;
 	char *xattrnames, *curr_attr;
 	ssize_t xattrnamesize, outBufSize = 0;
-	UInt32 cmpf = DECMPFS_MAGIC, orig_mode;
+	UInt32 orig_mode;
 	struct timeval times[2];
-#if defined HAS_LZVN || defined HAS_LZFSE
-	void *lz_WorkSpace = NULL;
+	chunk_compressor compressor = {NULL};
+	BlockMutable compressed_image image = {NULL};
+	const precompressed_chunks *precompressedChunks = NULL;
+	// streaming mode: the file is read in windows, never as a whole (and inBuf remains NULL)
+	BlockMutable bool streaming = false;
+	chunk_stream stream = {NULL};
+	stream_context streamContext = {NULL};
+#ifdef SUPPORT_PARALLEL
+	buffer_arena *arena = (worker)? parallelProcessorArena(worker) : &serialArena;
+#else
+	buffer_arena *arena = &serialArena;
+#endif
+#ifdef SUPPORT_PARALLEL
+	chunk_task_job *chunkJob = NULL;
+	precompressed_chunks precompressed;
 #endif
-	bool supportsLargeBlocks;
-	bool useMmap = false;
+	bool useMmap = false, cacheHit = false;
+	// the checksums of the original data, to verify the rewritten file against
+	file_checksums checksums = {0};
 
 	if (quitRequested)
 	{
@@ -389,7 +912,15 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 	void restoreFile()
 #endif
 	{
-		if (write(fdIn, inBuf, filesize) != filesize) {
+		if (streaming) {
+			if (!restoreStreamedFile(inFile, fdIn, backupName, &image, comptype)) {
+				if (backupName) {
+					fprintf(stderr, "\ta backup is available as %s\n", backupName);
+					xfree(backupName);
+				}
+				xclose(fdIn);
+			}
+		} else if (write(fdIn, inBuf, filesize) != filesize) {
 			fprintf(stderr, "%s: Error restoring file (%lld bytes; %s)\n", inFile, filesize, strerror(errno));
 			if (backupName) {
 				fprintf(stderr, "\ta backup is available as %s\n", backupName);
@@ -476,10 +1007,16 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 	if ((filesize + 0x13A + (numBlocks * 9)) > CMP_MAX_SUPPORTED_SIZE) {
 		fprintf( stderr, "Skipping file %s with unsupportable size %lld\n", inFile, (long long) filesize );
 		return;
+	} else if (folderinfo->streamWindow > 0 && filesize > folderinfo->streamWindow) {
+		streaming = true;
 	} else if (filesize >= 64 * 1024 * 1024) {
 		// use a rather arbitrary threshold above which using mmap may be of interest
 		useMmap = true;
 	}
+	// files of a single chunk take a shorter path: they are read with a plain read() into the
+	// arena, for which madvise() would only add a system call, and they are compressed only
+	// once, the result going into the decmpfs attribute whenever it fits.
+	const bool smallFile = numBlocks == 1 && !streaming;
 
 #ifdef SUPPORT_PARALLEL
 	bool locked = false;
@@ -502,6 +1039,77 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 		num_skipped += 1;
 		goto bail;
 	}
+	if (numBlocks >= PREFILTER_MIN_BLOCKS || folderinfo->autoCompression) {
+		// skip files that look incompressible throughout, and with -s predict the savings from
+		// a sample of chunks; don't bother with the full compression pass when they fall well
+		// short of the requirement. In auto mode the sample also serves to choose the settings.
+		double savings = 100, cpuPerByte = 0;
+		off_t sampledBytes = 0;
+		file_sample sample;
+		bool sampled = numBlocks >= PREFILTER_MIN_BLOCKS && sampleFile(fdIn, inFileInfo, numBlocks, arena, &sample);
+		if (sampled && sample.incompressible == PREFILTER_SAMPLES) {
+			__sync_fetch_and_add(&num_incompressible, 1);
+			if (printVerbose > 2) {
+				fprintf(stderr, "%s: all sampled chunks have an entropy of at least %g bits/byte\n",
+						inFile, INCOMPRESSIBLE_ENTROPY);
+			}
+			xclose(fdIn);
+			utimes(inFile, times);
+			goto bail;
+		}
+		if (folderinfo->autoCompression) {
+			if (!chooseCompression(inFile, filesize, (sampled)? &sample : NULL, folderinfo->cpuBudget,
+								   allowLargeBlocks, arena, &comptype, &compressionlevel,
+								   &savings, &cpuPerByte, &sampledBytes)) {
+				// the error has been reported
+				xclose(fdIn);
+				utimes(inFile, times);
+				goto bail;
+			}
+		} else if (sampled && minSavings != 0.0
+				   && !compressSample(inFile, &sample, comptype, compressionlevel, allowLargeBlocks, arena,
+									  &savings, &cpuPerByte, &sampledBytes)) {
+			// the error has been reported
+			xclose(fdIn);
+			utimes(inFile, times);
+			goto bail;
+		}
+		if (minSavings != 0.0 && savings < minSavings * PREFILTER_CONFIDENCE) {
+			__sync_fetch_and_add(&num_prefiltered, 1);
+			__sync_fetch_and_add(&prefilterSavedUSec, (long long) (cpuPerByte * (filesize - sampledBytes) * 1e6));
+			if (printVerbose > 2) {
+				fprintf(stderr, "%s: sampled savings (%g%%) are well below the required savings (%g%%)\n",
+						inFile, savings, minSavings);
+			}
+			xclose(fdIn);
+			utimes(inFile, times);
+			goto bail;
+		}
+	}
+	// the rewritten file is checked against the checksums of the data we read here,
+	// or for streamed files, of the chunks read through the stream (see below).
+	// They also give the content hash under which the compressed image is cached.
+	if (!streaming && !initFileChecksums(&checksums, filesize)) {
+		fprintf(stderr, "%s: malloc error, unable to allocate the block checksums (%s)\n",
+				inFile, strerror(errno));
+		xclose(fdIn);
+		utimes(inFile, times);
+		goto bail;
+	}
+	if (streaming) {
+		// the file will be read as it is compressed, in windows of (at most) the requested size.
+		// The checksums of its chunks stand in for the data when verifying the compressed image.
+		if (!initChunkStream(&stream, inFile, fdIn, filesize, folderinfo->streamWindow, checkFiles, arena)) {
+			xclose(fdIn);
+			utimes(inFile, times);
+			goto bail;
+		}
+		stream.loadWindow = loadStreamWindow;
+		stream.context = &streamContext;
+#ifdef SUPPORT_PARALLEL
+		streamContext.worker = worker;
+#endif
+	} else
 #ifndef NO_USE_MMAP
 	if (useMmap) {
 		// get a private mmap. We rewrite to the file's attributes and/or resource fork,
@@ -515,27 +1123,29 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 			useMmap = false;
 		} else {
 			madvise(inBuf, filesize, MADV_RANDOM);
+			addFileChecksums(&checksums, inBuf, filesize, 0);
 		}
 	}
-	if (!useMmap)
+	if (!useMmap && !streaming)
 #endif
 	{
-		inBuf = malloc(filesize);
+		inBuf = arenaBuffer(arena, ARENA_INBUF, filesize);
 		if (inBuf == NULL)
 		{
 			fprintf(stderr, "%s: malloc error, unable to allocate input buffer of %lld bytes (%s)\n", inFile, (long long) filesize, strerror(errno));
 			xclose(fdIn);
 			utimes(inFile, times);
-			return;
+			goto bail;
+		}
+		if (!smallFile) {
+			madvise(inBuf, filesize, MADV_RANDOM);
 		}
-		madvise(inBuf, filesize, MADV_RANDOM);
-		if (read(fdIn, inBuf, filesize) != filesize)
+		if (readChecksummed(fdIn, inBuf, filesize, 0, &checksums) != filesize)
 		{
 			fprintf(stderr, "%s: Error reading file (%s)\n", inFile, strerror(errno));
 			xclose(fdIn);
 			utimes(inFile, times);
-			free(inBuf);
-			return;
+			goto bail;
 		}
 	}
 	// keep our filedescriptor open to maintain the lock!
@@ -576,15 +1186,23 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 			goto bail;
 		}
 		xfree(infile);
-		if (fwrite(inBuf, filesize, 1, fp) != 1)
+		if (streaming)
 		{
-			fprintf(stderr, "%s: Error writing to backup file %s (%lld bytes; %s)\n", inFile, backupName, filesize, strerror(errno));
+			// the backup is written window by window as the file is read
+			streamContext.backup = fp;
+		}
+		else
+		{
+			if (fwrite(inBuf, filesize, 1, fp) != 1)
+			{
+				fprintf(stderr, "%s: Error writing to backup file %s (%lld bytes; %s)\n", inFile, backupName, filesize, strerror(errno));
+				fclose(fp);
+				goto bail;
+			}
 			fclose(fp);
-			goto bail;
+			utimes(backupName, times);
+			chmod(backupName, orig_mode);
 		}
-		fclose(fp);
-		utimes(backupName, times);
-		chmod(backupName, orig_mode);
 	}
 #endif
 #ifdef SUPPORT_PARALLEL
@@ -593,350 +1211,135 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 	}
 #endif
 
-	outdecmpfsBuf = malloc(MAX_DECMPFS_XATTR_SIZE);
-	if (outdecmpfsBuf == NULL)
-	{
-		fprintf(stderr, "%s: malloc error, unable to allocate xattr buffer (%d bytes; %s)\n",
-				inFile, MAX_DECMPFS_XATTR_SIZE, strerror(errno));
-		utimes(inFile, times);
-		goto bail;
+	// files that are not streamed may have an identical copy that was compressed before
+	blob_cache_key cacheKey;
+	if (!streaming) {
+		double cachedCPUTime;
+		// recorded while the file was read, so the lookup costs no extra pass over the data
+		cacheKey.contentHash = fileChecksumsHash(&checksums);
+		cacheKey.filesize = filesize;
+		cacheKey.comptype = comptype;
+		cacheKey.compressionlevel = compressionlevel;
+		cacheKey.allowLargeBlocks = allowLargeBlocks;
+		cacheKey.shareChunks = folderinfo->shareChunks;
+		if (blobCacheLookup(&cacheKey, inBuf, &image, arena, &cachedCPUTime)) {
+			__sync_fetch_and_add(&num_cache_hits, 1);
+			__sync_fetch_and_add(&cacheSavedUSec, (long long) (cachedCPUTime * 1e6));
+			if (printVerbose > 2) {
+				fprintf(stderr, "%s: reusing the compressed image of an identical file\n", inFile);
+			}
+			// (which was verified against our data by the lookup)
+			cacheHit = true;
+			goto imageReady;
+		}
 	}
 
-	struct compressionType {
-		UInt32 xattr, resourceFork;
-	} compressionType;
-	uLong zlib_EstimatedCompressedChunkSize;
-#if defined HAS_LZVN || defined HAS_LZFSE
-	size_t lz_EstimatedCompressedSize;
-
-	lz_chunk_table *chunkTable = (lz_chunk_table*) outBuf;
-	ssize_t chunkTableByteSize;
-#endif
-
-	switch (comptype) {
-		case ZLIB: {
-			cmpedsize = zlib_EstimatedCompressedChunkSize = compressBound(compblksize);
-			struct compressionType t = {CMP_ZLIB_XATTR, CMP_ZLIB_RESOURCE_FORK};
-			compressionType = t;
-#ifdef ZLIB_SINGLESHOT_OUTBUF
-			outBufSize = filesize + 0x13A + (numBlocks * 9);
-#else
-			outBufSize = 0x104 + sizeof(UInt32) + numBlocks * 8;
-#endif
-#define SET_BLOCKSTART()	blockStart = outBuf + 0x104
-			outBuf = malloc(outBufSize);
-			break;
+	// stop compressing as soon as the result is certain not to give the required savings.
+	size_t sizeLimit = (minSavings != 0.0)? (size_t) (filesize * (1.0 - minSavings / 100)) + 1 : 0;
+	image.sizeLimit = sizeLimit;
+	image.shareChunks = folderinfo->shareChunks;
+	double buildStartTime = threadCPUTime(), assemblyStartTime = buildStartTime;
+#ifdef SUPPORT_PARALLEL
+	unsigned int jobBlocks = (streaming)? stream.maxWindowBlocks : numBlocks;
+	if (worker && jobBlocks >= 2 * CHUNK_TASK_BLOCKS && parallelProcessorJobs(worker) > 1) {
+		// a large file: have its chunks compressed in ranges by all workers that have time
+		// to spare, and assemble the results in order below.
+		chunkJob = createChunkTaskJob(inFile, inBuf, filesize, jobBlocks, comptype, compressionlevel, allowLargeBlocks);
+		if (!chunkJob) {
+			utimes(inFile, times);
+			goto bail;
 		}
-#ifdef HAS_LZVN
-		case LZVN: {
-			cmpedsize = lz_EstimatedCompressedSize = MAX(lzvn_encode_scratch_size(), compblksize);
-			lz_WorkSpace = malloc(cmpedsize);
-			// for this compressor we will let the outBuf grow incrementally. Slower,
-			// but use only as much memory as required.
-
-			// The chunk table stores the offset of every block, and the offset of where a next block _would_ go,
-			// so we need numBlocks + 1 items
-			outBuf = calloc(numBlocks + 1, sizeof(*chunkTable));
-			chunkTable = outBuf;
-			if (!lz_WorkSpace || !chunkTable) {
-				fprintf(stderr,
-						"%s: malloc error, unable to allocate %lu bytes for lzvn workspace or %u element chunk table(%s)\n",
-						inFile, cmpedsize, numBlocks, strerror(errno));
+		chunkJob->sizeLimit = sizeLimit;
+		if (streaming) {
+			// the job will be run on every window as it is read
+			streamContext.chunkJob = chunkJob;
+		} else {
+			if (!runParallelChunkTasks(worker, (numBlocks + CHUNK_TASK_BLOCKS - 1) / CHUNK_TASK_BLOCKS,
+									   compressChunkRange, chunkJob)) {
+				if (chunkJob->aborted) {
+					abortedFile(inFile, filesize, chunkJob->processedBlocks, chunkJob->cpuUSec * 1e-6);
+				}
 				utimes(inFile, times);
 				goto bail;
 			}
-			struct compressionType t = {CMP_LZVN_XATTR, CMP_LZVN_RESOURCE_FORK};
-			compressionType = t;
-			outBufSize = chunkTableByteSize = (numBlocks + 1) * sizeof(*chunkTable);
-			chunkTable[0] = chunkTableByteSize;
-			break;
+			precompressed.rangeBlocks = CHUNK_TASK_BLOCKS;
+			precompressed.ranges = chunkJob->results;
+			precompressed.chunkSizes = chunkJob->chunkSizes;
+			precompressedChunks = &precompressed;
+			// the CPU time of the chunk tasks is accounted for by the job
+			assemblyStartTime = threadCPUTime();
 		}
+	} else
 #endif
-#ifdef HAS_LZFSE
-		case LZFSE:
-			cmpedsize = lz_EstimatedCompressedSize = MAX(lzfse_encode_scratch_size(), compblksize);
-			lz_WorkSpace = lz_EstimatedCompressedSize ? malloc(lz_EstimatedCompressedSize) : 0;
-			// for this compressor we will let the outBuf grow incrementally. Slower,
-			// but use only as much memory as required.
-
-			// The chunk table stores the offset of every block, and the offset of where a next block _would_ go,
-			// so we need numBlocks + 1 items
-			outBuf = calloc(numBlocks + 1, sizeof(*chunkTable));
-			chunkTable = outBuf;
-			if ((!lz_WorkSpace && lz_EstimatedCompressedSize) || !chunkTable) {
-				fprintf(stderr,
-						"%s: malloc error, unable to allocate %lu bytes for lzfse workspace or %u element chunk table(%s)\n",
-						inFile, cmpedsize, numBlocks, strerror(errno));
-				utimes(inFile, times);
-				goto bail;
-			}
-			struct compressionType t = {CMP_LZFSE_XATTR, CMP_LZFSE_RESOURCE_FORK};
-			compressionType = t;
-			outBufSize = chunkTableByteSize = (numBlocks + 1) * sizeof(*chunkTable);
-			chunkTable[0] = chunkTableByteSize;
-			break;
-#endif
-		default:
-			fprintf(stderr, "%s: unsupported compression type %d (%s)\n",
-					inFile, comptype, compressionTypeName(comptype));
-			utimes(inFile, times);
-			goto bail;
-			break;
-	}
-
-	if (outBuf == NULL && outBufSize != 0)
-	{
-		fprintf(stderr, "%s: malloc error, unable to allocate output buffer of %lu bytes (%s)\n",
-				inFile, outBufSize, strerror(errno));
-		utimes(inFile, times);
-		goto bail;
-	}
-
-	outBufBlock = malloc(cmpedsize);
-	if (outBufBlock == NULL)
+	if (!initChunkCompressor(&compressor, inFile, arena, comptype, compressionlevel, allowLargeBlocks))
 	{
-		fprintf(stderr, "%s: malloc error, unable to allocate compression buffer of %lu bytes (%s)\n",
-				inFile, cmpedsize, strerror(errno));
 		utimes(inFile, times);
 		goto bail;
 	}
-	// The header of the compression resource fork (16 bytes):
-	// compression magic number
-	decmpfs_disk_header *decmpfsAttr = (decmpfs_disk_header*) outdecmpfsBuf;
-	decmpfsAttr->compression_magic = OSSwapHostToLittleInt32(cmpf);
-	// the compression type: 4 == compressed data in the resource fork.
-	// FWIW, libarchive has the following comment in archive_write_disk_posix.c :
-	//* If the compressed size is smaller than MAX_DECMPFS_XATTR_SIZE [3802]
-	//* and the block count in the file is only one, store compressed
-	//* data to decmpfs xattr instead of the resource fork.
-	// We do the same below.
-	decmpfsAttr->compression_type = OSSwapHostToLittleInt32(compressionType.resourceFork);
-	// the uncompressed filesize
-	decmpfsAttr->uncompressed_size = OSSwapHostToLittleInt64(filesize);
-	// outdecmpfsSize = 0x10;
-	outdecmpfsSize = sizeof(decmpfs_disk_header);
-
-	unsigned long currBlockLen, currBlockOffset;
-	switch (comptype) {
-		case ZLIB:
-			*(UInt32 *) outBuf = OSSwapHostToBigInt32(0x100);
-			*(UInt32 *) (outBuf + 12) = OSSwapHostToBigInt32(0x32);
-			memset(outBuf + 16, 0, 0xF0);
-			SET_BLOCKSTART();
-			// block table: numBlocks + offset,blocksize pairs for each of the blocks
-			*(UInt32 *) blockStart = OSSwapHostToLittleInt32(numBlocks);
-			// actual compressed data starts after the block table
-			currBlock = blockStart + sizeof(UInt32) + (numBlocks * 8);
-			currBlockLen = outBufSize - (currBlock - outBuf);
-			supportsLargeBlocks = true;
-			break;
-#ifdef HAS_LZVN
-		case LZVN:
-			supportsLargeBlocks = false;
-			break;
-#endif
-#ifdef HAS_LZFSE
-		case LZFSE:
-			supportsLargeBlocks = false;
-			break;
-#endif
-		default:
-			// noop
-			break;
-	}
-	int blockNr;
-
-	// chunking loop that compresses the 64K chunks and handles the result(s).
-	// Note that LZVN appears not to be chunked like that (maybe inside lzvn_encode()?)
-	// TODO: refactor and merge with the switch() above if LZFSE compression doesn't need chunking either.
-	for (inBufPos = 0, blockNr = 0, currBlockOffset = 0
-		; inBufPos < filesize
-		; inBufPos += compblksize, currBlock += cmpedsize, currBlockOffset += cmpedsize, ++blockNr)
-	{
-		void *cursor = inBuf + inBufPos;
-		uLong bytesAfterCursor = ((filesize - inBufPos) > compblksize) ? compblksize : filesize - inBufPos;
-		switch (comptype) {
-			case ZLIB:
-				// reset cmpedsize; it may be changed by compress2().
-				cmpedsize = zlib_EstimatedCompressedChunkSize;
-				if (compress2(outBufBlock, &cmpedsize, cursor, bytesAfterCursor, compressionlevel) != Z_OK)
-				{
-					utimes(inFile, times);
-					goto bail;
-				}
-#ifndef ZLIB_SINGLESHOT_OUTBUF
-				if (currBlockOffset == 0) {
-					currBlockOffset = outBufSize;
-				} 
-				outBufSize += cmpedsize;
-				if (!(outBuf = reallocf(outBuf, outBufSize + 1))) {
-					fprintf(stderr, "%s: malloc error, unable to increase output buffer to %lu bytes (%s)\n",
-							inFile, outBufSize, strerror(errno));
-					utimes(inFile, times);
-					goto bail;
-				}
-				// update this one!
-				SET_BLOCKSTART();
-				currBlock = outBuf + currBlockOffset;
-				currBlockLen = outBufSize;
-#endif
-				break;
-#ifdef HAS_LZVN
-			case LZVN:{
-				// store the current last 4 bytes of compressed file content (bogus the 1st time we come here)
-				UInt32 prevLast = ((UInt32*)outBufBlock)[cmpedsize/sizeof(UInt32)-1];
-				cmpedsize =
-					lzvn_encode_buffer(outBufBlock, lz_EstimatedCompressedSize, cursor, bytesAfterCursor, lz_WorkSpace);
-				if (cmpedsize <= 0)
-				{
-					fprintf( stderr, "%s: lzvn compression failed on chunk #%d (of %u; %lu bytes)\n",
-							 inFile, blockNr, numBlocks, bytesAfterCursor);
-// 					if (bytesAfterCursor < LZVN_MINIMUM_COMPRESSABLE_SIZE) {
-// 						cmpedsize = bytesAfterCursor;
-// 						memcpy(outBufBlock, cursor, bytesAfterCursor);
-// 					} else {
-						utimes(inFile, times);
-						goto bail;
-// 					} 
-				}
-				// next offset will start at this offset
-				if (blockNr < numBlocks) {
-					chunkTable[blockNr+1] = chunkTable[blockNr] + cmpedsize;
-				}
-				if (currBlockOffset == 0) {
-					currBlockOffset = outBufSize;
-				} 
-				outBufSize += cmpedsize;
-				if (!(outBuf = reallocf(outBuf, outBufSize))) {
-					fprintf(stderr, "%s: malloc error, unable to increase output buffer to %lu bytes (%s)\n",
-							inFile, outBufSize, strerror(errno));
-					utimes(inFile, times);
-					goto bail;
-				}
-				// update this one!
-				chunkTable = outBuf;
-				currBlock = outBuf + currBlockOffset;
-				currBlockLen = outBufSize;
-				// if not the 1st time we're here, check if the 4 bytes of compressed file contents
-				// just before the current position in the output buffer correspond to prevLast.
-				// If the test fails we may have a chunking overlap issue.
-				// It never happened to my knowledge, but this sanity check is cheap enough to keep.
-				if (blockNr > 1 && ((UInt32*)currBlock)[-1] != prevLast) {
-					fprintf(stderr, "%s: warning, possible chunking overlap: prevLast=%u currBlock[-1]=%u currBlock[0]=%u\n",
-						inFile, prevLast, ((UInt32*)currBlock)[-1], ((UInt32*)currBlock)[0]);
-				}
-				break;
-			}
-#endif
-#ifdef HAS_LZFSE
-			case LZFSE:{
-				cmpedsize = lz_EstimatedCompressedSize;
-				while (1) {
-					cmpedsize = lzfse_encode_buffer(outBufBlock, cmpedsize, cursor, bytesAfterCursor, lz_WorkSpace);
-						// If output buffer was too small, grow and retry.
-					if (cmpedsize == 0) {
-						cmpedsize <<= 1;
-						if (!(outBufBlock = reallocf(outBufBlock, cmpedsize))) {
-							fprintf(stderr, "%s: malloc error, unable to increase output buffer to %lu bytes (%s)\n",
-									inFile, cmpedsize, strerror(errno));
-							utimes(inFile, times);
-							goto bail;
-						}
-						continue;
-					}
-					break;
-				}
-				// next offset will start at this offset
-				if (blockNr < numBlocks) {
-					chunkTable[blockNr + 1] = chunkTable[blockNr] + cmpedsize;
-				}
-				if (currBlockOffset == 0) {
-					currBlockOffset = outBufSize;
-				} 
-				outBufSize += cmpedsize;
-				if (!(outBuf = reallocf(outBuf, outBufSize))) {
-					fprintf(stderr, "%s: malloc error, unable to increase output buffer to %lu bytes (%s)\n",
-							inFile, outBufSize, strerror(errno));
-					utimes(inFile, times);
-					goto bail;
-				}
-				// update this one!
-				chunkTable = outBuf;
-				currBlock = outBuf + currBlockOffset;
-				currBlockLen = outBufSize;
-				break;
-			}
+	if (streaming) {
+		if (!buildStreamedImage(&image, &stream, comptype, &compressor, arena))
+		{
+#ifdef SUPPORT_PARALLEL
+			if (chunkJob && chunkJob->aborted) {
+				abortedFile(inFile, filesize, chunkJob->processedBlocks, chunkJob->cpuUSec * 1e-6);
+			} else
 #endif
-			default:
-				// noop
-				break;
+			if (image.aborted) {
+				abortedFile(inFile, filesize, image.processedBlocks, threadCPUTime() - buildStartTime);
+			}
+			utimes(inFile, times);
+			goto bail;
 		}
-		if (supportsLargeBlocks && cmpedsize > (((filesize - inBufPos) > compblksize) ? compblksize : filesize - inBufPos))
-		{
-			if (!allowLargeBlocks && (((filesize - inBufPos) > compblksize) ? compblksize : filesize - inBufPos) == compblksize)
-			{
-				if (printVerbose >= 2) {
-					fprintf(stderr, "%s: file has a compressed chunk that's larger than the original chunk; -L to compress\n", inFile);
-				}
-				utimes(inFile, times);
+#ifdef __APPLE__
+		if (streamContext.backup) {
+			int ret = fclose(streamContext.backup);
+			streamContext.backup = NULL;
+			if (ret != 0) {
+				fprintf(stderr, "%s: Error writing to backup file %s (%s)\n", inFile, backupName, strerror(errno));
 				goto bail;
 			}
-			*(unsigned char *) outBufBlock = 0xFF;
-			memcpy(outBufBlock + 1, inBuf + inBufPos, ((filesize - inBufPos) > compblksize) ? compblksize : filesize - inBufPos);
-			cmpedsize = ((filesize - inBufPos) > compblksize) ? compblksize : filesize - inBufPos;
-			cmpedsize++;
+			utimes(backupName, times);
+			chmod(backupName, orig_mode);
 		}
-		if (((cmpedsize + outdecmpfsSize) <= MAX_DECMPFS_XATTR_SIZE) && (numBlocks <= 1))
-		{
-			// store in directly into the attribute instead of using the resource fork.
-			// *(UInt32 *) (outdecmpfsBuf + 4) = EndianU32_NtoL(compressionType.xattr);
-			decmpfsAttr->compression_type = OSSwapHostToLittleInt32(compressionType.xattr);
-			memcpy(outdecmpfsBuf + outdecmpfsSize, outBufBlock, cmpedsize);
-			outdecmpfsSize += cmpedsize;
-			folderinfo->data_compressed_size = outdecmpfsSize;
-			break;
+#endif
+	} else if (!buildCompressedImage(&image, inFile, inBuf, filesize, comptype, &compressor, precompressedChunks, arena))
+	{
+		if (image.aborted) {
+			abortedFile(inFile, filesize, image.processedBlocks, threadCPUTime() - buildStartTime);
 		}
-		if (currBlockOffset + cmpedsize <= currBlockLen) {
-			memcpy(currBlock, outBufBlock, cmpedsize);
-		} else {
-			fprintf( stderr, "%s: result buffer overrun at chunk #%d (%lu >= %lu)\n", inFile, blockNr,
-				currBlockOffset + cmpedsize, currBlockLen);
-			utimes(inFile, times);
-			goto bail;
+		utimes(inFile, times);
+		goto bail;
+	}
+	if (!streaming) {
+		double buildCPUTime = threadCPUTime() - assemblyStartTime;
+#ifdef SUPPORT_PARALLEL
+		if (chunkJob) {
+			buildCPUTime += chunkJob->cpuUSec * 1e-6;
 		}
-		switch (comptype) {
-			case ZLIB:
-				*(UInt32 *) (blockStart + ((inBufPos / compblksize) * 8) + 0x4) = OSSwapHostToLittleInt32(currBlock - blockStart);
-				*(UInt32 *) (blockStart + ((inBufPos / compblksize) * 8) + 0x8) = OSSwapHostToLittleInt32(cmpedsize);
-				break;
-			default:
-				// noop
-				break;
+#endif
+		blobCacheStore(&cacheKey, &image, buildCPUTime);
+	}
+imageReady:
+	outdecmpfsBuf = image.decmpfsBuf;
+	outdecmpfsSize = image.decmpfsSize;
+	outBuf = image.resourceFork;
+	outBufSize = image.resourceForkSize;
+	if (image.resourceFork && image.sharedChunks) {
+		__sync_fetch_and_add(&num_shared_chunks, image.sharedChunks);
+		if (printVerbose > 2) {
+			fprintf(stderr, "%s: %u of %u chunks are stored only once\n", inFile, image.sharedChunks, numBlocks);
 		}
 	}
 	// deallocate memory that isn't needed anymore.
-#if defined HAS_LZVN || defined HAS_LZFSE
-	xfree(lz_WorkSpace);
-#endif
-	free(outBufBlock); outBufBlock = NULL;
-
+	releaseChunkCompressor(&compressor);
 #ifdef SUPPORT_PARALLEL
-	// 20160928: the actual rewrite of the file is never done in parallel
-	if( worker ){
-		locked = lockParallelProcessorIO(worker);
-	}
-#else
-	signal(SIGINT, SIG_IGN);
-	signal(SIGHUP, SIG_IGN);
+	freeChunkTaskJob(chunkJob);
+	chunkJob = NULL;
 #endif
 
-	// fdIn is still open
-	bool isTruncated = false;
-
-	//if (EndianU32_LtoN(*(UInt32 *) (outdecmpfsBuf + 4)) == CMP_ZLIB_RESOURCE_FORK)
-	if (OSSwapLittleToHostInt32(decmpfsAttr->compression_type) == compressionType.resourceFork)
+	if (image.resourceFork)
 	{
-		long long int newSize = currBlock - outBuf + outdecmpfsSize + 50;
+		long long int newSize = outBufSize + outdecmpfsSize;
 		if ((minSavings != 0.0 && ((double) newSize / filesize) >= (1.0 - minSavings / 100))
 			|| newSize >= filesize)
 		{
@@ -952,106 +1355,75 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 			}
 			goto bail;
 		}
-		// create and write the resource fork:
-		switch (comptype) {
-			case ZLIB:
-#ifndef ZLIB_SINGLESHOT_OUTBUF
-				currBlockOffset = currBlock - outBuf;
-				outBufSize += currBlockOffset + sizeof(decmpfs_resource_zlib_trailer);
-				if (!(outBuf = reallocf(outBuf, outBufSize + 1))) {
-					fprintf(stderr, "%s: malloc error, unable to increase output buffer to %lu bytes (%s)\n",
-							inFile, outBufSize, strerror(errno));
-					utimes(inFile, times);
-					goto bail;
-				}
-				// update this one!
-				SET_BLOCKSTART();
-				currBlock = outBuf + currBlockOffset;
-#endif
-				*(UInt32 *) (outBuf + 4) = OSSwapHostToBigInt32(currBlock - outBuf);
-				*(UInt32 *) (outBuf + 8) = OSSwapHostToBigInt32(currBlock - outBuf - 0x100);
-				*(UInt32 *) (blockStart - 4) = OSSwapHostToBigInt32(currBlock - outBuf - 0x104);
-				decmpfs_resource_zlib_trailer *resourceTrailer = (decmpfs_resource_zlib_trailer*) currBlock;
-				memset(&resourceTrailer->empty[0], 0, 24);
-				resourceTrailer->magic1 = OSSwapHostToBigInt16(0x1C);
-				resourceTrailer->magic2 = OSSwapHostToBigInt16(0x32);
-				resourceTrailer->spacer1 = 0;
-				resourceTrailer->compression_magic = OSSwapHostToBigInt32(cmpf);
-				resourceTrailer->magic3 = OSSwapHostToBigInt32(0xA);
-				resourceTrailer->magic4 = OSSwapHostToLittleInt64(0xFFFF0100);
-				resourceTrailer->spacer2 = 0;
-#ifdef __APPLE__
-				ftruncate(fdIn, 0);
-				lseek(fdIn, SEEK_SET, 0);
-				if (setxattr(inFile, XATTR_RESOURCEFORK_NAME, outBuf, currBlock - outBuf + 50, 0,
-					XATTR_NOFOLLOW | XATTR_CREATE) < 0)
-				{
-					fprintf(stderr, "%s: setxattr(%d): %s (%d)\n", inFile, fdIn, strerror(errno), __LINE__);
-					restoreFile();
-					goto bail;
-				}
-				isTruncated = true;
-#else
-				if (printVerbose > 2) {
-					fprintf(stderr, "# setxattr(XATTR_RESOURCEFORK_NAME) outBuf=%p len=%lu\n",
-							outBuf, currBlock - outBuf + 50);
-				}
-#endif
-				folderinfo->data_compressed_size = currBlock - outBuf + 50;
-				break;
-#ifdef HAS_LZVN
-			case LZVN: {
-#ifdef __APPLE__
-				ftruncate(fdIn, 0);
-				lseek(fdIn, SEEK_SET, 0);
-				if (setxattr(inFile, XATTR_RESOURCEFORK_NAME, outBuf, outBufSize, 0,
-					XATTR_NOFOLLOW | XATTR_CREATE) < 0)
-				{
-					fprintf(stderr, "%s: setxattr(%d): %s (%d)\n", inFile, fdIn, strerror(errno), __LINE__);
-					restoreFile();
-					goto bail;
-				}
-				isTruncated = true;
-#else
-				if (printVerbose > 2) {
-					fprintf(stderr, "# setxattr(XATTR_RESOURCEFORK_NAME) outBuf=%p len=%lu\n",
-							outBuf, outBufSize);
-				}
+	}
+
+	if (checkFiles && !cacheHit)
+	{
+		// decode the image and compare it with what we read before anything is written; reading
+		// the file back after rewriting it (checkOnDisk) also catches file system errors.
+		image_check_job check = { inFile, &image, comptype, filesize, numBlocks, inBuf, stream.checksums, numBlocks };
+		unsigned int nTasks = (numBlocks + CHUNK_TASK_BLOCKS - 1) / CHUNK_TASK_BLOCKS, task;
+		bool ok = true;
+#ifdef SUPPORT_PARALLEL
+		if (worker && numBlocks >= 2 * CHUNK_TASK_BLOCKS && parallelProcessorJobs(worker) > 1) {
+			ok = runParallelChunkTasks(worker, nTasks, checkImageTask, &check);
+		} else
 #endif
-				folderinfo->data_compressed_size = outBufSize;
-				break;
+		for (task = 0 ; ok && task < nTasks ; ++task) {
+			ok = checkImageRange(&check, task, arena);
+		}
+		if (!ok) {
+			if (check.badBlock < numBlocks) {
+				fprintf(stderr, "\tchunk #%u of %u does not decode to the original data\n", check.badBlock, numBlocks);
 			}
+			printf("%s: Compressed data check failed, leaving the file uncompressed\n", inFile);
+			utimes(inFile, times);
+			goto bail;
+		}
+	}
+
+#ifdef SUPPORT_PARALLEL
+	// 20160928: the actual rewrite of the file is never done in parallel
+	if( worker ){
+		locked = lockParallelProcessorIO(worker);
+	}
+#else
+	signal(SIGINT, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
 #endif
-#ifdef HAS_LZFSE
-			case LZFSE:
+
+	// fdIn is still open
+	bool isTruncated = false;
+
+	if (image.resourceFork)
+	{
+		// write the resource fork:
 #ifdef __APPLE__
-				ftruncate(fdIn, 0);
-				lseek(fdIn, SEEK_SET, 0);
-				if (setxattr(inFile, XATTR_RESOURCEFORK_NAME, outBuf, outBufSize, 0,
-					XATTR_NOFOLLOW | XATTR_CREATE) < 0)
-				{
-					fprintf(stderr, "%s: setxattr(%d): %s (%d)\n", inFile, fdIn, strerror(errno), __LINE__);
-					restoreFile();
-					goto bail;
-				}
-				isTruncated = true;
+		ftruncate(fdIn, 0);
+		lseek(fdIn, SEEK_SET, 0);
+		if (setxattr(inFile, XATTR_RESOURCEFORK_NAME, outBuf, outBufSize, 0,
+			XATTR_NOFOLLOW | XATTR_CREATE) < 0)
+		{
+			fprintf(stderr, "%s: setxattr(%d): %s (%d)\n", inFile, fdIn, strerror(errno), __LINE__);
+			restoreFile();
+			goto bail;
+		}
+		isTruncated = true;
 #else
-				if (printVerbose > 2) {
-					fprintf(stderr, "# setxattr(XATTR_RESOURCEFORK_NAME) outBuf=%p len=%lu\n",
-							outBuf, outBufSize);
-				}
-#endif
-				folderinfo->data_compressed_size = outBufSize;
-				break;
-#endif
-			default:
-				// noop
-				break;
+		if (printVerbose > 2) {
+			fprintf(stderr, "# setxattr(XATTR_RESOURCEFORK_NAME) outBuf=%p len=%lu\n",
+					outBuf, outBufSize);
 		}
+#endif
+		folderinfo->data_compressed_size = outBufSize;
 		if (outBufSize > maxOutBufSize) {
 			maxOutBufSize = outBufSize;
 		}
 	}
+	else
+	{
+		folderinfo->data_compressed_size = outdecmpfsSize;
+	}
 #ifdef __APPLE__
 	// set the decmpfs attribute, which may or may not contain compressed data.
 	// This requires negligible disk space so we do not truncate the file first,
@@ -1083,7 +1455,7 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 			fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
 		}
 // 		if (EndianU32_LtoN(*(UInt32 *) (outdecmpfsBuf + 4)) == CMP_ZLIB_RESOURCE_FORK &&
-		if (OSSwapLittleToHostInt32(decmpfsAttr->compression_type) == compressionType.resourceFork &&
+		if (image.resourceFork &&
 			fremovexattr(fdIn, XATTR_RESOURCEFORK_NAME, XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
 		{
 			fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
@@ -1101,11 +1473,10 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 // 	fsync(fdIn);
 	xclose(fdIn);
 	lstat(inFile, inFileInfo);
-	if (checkFiles)
+	if (checkOnDisk)
 	{
 		bool sizeMismatch = inFileInfo->st_size != filesize, readFailure = false, contentMismatch = false;
 		ssize_t checkRead= -2;
-		bool outBufMMapped = false;
 		errno = 0;
 		fdIn = open(inFile, O_RDONLY|O_EXLOCK);
 		if (fdIn == -1)
@@ -1114,41 +1485,39 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 			// we don't bail here, we fail (= restore the backup).
 			goto fail;
 		}
-		if (!sizeMismatch) {
-#ifndef NO_USE_MMAP
-			xfree(outBuf);
-			outBuf = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE|MAP_NOCACHE, fdIn, 0);
-			outBufMMapped = true;
-#else
-			outBuf = reallocf(outBuf, filesize);
-#endif
-			if (!outBuf) {
+		if (!sizeMismatch && streaming && backupName) {
+			// compare the file (read through the stream window) with the backup we made
+			int backupFd = open(backupName, O_RDONLY);
+			errno = 0;
+			contentMismatch = !verifyChunkStream(&stream, fdIn, backupFd, &readFailure) && !readFailure;
+			checkRead = (readFailure)? -1 : filesize;
+			xclose(backupFd);
+		} else if (!sizeMismatch) {
+			// read the file back block by block and compare it with the checksums of the original
+			// data; the chunks of a streamed file were checksummed as they were read.
+			const file_checksums streamChecksums = { filesize, stream.numBlocks, stream.checksums };
+			const file_checksums *original = (streaming)? &streamChecksums : &checksums;
+			void *checkBuf = arenaBuffer(arena, ARENA_CHUNK, CHECKSUM_BLOCK_SIZE);
+			if (!checkBuf) {
 				xclose(fdIn);
-				fprintf(stderr, "%s: failure reallocating buffer for validation; %s\n", inFile, strerror(errno));
+				fprintf(stderr, "%s: failure allocating buffer for validation; %s\n", inFile, strerror(errno));
 				goto fail;
 			}
-			// this should be appropriate for simply reading into and comparing:
-			madvise(inBuf, filesize, MADV_SEQUENTIAL);
-			madvise(outBuf, filesize, MADV_SEQUENTIAL);
-			if (!outBufMMapped) {
-				errno = 0;
-				readFailure = (checkRead = read(fdIn, outBuf, filesize)) != filesize;
-			} else {
-				readFailure = false;
-				checkRead = filesize;
+			errno = 0;
+			size_t badBlock = verifyChecksummedFile(original, fdIn, folderinfo->check_samples, checkBuf, &readFailure);
+			contentMismatch = badBlock < original->numBlocks && !readFailure;
+			checkRead = (readFailure)? (ssize_t) badBlock * CHECKSUM_BLOCK_SIZE : filesize;
+			if (contentMismatch && printVerbose > 1) {
+				fprintf(stderr, "%s: chunk #%zu differs from the original\n", inFile, badBlock);
 			}
 		}
 		xclose(fdIn);
-		if (sizeMismatch || readFailure
-			|| (contentMismatch = memcmp(outBuf, inBuf, filesize) != 0))
+		if (sizeMismatch || readFailure || contentMismatch)
 		{
 			fprintf(stderr, "\tsize mismatch=%d read=%zd failure=%d content mismatch=%d (%s)\n",
 				sizeMismatch, checkRead, readFailure, contentMismatch, strerror(errno));
 fail:;
 			printf("%s: Compressed file check failed, reverting file changes\n", inFile);
-			if (outBufMMapped) {
-				xmunmap(outBuf, filesize);
-			}
 #ifdef __APPLE__
 			if (backupName)
 			{
@@ -1165,7 +1534,7 @@ fail:;
 				fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
 			}
 // 			if (EndianU32_LtoN(*(UInt32 *) (outdecmpfsBuf + 4)) == CMP_ZLIB_RESOURCE_FORK && 
-			if (OSSwapLittleToHostInt32(decmpfsAttr->compression_type) == compressionType.resourceFork &&
+			if (image.resourceFork &&
 				removexattr(inFile, XATTR_RESOURCEFORK_NAME, XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
 			{
 				fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
@@ -1177,7 +1546,8 @@ fail:;
 				xfree(backupName);
 				goto bail;
 			}
-			if (fwrite(inBuf, filesize, 1, in) != 1)
+			if ((streaming)? !restoreStreamedFile(inFile, fileno(in), backupName, &image, comptype)
+				: fwrite(inBuf, filesize, 1, in) != 1)
 			{
 				fprintf(stderr, "%s: Error writing to file (%lld bytes; %s)\n", inFile, filesize, strerror(errno));
 				xfree(backupName);
@@ -1186,9 +1556,6 @@ fail:;
 			fclose(in);
 #endif
 		}
-		if (outBufMMapped) {
-			xmunmap(outBuf, filesize);
-		}
 	}
 // #ifndef NO_USE_MMAP
 // 	{
@@ -1236,13 +1603,19 @@ bail:
 	} else
 #endif
 	{
-		xfree(inBuf);
+		// the buffer remains in the arena
+		inBuf = NULL;
 	}
-	xfree(outBuf);
-	xfree(outdecmpfsBuf);
-	xfree(outBufBlock);
-#if defined HAS_LZVN || defined HAS_LZFSE
-	xfree(lz_WorkSpace);
+	outBuf = outdecmpfsBuf = NULL;
+	releaseChunkCompressor(&compressor);
+	releaseChunkStream(&stream);
+	releaseFileChecksums(&checksums);
+	if (streamContext.backup) {
+		fclose(streamContext.backup);
+	}
+	trimBufferArena(arena);
+#ifdef SUPPORT_PARALLEL
+	freeChunkTaskJob(chunkJob);
 #endif
 }
 
@@ -2195,6 +2568,26 @@ long long process_file_info(const char *filepath, const char *filetype, struct s
 	return ret;
 }
 
+// report the files and chunks that were handled without (completely) compressing them
+static void printRejectionInfo()
+{
+	if (num_cache_hits) {
+		printf("Compressed images reused for identical files: %lld (~%.1fs CPU saved)\n",
+			   num_cache_hits, cacheSavedUSec * 1e-6);
+	}
+	if (num_shared_chunks) {
+		printf("Duplicate chunks stored only once: %lld\n", num_shared_chunks);
+	}
+	if (num_incompressible) {
+		printf("Skipped %lld files whose sampled chunks all look incompressible\n", num_incompressible);
+	}
+	if (num_prefiltered || num_aborted) {
+		printf("Rejected without a full compression pass: %lld files by sampling (~%.1fs CPU saved),"
+			   " %lld files by early abort (~%.1fs CPU saved)\n",
+			   num_prefiltered, prefilterSavedUSec * 1e-6, num_aborted, abortSavedUSec * 1e-6);
+	}
+}
+
 void printFolderInfo(struct folder_info *folderinfo, bool hardLinkCheck)
 {
 	long long foldersize, foldersize_rounded;
@@ -2204,6 +2597,7 @@ void printFolderInfo(struct folder_info *folderinfo, bool hardLinkCheck)
 		printf(", %lld skipped", num_skipped);
 	}
 	printf("\n");
+	printRejectionInfo();
 	if (hardLinkCheck)
 		printf("Total number of file hard links: %lld\n", folderinfo->num_hard_link_files);
 	printf("Total number of folders: %lld\n", folderinfo->num_folders);
@@ -2369,7 +2763,7 @@ void process_folder(FTS *currfolder, struct folder_info *folderinfo)
 							{
 								if (fileIsCompressable(currfile->fts_path, currfile->fts_statp, folderinfo->compressiontype, &folderinfo->onAPFS))
 									addFileToParallelProcessor( PP, currfile->fts_path, currfile->fts_statp, folderinfo, false );
-								else
+								else if (!parallelProcessorIsStreaming(PP))
 									process_file_info(currfile->fts_path, NULL, currfile->fts_statp, getParallelProcessorJobInfo(PP));
 							}
 							else
@@ -2430,18 +2824,29 @@ void printUsage()
 		   "Create archive file with compressed data in data fork:    " AFSCTOOL_PROG_NAME " -a[d] src dst [... srcN dstN]\n"
 		   "Extract HFS+/APFS compression archive to file:            " AFSCTOOL_PROG_NAME " -x[d] src dst [... srcN dstN]\n"
 #ifdef SUPPORT_PARALLEL
-		   "Apply HFS+/APFS compression to file or folder:            " AFSCTOOL_PROG_NAME " -c[nlfvv[v]ib] [-jN|-JN] [-S [-RM] ] [-<level>] [-m <size>] [-s <percentage>] [-t <ContentType>] [-T compressor] file[s]/folder[s]\n\n"
+		   "Apply HFS+/APFS compression to file or folder:            " AFSCTOOL_PROG_NAME " -c[nlfvv[v]ib] [-P[N]] [-jN|-JN] [-S [-RM] ] [-<level>] [-m <size>] [-w <size>] [-s <percentage>] [-C <dir>] [-t <ContentType>] [-T compressor [-B <seconds>]] file[s]/folder[s]\n\n"
 #else
-		   "Apply HFS+/APFS compression to file or folder:            " AFSCTOOL_PROG_NAME " -c[nlfvv[v]ib] [-<level>] [-m <size>] [-s <percentage>] [-t <ContentType>] [-T compressor] file[s]/folder[s]\n\n"
+		   "Apply HFS+/APFS compression to file or folder:            " AFSCTOOL_PROG_NAME " -c[nlfvv[v]ib] [-P[N]] [-<level>] [-m <size>] [-w <size>] [-s <percentage>] [-C <dir>] [-t <ContentType>] [-T compressor [-B <seconds>]] file[s]/folder[s]\n\n"
 #endif
 		   "Options:\n"
 		   "-v Increase verbosity level\n"
 		   "-f Detect hard links\n"
 		   "-l List files that are HFS+/APFS compressed (or if the -c option is given, files which fail to compress)\n"
 		   "-L Allow larger-than-raw compressed chunks (not recommended; always true for LZVN compression)\n"
+		   "-D Store identical chunks of a file only once (ZLIB only; experimental, cannot be combined with -n)\n"
 		   "-n Do not verify files after compression (not recommended)\n"
+		   "-P[N] Paranoid verification: read every file back after compressing it, in addition to\n"
+		   "      checking that the compressed data decodes to the original before it is written.\n"
+		   "      With <N>, only N randomly chosen 64Kb blocks are read back from files that have more than\n"
+		   "      N blocks; -P or -P0 reads back all blocks\n"
 		   "-m <size> Largest file size to compress, in bytes\n"
-		   "-s <percentage> For compression to be applied, compression savings must be at least this percentage\n"
+		   "-w <size> Read and compress files larger than <size> Mb in a window of that size,\n"
+		   "          keeping only the window and the compressed data in memory\n"
+		   "-C <dir> Keep the compressed data in <dir> so that files identical to a file compressed\n"
+		   "         in an earlier run don't need to be compressed again (within a run this is automatic)\n"
+		   "-s <percentage> For compression to be applied, compression savings must be at least this percentage.\n"
+		   "                Files are rejected early when a sample of their chunks falls well short of it,\n"
+		   "                or as soon as the compressed data can no longer meet it.\n"
 		   "-t <ContentType/Extension> Return statistics for files of given content type and when compressing,\n"
 		   "                           if this option is given then only files of content type(s) or extension(s) specified with this option will be compressed\n"
 		   "-i Compress or show statistics for files that don't have content type(s) or extension(s) given by -t <ContentType/Extension> instead of those that do\n"
@@ -2449,12 +2854,29 @@ void printUsage()
 #ifdef SUPPORT_PARALLEL
 		   "-jN compress (only compressable) files using <N> threads (compression is concurrent, disk IO is exclusive)\n"
 		   "-JN read, compress and write files (only compressable ones) using <N> threads (everything is concurrent except writing the compressed file)\n"
+		   "-jauto use a thread per available CPU (taking cgroup limits into account), with exclusive disk IO on spinning disks\n"
+		   "       and concurrent IO on solid state devices, and a -w window and -M budget that keep the files in flight\n"
+		   "       within half the memory\n"
 		   "-S sort the item list by file size (leaving the largest files to the end may be beneficial if the target volume is almost full)\n"
+		   "   The workers start while the files are still being found, so only the files waiting to be\n"
+		   "   processed are sorted, unless -SS is used\n"
 		   "-RM <M> of the <N> workers will work the item list (must be sorted!) in reverse order, starting with the largest files\n"
+		   "-SS schedule the item list by estimated processing time: all workers take the costliest file left,\n"
+		   "    the small files filling in at the end so that the workers finish together (ignores -R)\n"
+		   "-A adapt the number of active workers to the measured throughput, up to <N> (default: twice the\n"
+		   "   number of CPUs). Workers are parked when adding them no longer makes things go faster\n"
+		   "-IW <W> workers can read or write files on the same device at the same time (default 1);\n"
+		   "    workers doing I/O on different devices never wait for each other\n"
+		   "-N[cpulist] pin the workers to the CPUs in <cpulist> (e.g. 0-7,16-23; default: all available CPUs),\n"
+		   "            alternating between the NUMA nodes, with their buffers allocated on their node (Linux only)\n"
+		   "-MN limit the memory used by the files being compressed to <N> Mb together (-jauto: half the available memory;\n"
+		   "    -M0: no limit). Files that don't fit wait, or are set aside while a worker takes a smaller one\n"
 #endif
 		   "-T <compressor> Compression type to use: ZLIB (= types 3,4), LZVN (= types 7,8), or LZFSE (= types 11,12)\n"
+		   "                or auto, to choose the type and level per file from a sample or the file's extension\n"
+		   "-B <seconds> CPU time per Gb -T auto may spend to get more savings (default %g)\n"
 		   "-<level> Compression level to use when compressing (ZLIB only; ranging from 1 to 9, with 1 being the fastest and 9 being the best - default is 5)\n"
-		  , AFSCTOOL_FULL_VERSION_STRING);
+		  , AFSCTOOL_FULL_VERSION_STRING, AUTO_DEFAULT_BUDGET);
 }
 
 #ifndef SUPPORT_PARALLEL
@@ -2472,11 +2894,13 @@ int afsctool (int argc, const char * argv[])
 	char *folderarray[2], *fullpath = NULL, *fullpathdst = NULL, *cwd, *fileextension, *filetype = NULL;
 	int compressionlevel = 5;
 	compression_type compressiontype = ZLIB;
-	double minSavings = 0.0;
-	long long int filesize, filesize_rounded, maxSize = 0;
+	double minSavings = 0.0, cpuBudget = 0.0;
+	bool autoCompression = FALSE;
+	long long int filesize, filesize_rounded, maxSize = 0, streamWindow = 0;
 	bool printDir = FALSE, decomp = FALSE, createfile = FALSE, extractfile = FALSE, applycomp = FALSE,
-		fileCheck = TRUE, argIsFile, hardLinkCheck = FALSE, dstIsFile, free_src = FALSE, free_dst = FALSE,
-		invert_filetypelist = FALSE, allowLargeBlocks = FALSE, filetype_found, backupFile = FALSE;
+		fileCheck = TRUE, diskCheck = FALSE, argIsFile, hardLinkCheck = FALSE, dstIsFile, free_src = FALSE, free_dst = FALSE,
+		invert_filetypelist = FALSE, allowLargeBlocks = FALSE, filetype_found, backupFile = FALSE, shareChunks = FALSE;
+	const char *blobStoreDir = NULL;
 	FILE *afscFile, *outFile;
 	char *xattrnames, *curr_attr, header[4];
 	ssize_t xattrnamesize, xattrsize, getxattrret, xattrPos;
@@ -2484,8 +2908,12 @@ int afsctool (int argc, const char * argv[])
 	void *attr_buf;
 	UInt16 big16;
 	UInt64 big64;
-	int nJobs = 0, nReverse = 0;
-	bool sortQueue = false;
+	int nJobs = 0, nReverse = 0, ioWidth = 0;
+	const char *cpuPlacement = NULL;
+	long long memoryBudget = -1;
+	size_t blobCacheMemory = BLOB_CACHE_MEMORY;
+	long checkSamples = 0;
+	bool sortQueue = false, sortByCost = false, autoScale = false, autoJobs = false;
 	bool ppJobInfoInitialised = false;
 
 	folderinfo.filetypeslist = NULL;
@@ -2578,6 +3006,27 @@ int afsctool (int argc, const char * argv[])
 					}
 					fileCheck = FALSE;
 					break;
+				case 'P':
+					if (createfile || extractfile || decomp)
+					{
+						printUsage();
+						exit(EINVAL);
+					}
+					diskCheck = TRUE;
+					if (isdigit(argv[i][j+1]))
+					{
+						checkSamples = atol(&argv[i][j+1]);
+						goto next_arg;
+					}
+					break;
+				case 'D':
+					if (!applycomp)
+					{
+						printUsage();
+						exit(EINVAL);
+					}
+					shareChunks = TRUE;
+					break;
 				case 'f':
 					if (createfile || extractfile || decomp)
 					{
@@ -2612,6 +3061,47 @@ int afsctool (int argc, const char * argv[])
 					sscanf(argv[i], "%lld", &maxSize);
 					j = strlen(argv[i]) - 1;
 					break;
+				case 'w':
+					if (!applycomp || j + 1 < strlen(argv[i]) || i + 2 > argc)
+					{
+						printUsage();
+						exit(EINVAL);
+					}
+					i++;
+					sscanf(argv[i], "%lld", &streamWindow);
+					if (streamWindow <= 0)
+					{
+						fprintf(stderr, "Invalid window size; must be a positive number of Mb\n");
+						exit(EINVAL);
+					}
+					streamWindow *= 1024 * 1024;
+					j = strlen(argv[i]) - 1;
+					break;
+				case 'C':
+					if (!applycomp || j + 1 < strlen(argv[i]) || i + 2 > argc)
+					{
+						printUsage();
+						exit(EINVAL);
+					}
+					i++;
+					blobStoreDir = argv[i];
+					j = strlen(argv[i]) - 1;
+					break;
+				case 'B':
+					if (!applycomp || j + 1 < strlen(argv[i]) || i + 2 > argc)
+					{
+						printUsage();
+						exit(EINVAL);
+					}
+					i++;
+					sscanf(argv[i], "%lf", &cpuBudget);
+					if (cpuBudget <= 0)
+					{
+						fprintf(stderr, "Invalid CPU budget; must be a positive number of seconds per Gb\n");
+						exit(EINVAL);
+					}
+					j = strlen(argv[i]) - 1;
+					break;
 				case 's':
 					if (createfile || extractfile || decomp || j + 1 < strlen(argv[i]) || i + 2 > argc)
 					{
@@ -2661,12 +3151,21 @@ int afsctool (int argc, const char * argv[])
 					i++;
 					if (strcasecmp(argv[i], "zlib") == 0) {
 						compressiontype = ZLIB;
+					} else if (strcasecmp(argv[i], "auto") == 0) {
+						// ZLIB is the default for the files for which there is nothing to go by
+						compressiontype = ZLIB;
+						autoCompression = TRUE;
 					} else if (strcasecmp(argv[i], "lzvn") == 0) {
 #ifdef HAS_LZVN
 						if(
+#ifdef __APPLE__
 							// we can do simplified runtime OS version detection: accept LZVN on 10.9 and up.
 							// NB: apparently this cannot be merged into a single if() with the strcasecmp().
 							isMacOSVersionAtLeast(10, 9, 0)
+#else
+							// elsewhere we only compress in memory, so the OS version doesn't matter.
+							true
+#endif
 						) {
 							compressiontype = LZVN;
 						} else {
@@ -2680,7 +3179,11 @@ int afsctool (int argc, const char * argv[])
 					} else if (strcasecmp(argv[i], "lzfse") == 0) {
 #ifdef HAS_LZFSE
 						if(
+#ifdef __APPLE__
 							isMacOSVersionAtLeast(10, 11, 0)
+#else
+							true
+#endif
 						) {
 							// accept LZFSE on 10.11 and up.
 							compressiontype = LZFSE;
@@ -2737,6 +3240,10 @@ int afsctool (int argc, const char * argv[])
 							nReverse = 0;
 						}
 					}
+					else if (strcasecmp(&argv[i][j+1], "auto") == 0)
+					{
+						autoJobs = true;
+					}
 					else
 					{
 						nJobs = atoi(&argv[i][j+1]);
@@ -2755,6 +3262,59 @@ int afsctool (int argc, const char * argv[])
 						exit(EINVAL);
 					}
 					sortQueue = true;
+					if (argv[i][j+1] == 'S')
+					{
+						sortByCost = true;
+					}
+					goto next_arg;
+					break;
+				case 'A':
+					if (!applycomp)
+					{
+						printUsage();
+						exit(EINVAL);
+					}
+					autoScale = true;
+					break;
+				case 'I':
+					if (!applycomp)
+					{
+						printUsage();
+						exit(EINVAL);
+					}
+					ioWidth = atoi(&argv[i][j+1]);
+					if (ioWidth <= 0)
+					{
+						fprintf( stderr, "Warning: the number of concurrent I/O workers must be a positive number (%s)\n", argv[i] );
+						ioWidth = 0;
+					}
+					goto next_arg;
+					break;
+				case 'N':
+					if (!applycomp)
+					{
+						printUsage();
+						exit(EINVAL);
+					}
+					cpuPlacement = &argv[i][j+1];
+					goto next_arg;
+					break;
+				case 'M':
+					if (!applycomp)
+					{
+						printUsage();
+						exit(EINVAL);
+					}
+					memoryBudget = atoll(&argv[i][j+1]);
+					if (memoryBudget < 0)
+					{
+						fprintf( stderr, "Warning: the memory budget cannot be negative (%s)\n", argv[i] );
+						memoryBudget = -1;
+					}
+					else
+					{
+						memoryBudget *= 1024 * 1024;
+					}
 					goto next_arg;
 					break;
 #endif
@@ -2772,8 +3332,60 @@ next_arg:;
 		printUsage();
 		exit(EINVAL);
 	}
-
+	if (shareChunks && !fileCheck)
+	{
+		// not every decoder may accept chunks that share their data: only use them when checked.
+		fprintf(stderr, "-D requires the compressed files to be verified, it cannot be combined with -n\n");
+		exit(EINVAL);
+	}
+	if (shareChunks)
+	{
+		// our own decoder doesn't say anything about the system's: read the files back.
+		diskCheck = TRUE;
+	}
+	if (cpuBudget != 0.0 && !autoCompression)
+	{
+		fprintf(stderr, "Warning: the CPU budget only applies to -T auto\n");
+	}
+	else if (autoCompression && cpuBudget == 0.0)
+	{
+		cpuBudget = AUTO_DEFAULT_BUDGET;
+	}
 #ifdef SUPPORT_PARALLEL
+	if (autoJobs)
+	{
+		system_resources resources;
+		getSystemResources(&resources);
+		nJobs = (resources.nCPUs > 0)? resources.nCPUs : 1;
+		if (autoScale)
+		{
+			nJobs *= 2;
+		}
+		// the I/O tokens of each device are set according to its type instead
+		exclusive_io = true;
+		if (streamWindow == 0 && resources.memory > 0)
+		{
+			// a file is read in whole and compressed into a buffer of about the same size:
+			// stream the files that would otherwise take more than half the memory between the workers.
+			streamWindow = resources.memory / 4 / nJobs / (1024 * 1024);
+			streamWindow = (streamWindow > 0)? streamWindow * 1024 * 1024 : 1024 * 1024;
+		}
+		if (memoryBudget < 0)
+		{
+			memoryBudget = resources.memory / 2;
+		}
+		fprintf( stderr, "Automatic mode: %d workers for %d%s CPUs, files over %lld Mb of %s%llu Mb are streamed,"
+			" %lld Mb in flight at most\n",
+			nJobs, resources.nCPUs, (resources.cpuLimited)? " available" : "",
+			streamWindow / (1024 * 1024), (resources.memoryLimited)? "a limit of " : "",
+			resources.memory / (1024 * 1024), memoryBudget / (1024 * 1024) );
+	}
+	if (autoScale && nJobs == 0)
+	{
+		// leave the autoscaler room to grow beyond a worker per CPU
+		long nCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+		nJobs = (nCPUs > 0)? 2 * nCPUs : 2;
+	}
 	if (nJobs > 0)
 	{
 		if (nReverse && !sortQueue)
@@ -2781,7 +3393,38 @@ next_arg:;
 			fprintf( stderr, "Warning: reverse jobs are ignored when the item list is not sorted (-S)\n" );
 			nReverse = 0;
 		}
+		else if (nReverse && sortByCost)
+		{
+			fprintf( stderr, "Warning: reverse jobs are ignored when scheduling by cost (-SS)\n" );
+			nReverse = 0;
+		}
 		PP = createParallelProcessor(nJobs, nReverse, printVerbose);
+		if (PP && autoScale)
+		{
+			setParallelProcessorAutoScaling(PP, true);
+		}
+		if (PP && (ioWidth || autoJobs))
+		{
+			// 0: according to the device type
+			setParallelProcessorIOWidth(PP, ioWidth);
+		}
+		if (PP && cpuPlacement && !setParallelProcessorCPUPlacement(PP, cpuPlacement))
+		{
+			fprintf( stderr, "Warning: cannot pin the workers to CPUs \"%s\"\n", cpuPlacement );
+		}
+		if (PP && memoryBudget > 0)
+		{
+			if (applycomp)
+			{
+				// the compressed images the cache keeps take their memory from the budget too
+				if ((long long) blobCacheMemory > memoryBudget / 4)
+				{
+					blobCacheMemory = memoryBudget / 4;
+				}
+				memoryBudget -= blobCacheMemory;
+			}
+			setParallelProcessorMemoryBudget(PP, memoryBudget);
+		}
 //		if (PP)
 //		{
 //			if (printVerbose)
@@ -2792,11 +3435,60 @@ next_arg:;
 //		}
 	}
 #endif
+	if (applycomp && !initBlobCache(blobCacheMemory, blobStoreDir))
+	{
+		exit(EINVAL);
+	}
 
 	// ignore signals due to exceeding CPU or file size limits
 	signal(SIGXCPU, SIG_IGN);
 	signal(SIGXFSZ, SIG_IGN);
 
+	// the settings for the folders to process; the statistics are reset for each folder
+	folderinfo.print_info = (nJobs)? false : printVerbose;
+	folderinfo.print_files = (nJobs == 0)? printDir : 0;
+	folderinfo.compress_files = applycomp;
+	folderinfo.check_files = fileCheck;
+	folderinfo.check_on_disk = diskCheck;
+	folderinfo.check_samples = checkSamples;
+	folderinfo.allowLargeBlocks = allowLargeBlocks;
+	folderinfo.shareChunks = shareChunks;
+	folderinfo.compressionlevel = compressionlevel;
+	folderinfo.compressiontype = compressiontype;
+	folderinfo.autoCompression = autoCompression;
+	folderinfo.cpuBudget = cpuBudget;
+	folderinfo.minSavings = minSavings;
+	folderinfo.maxSize = maxSize;
+	folderinfo.streamWindow = streamWindow;
+	folderinfo.check_hard_links = hardLinkCheck;
+	folderinfo.invert_filetypelist = invert_filetypelist;
+	folderinfo.backup_file = backupFile;
+
+#ifdef SUPPORT_PARALLEL
+	// unless the whole list is needed to schedule it, process the files while the scan is finding them
+	if (PP && !sortByCost)
+	{
+		struct folder_info *fi = getParallelProcessorJobInfo(PP);
+		memcpy(fi, &folderinfo, sizeof(*fi));
+		fi->num_files = fi->num_folders = 0;
+		fi->num_compressed = 0;
+		fi->num_hard_link_files = fi->num_hard_link_folders = 0;
+		fi->uncompressed_size = fi->uncompressed_size_rounded = 0;
+		fi->compressed_size = fi->compressed_size_rounded = 0;
+		fi->compattr_size = 0;
+		fi->total_size = 0;
+		fi->filetypes = NULL;
+		fi->numfiletypes = fi->filetypessize = 0;
+		ppJobInfoInitialised = true;
+		signal(SIGINT, signal_handler);
+		signal(SIGHUP, signal_handler);
+		if (startParallelProcessor(PP, sortQueue, PARALLEL_QUEUE_LIMIT))
+		{
+			fprintf( stderr, "Started %d worker threads to process the files as they are found\n", nJobs );
+		}
+	}
+#endif
+
 	int N, step, n;
 	if (createfile || extractfile)
 	{
@@ -2878,11 +3570,17 @@ next_arg:;
 		{
 			struct folder_info fi;
 			fi.maxSize = maxSize;
+			fi.streamWindow = streamWindow;
 			fi.compressionlevel = compressionlevel;
 			fi.compressiontype = compressiontype;
+			fi.autoCompression = autoCompression;
+			fi.cpuBudget = cpuBudget;
 			fi.allowLargeBlocks = allowLargeBlocks;
+			fi.shareChunks = shareChunks;
 			fi.minSavings = minSavings;
 			fi.check_files = fileCheck;
+			fi.check_on_disk = diskCheck;
+			fi.check_samples = checkSamples;
 			fi.backup_file = backupFile;
 #ifdef SUPPORT_PARALLEL
 			if (PP)
@@ -2891,8 +3589,9 @@ next_arg:;
 				{
 					addFileToParallelProcessor( PP, fullpath, &fileinfo, &fi, true );
 				}
-				else
+				else if (!parallelProcessorIsStreaming(PP))
 				{
+					// (the workers account for the files they process in the job info)
 					process_file_info(fullpath, NULL, &fileinfo, getParallelProcessorJobInfo(PP));
 				}
 			}
@@ -3216,21 +3915,9 @@ next_arg:;
 			folderinfo.num_hard_link_files = 0;
 			folderinfo.num_folders = 0;
 			folderinfo.num_hard_link_folders = 0;
-			folderinfo.print_info = (nJobs)? false : printVerbose;
-			folderinfo.print_files = (nJobs == 0)? printDir : 0;
-			folderinfo.compress_files = applycomp;
-			folderinfo.check_files = fileCheck;
-			folderinfo.allowLargeBlocks = allowLargeBlocks;
-			folderinfo.compressionlevel = compressionlevel;
-			folderinfo.compressiontype = compressiontype;
-			folderinfo.minSavings = minSavings;
-			folderinfo.maxSize = maxSize;
-			folderinfo.check_hard_links = hardLinkCheck;
 			folderinfo.filetypes = NULL;
 			folderinfo.numfiletypes = 0;
 			folderinfo.filetypessize = 0;
-			folderinfo.invert_filetypelist = invert_filetypelist;
-			folderinfo.backup_file = backupFile;
 			process_folder(currfolder, &folderinfo);
 			folderinfo.num_folders--;
 			if (printVerbose > 0 || !printDir)
@@ -3346,6 +4033,7 @@ next_arg:;
 								printf(", %lld skipped", num_skipped);
 							}
 							printf("\n");
+							printRejectionInfo();
 							if (hardLinkCheck)
 								printf("Total number of file hard links: %lld\n", alltypesinfo.num_hard_link_files);
 							filesize = alltypesinfo.uncompressed_size;
@@ -3390,7 +4078,7 @@ next_arg:;
 					}
 				}
 			}
-			if (PP && nJobs > 0)
+			if (PP && nJobs > 0 && !parallelProcessorIsStreaming(PP))
 			{
 				struct folder_info *fi = getParallelProcessorJobInfo(PP);
 				memcpy(fi, &folderinfo, sizeof(*fi));
@@ -3435,26 +4123,39 @@ next_arg:;
 				ppJobInfoInitialised = true;
 			}
 		}
-		if (sortQueue)
+		if (sortByCost)
+		{
+			sortFilesInParallelProcessorByCost(PP);
+		}
+		else if (sortQueue && !parallelProcessorIsStreaming(PP))
 		{
 			sortFilesInParallelProcessorBySize(PP);
 		}
 		size_t nFiles = filesInParallelProcessor(PP);
-		if (nFiles)
-		{
-			if (nJobs > nFiles) {
-				nJobs = nFiles;
-				if (nJobs < nReverse) {
-					// user asked a certain amount of reverse jobs;
-					// respect that as well if we can
-					nReverse = nJobs;
+		const bool streaming = parallelProcessorIsStreaming(PP);
+		if (nFiles || streaming)
+		{
+			if (streaming)
+			{
+				// the workers are already running
+				fprintf( stderr, "Found %lu items, waiting for the workers to finish\n", nFiles );
+			}
+			else
+			{
+				if ((size_t) nJobs > nFiles) {
+					nJobs = nFiles;
+					if (nJobs < nReverse) {
+						// user asked a certain amount of reverse jobs;
+						// respect that as well if we can
+						nReverse = nJobs;
+					}
+					changeParallelProcessorJobs(PP, nJobs, nReverse);
 				}
-				changeParallelProcessorJobs(PP, nJobs, nReverse);
+				signal(SIGINT, signal_handler);
+				signal(SIGHUP, signal_handler);
+				fprintf( stderr, "Starting %d worker threads to process queue with %lu items\n",
+					nJobs, nFiles );
 			}
-			signal(SIGINT, signal_handler);
-			signal(SIGHUP, signal_handler);
-			fprintf( stderr, "Starting %d worker threads to process queue with %lu items\n",
-				nJobs, nFiles );
 			int processed = runParallelProcessor(PP);
 			fprintf( stderr, "Processed %d entries\n", processed );
 			if (printVerbose > 0)
@@ -3473,6 +4174,12 @@ next_arg:;
 		releaseParallelProcessor(PP);
 	}
 #endif
+	if (printVerbose > 0 && serialArena.allocationsAvoided) {
+		fprintf(stderr, "Recycled %0.2lf Kb in buffers, avoiding %llu allocations\n",
+				serialArena.bytesRecycled / 1024.0, serialArena.allocationsAvoided);
+	}
+	releaseBufferArena(&serialArena);
+	releaseBlobCache();
 // 	if (maxOutBufSize) {
 // 		fprintf(stderr, "maxOutBufSize: %zd\n", maxOutBufSize);
 // 	}
@@ -93,6 +93,8 @@ typedef struct __attribute__((packed)) {
 #endif
 
 extern int afsctool (int argc, const char * argv[]);
+extern const char *compressionTypeName(int type);
+extern int printVerbose;
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,355 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file blobcache.cpp
+ * (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * The compressed image cache. Images are kept in memory in the order they were added,
+ * the oldest being dropped when the cache exceeds its memory budget. The optional store
+ * directory holds one file per image, named after its key.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+
+#include <sparsehash/dense_hash_map>
+
+#undef MUTEXEX_CAN_TIMEOUT
+#include "CritSectEx/CritSectEx.h"
+
+#define CRITSECTLOCK	MutexEx
+
+#include "blobcache.h"
+
+namespace {
+
+struct BlobEntry {
+	unsigned int decmpfsSize;
+	size_t resourceForkSize;
+	double cpuTime;
+	// the decmpfs xattr followed by the resource fork
+	char *data;
+};
+
+// the header of the files in the store directory (which are not meant to be portable)
+struct BlobFileHeader {
+	char magic[8];
+	uint32_t decmpfsSize;
+	uint32_t reserved;
+	uint64_t resourceForkSize;
+	uint64_t cpuUSec;
+};
+const char blobFileMagic[8] = { 'a', 'f', 's', 'c', 'B', 'L', 'B', '1' };
+
+typedef google::dense_hash_map<std::string,BlobEntry*> BlobMap;
+
+BlobMap *blobMap = nullptr;
+std::deque<std::string> blobOrder;
+size_t blobMemory = 0, maxBlobMemory = 0;
+std::string storeDir;
+bool storeErrorReported = false;
+CRITSECTLOCK blobLock(4000);
+
+std::string keyName(const blob_cache_key *key)
+{
+	char name[128];
+	snprintf(name, sizeof(name), "%016llx-%llx-%d-%d%s%s",
+			 (unsigned long long) key->contentHash, (unsigned long long) key->filesize,
+			 key->comptype, key->compressionlevel,
+			 key->allowLargeBlocks ? "L" : "", key->shareChunks ? "D" : "");
+	return std::string(name);
+}
+
+// set up <image> with buffers from <arena> for the given sizes
+bool allocImage(compressed_image *image, unsigned int decmpfsSize, size_t resourceForkSize, buffer_arena *arena)
+{
+	if (decmpfsSize > MAX_DECMPFS_XATTR_SIZE
+		|| !(image->decmpfsBuf = arenaBuffer(arena, ARENA_DECMPFS, MAX_DECMPFS_XATTR_SIZE))) {
+		return false;
+	}
+	image->decmpfsSize = decmpfsSize;
+	image->resourceForkSize = resourceForkSize;
+	if (resourceForkSize) {
+		image->resourceFork = arenaBuffer(arena, ARENA_OUTBUF, resourceForkSize);
+		return image->resourceFork != NULL;
+	}
+	image->resourceFork = NULL;
+	return true;
+}
+
+// drop the oldest entries until <required> more bytes fit in the budget
+void makeRoom(size_t required)
+{
+	while (!blobOrder.empty() && blobMemory + required > maxBlobMemory) {
+		auto it = blobMap->find(blobOrder.front());
+		if (it != blobMap->end()) {
+			BlobEntry *entry = it->second;
+			blobMemory -= entry->decmpfsSize + entry->resourceForkSize;
+			free(entry->data);
+			delete entry;
+			blobMap->erase(it);
+		}
+		blobOrder.pop_front();
+	}
+}
+
+void addToMemory(const std::string &name, const compressed_image *image, double cpuTime)
+{
+	const size_t resourceForkSize = image->resourceFork ? image->resourceForkSize : 0;
+	const size_t size = image->decmpfsSize + resourceForkSize;
+	if (!blobMap || size > maxBlobMemory / 4) {
+		return;
+	}
+	char *data = (char*) malloc(size);
+	if (!data) {
+		return;
+	}
+	memcpy(data, image->decmpfsBuf, image->decmpfsSize);
+	if (image->resourceFork) {
+		memcpy(data + image->decmpfsSize, image->resourceFork, resourceForkSize);
+	}
+	CRITSECTLOCK::Scope scope(blobLock);
+	if (blobMap->count(name)) {
+		// another thread got there first
+		free(data);
+		return;
+	}
+	makeRoom(size);
+	BlobEntry *entry = new BlobEntry;
+	entry->decmpfsSize = image->decmpfsSize;
+	entry->resourceForkSize = resourceForkSize;
+	entry->cpuTime = cpuTime;
+	entry->data = data;
+	(*blobMap)[name] = entry;
+	blobOrder.push_back(name);
+	blobMemory += size;
+}
+
+bool lookupInMemory(const std::string &name, compressed_image *image, buffer_arena *arena, double *cpuTime)
+{
+	if (!blobMap) {
+		return false;
+	}
+	CRITSECTLOCK::Scope scope(blobLock);
+	auto it = blobMap->find(name);
+	if (it == blobMap->end()) {
+		return false;
+	}
+	const BlobEntry *entry = it->second;
+	if (!allocImage(image, entry->decmpfsSize, entry->resourceForkSize, arena)) {
+		return false;
+	}
+	memcpy(image->decmpfsBuf, entry->data, entry->decmpfsSize);
+	if (image->resourceFork) {
+		memcpy(image->resourceFork, entry->data + entry->decmpfsSize, entry->resourceForkSize);
+	}
+	*cpuTime = entry->cpuTime;
+	return true;
+}
+
+void forgetInMemory(const std::string &name)
+{
+	if (!blobMap) {
+		return;
+	}
+	CRITSECTLOCK::Scope scope(blobLock);
+	auto it = blobMap->find(name);
+	if (it != blobMap->end()) {
+		BlobEntry *entry = it->second;
+		blobMemory -= entry->decmpfsSize + entry->resourceForkSize;
+		free(entry->data);
+		delete entry;
+		blobMap->erase(it);
+		// this is rare (a hash collision), so a linear search is fine
+		auto order = std::find(blobOrder.begin(), blobOrder.end(), name);
+		if (order != blobOrder.end()) {
+			blobOrder.erase(order);
+		}
+	}
+}
+
+bool readFully(int fd, void *buf, size_t len)
+{
+	for (char *c = (char*) buf ; len > 0 ; ) {
+		ssize_t n = read(fd, c, len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		c += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool writeFully(int fd, const void *buf, size_t len)
+{
+	for (const char *c = (const char*) buf ; len > 0 ; ) {
+		ssize_t n = write(fd, c, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		c += n;
+		len -= n;
+	}
+	return true;
+}
+
+// read the image of <key>, stored under <name>. The files can be damaged or come from elsewhere,
+// so nothing is taken for granted before the chunks are decoded.
+bool lookupInStore(const blob_cache_key *key, const std::string &name, compressed_image *image,
+				   buffer_arena *arena, double *cpuTime)
+{
+	if (storeDir.empty()) {
+		return false;
+	}
+	const std::string path = storeDir + "/" + name;
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	BlobFileHeader header;
+	struct stat st;
+	bool ok = readFully(fd, &header, sizeof(header))
+		&& memcmp(header.magic, blobFileMagic, sizeof(blobFileMagic)) == 0
+		&& header.decmpfsSize >= sizeof(decmpfs_disk_header) && header.decmpfsSize <= MAX_DECMPFS_XATTR_SIZE
+		&& fstat(fd, &st) == 0
+		&& (uint64_t) st.st_size == sizeof(header) + header.decmpfsSize + header.resourceForkSize
+		&& allocImage(image, header.decmpfsSize, header.resourceForkSize, arena)
+		&& readFully(fd, image->decmpfsBuf, image->decmpfsSize)
+		&& (!image->resourceFork || readFully(fd, image->resourceFork, image->resourceForkSize))
+		&& checkImageHeader(image, key->comptype, key->filesize);
+	close(fd);
+	if (ok) {
+		*cpuTime = header.cpuUSec * 1e-6;
+	} else {
+		// a damaged or foreign file: get rid of it
+		unlink(path.c_str());
+	}
+	return ok;
+}
+
+void addToStore(const std::string &name, const compressed_image *image, double cpuTime)
+{
+	if (storeDir.empty()) {
+		return;
+	}
+	const std::string path = storeDir + "/" + name;
+	std::string tmpPath = path + ".XXXXXX";
+	int fd = mkstemp(&tmpPath[0]);
+	if (fd < 0) {
+		if (!storeErrorReported) {
+			fprintf(stderr, "%s: cannot add to the compressed image store (%s)\n", storeDir.c_str(), strerror(errno));
+			storeErrorReported = true;
+		}
+		return;
+	}
+	BlobFileHeader header;
+	memcpy(header.magic, blobFileMagic, sizeof(blobFileMagic));
+	header.decmpfsSize = image->decmpfsSize;
+	header.reserved = 0;
+	header.resourceForkSize = image->resourceFork ? image->resourceForkSize : 0;
+	header.cpuUSec = (uint64_t) (cpuTime * 1e6);
+	bool ok = writeFully(fd, &header, sizeof(header))
+		&& writeFully(fd, image->decmpfsBuf, image->decmpfsSize)
+		&& (!image->resourceFork || writeFully(fd, image->resourceFork, image->resourceForkSize));
+	if (close(fd) != 0) {
+		ok = false;
+	}
+	// rename() makes the complete file appear at once, also to concurrent runs
+	if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+		if (!storeErrorReported) {
+			fprintf(stderr, "%s: error writing to the compressed image store (%s)\n", storeDir.c_str(), strerror(errno));
+			storeErrorReported = true;
+		}
+		unlink(tmpPath.c_str());
+	}
+}
+
+// check that <image> decodes to the <filesize> bytes at <inBuf>
+bool imageMatches(const compressed_image *image, int comptype, const void *inBuf, off_t filesize, buffer_arena *arena)
+{
+	const unsigned int numBlocks = (filesize + DECMPFS_CHUNK_SIZE - 1) / DECMPFS_CHUNK_SIZE;
+	void *chunk = arenaBuffer(arena, ARENA_CHUNK, DECMPFS_CHUNK_SIZE);
+	return chunk && checkImageChunks(image, comptype, filesize, inBuf, NULL, 0, numBlocks, chunk, arena) == numBlocks;
+}
+
+} // namespace
+
+bool initBlobCache(size_t maxMemory, const char *dir)
+{
+	maxBlobMemory = maxMemory;
+	if (maxMemory && !blobMap) {
+		blobMap = new BlobMap;
+		blobMap->set_empty_key(std::string());
+		blobMap->set_deleted_key(std::string("-"));
+	}
+	if (dir) {
+		if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+			fprintf(stderr, "%s: cannot create the compressed image store (%s)\n", dir, strerror(errno));
+			return false;
+		}
+		storeDir = dir;
+	}
+	return true;
+}
+
+void releaseBlobCache()
+{
+	if (blobMap) {
+		CRITSECTLOCK::Scope scope(blobLock);
+		for (auto &it : *blobMap) {
+			free(it.second->data);
+			delete it.second;
+		}
+		delete blobMap;
+		blobMap = nullptr;
+		blobOrder.clear();
+		blobMemory = 0;
+	}
+}
+
+bool blobCacheLookup(const blob_cache_key *key, const void *inBuf, compressed_image *image,
+					 buffer_arena *arena, double *cpuTime)
+{
+	const std::string name = keyName(key);
+	if (lookupInMemory(name, image, arena, cpuTime)) {
+		if (imageMatches(image, key->comptype, inBuf, key->filesize, arena)) {
+			return true;
+		}
+		// not the same content after all
+		forgetInMemory(name);
+	} else if (lookupInStore(key, name, image, arena, cpuTime)) {
+		if (imageMatches(image, key->comptype, inBuf, key->filesize, arena)) {
+			addToMemory(name, image, *cpuTime);
+			return true;
+		}
+		unlink((storeDir + "/" + name).c_str());
+	}
+	image->decmpfsBuf = image->resourceFork = NULL;
+	image->decmpfsSize = 0;
+	image->resourceForkSize = 0;
+	return false;
+}
+
+void blobCacheStore(const blob_cache_key *key, const compressed_image *image, double cpuTime)
+{
+	const std::string name = keyName(key);
+	addToMemory(name, image, cpuTime);
+	addToStore(name, image, cpuTime);
+}
@@ -0,0 +1,57 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+
+/*
+ * @file blobcache.h
+ * @file blobcache.cpp
+ * (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * A cache of the compressed images of the files processed, addressed by their content,
+ * so that identical files need to be compressed only once. The cache is kept in memory
+ * for the duration of a run and can be backed by a directory to reuse the images across runs.
+ */
+
+#ifndef _BLOBCACHE_H
+
+#include "codecs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif //__cplusplus
+
+// the default amount of memory used to keep compressed images
+#define BLOB_CACHE_MEMORY	(64 * 1024 * 1024)
+
+// what identifies a compressed image: the file content and the settings it was compressed with
+typedef struct blob_cache_key {
+	// fileChecksumsHash() of the file content
+	uint64_t contentHash;
+	off_t filesize;
+	int comptype, compressionlevel;
+	bool allowLargeBlocks, shareChunks;
+} blob_cache_key;
+
+/**
+ * set up the cache to keep up to <maxMemory> bytes of compressed images in memory,
+ * and to store them in (and load them from) the directory <storeDir> if that is not NULL.
+ */
+extern bool initBlobCache(size_t maxMemory, const char *storeDir);
+extern void releaseBlobCache();
+
+/**
+ * look up the compressed image of the <key->filesize> bytes at <inBuf> and copy it into <image>,
+ * using the buffers of <arena>. A cached image is only returned when it decodes to the data at <inBuf>.
+ * <cpuTime> returns the CPU time it took to compress the image originally.
+ */
+extern bool blobCacheLookup(const blob_cache_key *key, const void *inBuf, compressed_image *image,
+							buffer_arena *arena, double *cpuTime);
+// add the freshly built <image> to the cache; it took <cpuTime> seconds of CPU time to compress.
+extern void blobCacheStore(const blob_cache_key *key, const compressed_image *image, double cpuTime);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#define _BLOBCACHE_H
+#endif //_BLOBCACHE_H
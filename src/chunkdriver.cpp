@@ -0,0 +1,841 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file chunkdriver.cpp
+ * Copyright "brkirch" (https://brkirch.wordpress.com/afsctool/)
+ * Parallel processing modifications and other tweaks (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * The drivers that build a file's compressed image. They are specialised at compile time
+ * for each codec and storage mode, so the chunk loop doesn't need to dispatch on the
+ * compression type for every chunk.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef __APPLE__
+#	include <endian.h>
+#	define OSSwapHostToBigInt16(x)		htobe16(x)
+#	define OSSwapHostToBigInt32(x)		htobe32(x)
+#	define OSSwapHostToLittleInt32(x)	htole32(x)
+#	define OSSwapHostToLittleInt64(x)	htole64(x)
+#	define OSSwapLittleToHostInt32(x)	le32toh(x)
+#	define OSSwapLittleToHostInt64(x)	le64toh(x)
+#endif
+
+#include <vector>
+
+#include "codecs.h"
+
+namespace {
+
+typedef enum StorageMode { DECMPFS_XATTR, RESOURCE_FORK } StorageMode;
+
+// the codec descriptions: the compression primitive and the resource fork layout.
+template <int T> struct Codec;
+
+template <> struct Codec<ZLIB>
+{
+	static const UInt32 xattrType = CMP_ZLIB_XATTR;
+	static const UInt32 resourceForkType = CMP_ZLIB_RESOURCE_FORK;
+	// chunks that don't compress can be stored as a 0xFF byte followed by the original data
+	static const bool supportsLargeBlocks = true;
+	static inline bool compress(chunk_compressor *compressor, const void *cursor, uLong len,
+								int blockNr, unsigned int numBlocks, unsigned long *cmpedsize)
+	{
+		return zlibCompressChunk(compressor, cursor, len, blockNr, numBlocks, cmpedsize);
+	}
+	// The resource fork starts with a 0x100 byte header and the 4-byte data length,
+	// followed by the block table (numBlocks + offset,blocksize pairs for each of the blocks,
+	// relative to the table) and the compressed data. It ends with a trailer.
+	static inline size_t headerSize(unsigned int numBlocks)
+	{
+		return 0x104 + sizeof(UInt32) + numBlocks * 8;
+	}
+	static inline void initHeader(char *outBuf, unsigned int numBlocks)
+	{
+		*(UInt32 *) outBuf = OSSwapHostToBigInt32(0x100);
+		*(UInt32 *) (outBuf + 12) = OSSwapHostToBigInt32(0x32);
+		memset(outBuf + 16, 0, 0xF0);
+		*(UInt32 *) (outBuf + 0x104) = OSSwapHostToLittleInt32(numBlocks);
+	}
+	static inline void addChunk(char *outBuf, unsigned int blockNr, size_t offset, unsigned long cmpedsize)
+	{
+		char *blockStart = outBuf + 0x104;
+		*(UInt32 *) (blockStart + (blockNr * 8) + 0x4) = OSSwapHostToLittleInt32(offset - 0x104);
+		*(UInt32 *) (blockStart + (blockNr * 8) + 0x8) = OSSwapHostToLittleInt32(cmpedsize);
+	}
+	// every block has its own (offset,size) entry, so identical blocks can point to the same data
+	static const bool supportsSharedChunks = true;
+	static inline void shareChunk(char *outBuf, unsigned int blockNr, unsigned int original)
+	{
+		char *blockStart = outBuf + 0x104;
+		memcpy(blockStart + (blockNr * 8) + 0x4, blockStart + (original * 8) + 0x4, 8);
+	}
+	static const size_t trailerSize = sizeof(decmpfs_resource_zlib_trailer);
+	static inline void finish(char *outBuf, size_t dataEnd)
+	{
+		*(UInt32 *) (outBuf + 4) = OSSwapHostToBigInt32(dataEnd);
+		*(UInt32 *) (outBuf + 8) = OSSwapHostToBigInt32(dataEnd - 0x100);
+		*(UInt32 *) (outBuf + 0x100) = OSSwapHostToBigInt32(dataEnd - 0x104);
+		decmpfs_resource_zlib_trailer *resourceTrailer = (decmpfs_resource_zlib_trailer*) (outBuf + dataEnd);
+		memset(&resourceTrailer->empty[0], 0, 24);
+		resourceTrailer->magic1 = OSSwapHostToBigInt16(0x1C);
+		resourceTrailer->magic2 = OSSwapHostToBigInt16(0x32);
+		resourceTrailer->spacer1 = 0;
+		resourceTrailer->compression_magic = OSSwapHostToBigInt32(DECMPFS_MAGIC);
+		resourceTrailer->magic3 = OSSwapHostToBigInt32(0xA);
+		resourceTrailer->magic4 = OSSwapHostToLittleInt64(0xFFFF0100);
+		resourceTrailer->spacer2 = 0;
+	}
+	// the inverse operations, for decoding:
+	// (the offset of a chunk is returned relative to <outBuf>)
+	static inline void chunkAt(const char *outBuf, unsigned int blockNr, size_t *offset, size_t *cmpedsize)
+	{
+		const char *blockStart = outBuf + 0x104;
+		*offset = 0x104 + (size_t) OSSwapLittleToHostInt32(*(UInt32 *) (blockStart + (blockNr * 8) + 0x4));
+		*cmpedsize = OSSwapLittleToHostInt32(*(UInt32 *) (blockStart + (blockNr * 8) + 0x8));
+	}
+	static inline ssize_t decompress(codec_state *state, const void *cmpedChunk, size_t cmpedsize, void *outBuf)
+	{
+		if (cmpedsize > 0 && *(const unsigned char *) cmpedChunk == 0xFF) {
+			if (cmpedsize - 1 > DECMPFS_CHUNK_SIZE) {
+				return -1;
+			}
+			memcpy(outBuf, (const char*) cmpedChunk + 1, cmpedsize - 1);
+			return cmpedsize - 1;
+		}
+		return zlibDecompressChunk(state, cmpedChunk, cmpedsize, outBuf);
+	}
+};
+
+#if defined HAS_LZVN || defined HAS_LZFSE
+// LZVN and LZFSE resource forks start with a table of chunk offsets (see lz_chunk_table)
+// followed by the compressed data.
+struct LZChunkTableLayout
+{
+	static const bool supportsLargeBlocks = false;
+	static inline size_t headerSize(unsigned int numBlocks)
+	{
+		// The chunk table stores the offset of every block, and the offset of where a next block _would_ go,
+		// so we need numBlocks + 1 items
+		return (numBlocks + 1) * sizeof(lz_chunk_table);
+	}
+	static inline void initHeader(char *outBuf, unsigned int numBlocks)
+	{
+		((lz_chunk_table*) outBuf)[0] = headerSize(numBlocks);
+	}
+	static inline void addChunk(char *outBuf, unsigned int blockNr, size_t offset, unsigned long cmpedsize)
+	{
+		// next offset will start at this offset
+		((lz_chunk_table*) outBuf)[blockNr + 1] = offset + cmpedsize;
+	}
+	// chunk sizes follow from consecutive offsets, so chunks cannot be shared
+	static const bool supportsSharedChunks = false;
+	static inline void shareChunk(char *, unsigned int, unsigned int)
+	{}
+	static const size_t trailerSize = 0;
+	static inline void finish(char *, size_t)
+	{}
+	static inline void chunkAt(const char *outBuf, unsigned int blockNr, size_t *offset, size_t *cmpedsize)
+	{
+		const lz_chunk_table *table = (const lz_chunk_table*) outBuf;
+		*offset = table[blockNr];
+		// (offsets that go backwards give a size that can't fit)
+		*cmpedsize = (table[blockNr + 1] >= table[blockNr])? table[blockNr + 1] - table[blockNr] : (size_t) -1;
+	}
+};
+#endif
+
+#ifdef HAS_LZVN
+template <> struct Codec<LZVN> : public LZChunkTableLayout
+{
+	static const UInt32 xattrType = CMP_LZVN_XATTR;
+	static const UInt32 resourceForkType = CMP_LZVN_RESOURCE_FORK;
+	static inline bool compress(chunk_compressor *compressor, const void *cursor, uLong len,
+								int blockNr, unsigned int numBlocks, unsigned long *cmpedsize)
+	{
+		return lzvnCompressChunk(compressor, cursor, len, blockNr, numBlocks, cmpedsize);
+	}
+	static inline ssize_t decompress(codec_state *state, const void *cmpedChunk, size_t cmpedsize, void *outBuf)
+	{
+		return lzvnDecompressChunk(state, cmpedChunk, cmpedsize, outBuf);
+	}
+};
+#endif
+
+#ifdef HAS_LZFSE
+template <> struct Codec<LZFSE> : public LZChunkTableLayout
+{
+	static const UInt32 xattrType = CMP_LZFSE_XATTR;
+	static const UInt32 resourceForkType = CMP_LZFSE_RESOURCE_FORK;
+	static inline bool compress(chunk_compressor *compressor, const void *cursor, uLong len,
+								int blockNr, unsigned int numBlocks, unsigned long *cmpedsize)
+	{
+		return lzfseCompressChunk(compressor, cursor, len, blockNr, numBlocks, cmpedsize);
+	}
+	static inline ssize_t decompress(codec_state *state, const void *cmpedChunk, size_t cmpedsize, void *outBuf)
+	{
+		return lzfseDecompressChunk(state, cmpedChunk, cmpedsize, outBuf);
+	}
+};
+#endif
+
+/**
+ * The compressed representation of full chunks that repeat a single byte value (typically
+ * zeroes), per codec, compression level and byte value. Entries are created on first use and
+ * shared by all threads for the lifetime of the process.
+ */
+struct cached_chunk {
+	unsigned long size;
+	char data[1];
+};
+
+template <int T> struct ConstantChunkCache
+{
+	static cached_chunk *entries[10][256];
+	static inline cached_chunk *&entry(int level, unsigned char byte)
+	{
+		return entries[(level >= 0 && level <= 9)? level : 0][byte];
+	}
+	// the cached chunk, if any. Entries are published with a compare-and-swap (a full barrier),
+	// so the acquire load guarantees that its size and data are seen as they were written.
+	static inline const cached_chunk *lookup(int level, unsigned char byte)
+	{
+		return __atomic_load_n(&entry(level, byte), __ATOMIC_ACQUIRE);
+	}
+	// remember the chunk just compressed by <compressor>, unless another thread got there first.
+	static void store(const chunk_compressor *compressor, unsigned char byte, unsigned long cmpedsize)
+	{
+		cached_chunk *chunk = (cached_chunk*) malloc(sizeof(cached_chunk) + cmpedsize);
+		if (chunk) {
+			chunk->size = cmpedsize;
+			memcpy(chunk->data, compressor->outBufBlock, cmpedsize);
+			if (!__sync_bool_compare_and_swap(&entry(compressor->compressionlevel, byte), (cached_chunk*) NULL, chunk)) {
+				free(chunk);
+			}
+		}
+	}
+};
+template <int T> cached_chunk *ConstantChunkCache<T>::entries[10][256];
+
+// store a chunk uncompressed, in the format of codecs that support it
+inline void storeRawChunk(chunk_compressor *compressor, const void *cursor, uLong len, unsigned long *cmpedsize)
+{
+	*(unsigned char *) compressor->outBufBlock = 0xFF;
+	memcpy((char*) compressor->outBufBlock + 1, cursor, len);
+	*cmpedsize = len + 1;
+}
+
+template <int T>
+inline bool compressChunkWith(chunk_compressor *compressor, const void *cursor, uLong len,
+							  int blockNr, unsigned int numBlocks, unsigned long *cmpedsize)
+{
+	unsigned char constantByte;
+	const bool isConstant = len == DECMPFS_CHUNK_SIZE && chunkIsConstant(cursor, len, &constantByte);
+	if (isConstant) {
+		// a run of identical bytes, most likely zeroes: reuse the result from the previous time
+		const cached_chunk *cached = ConstantChunkCache<T>::lookup(compressor->compressionlevel, constantByte);
+		if (cached && cached->size <= compressor->outBufBlockSize) {
+			memcpy(compressor->outBufBlock, cached->data, cached->size);
+			*cmpedsize = cached->size;
+			return true;
+		}
+	} else if (Codec<T>::supportsLargeBlocks && compressor->allowLargeBlocks
+		&& len == DECMPFS_CHUNK_SIZE && chunkLooksIncompressible(cursor, len))
+	{
+		// random-looking data: compressing it would only make it larger
+		storeRawChunk(compressor, cursor, len, cmpedsize);
+		return true;
+	}
+	if (!Codec<T>::compress(compressor, cursor, len, blockNr, numBlocks, cmpedsize)) {
+		return false;
+	}
+	if (isConstant && *cmpedsize <= len) {
+		ConstantChunkCache<T>::store(compressor, constantByte, *cmpedsize);
+	}
+	if (Codec<T>::supportsLargeBlocks && *cmpedsize > len)
+	{
+		if (!compressor->allowLargeBlocks && len == DECMPFS_CHUNK_SIZE)
+		{
+			if (printVerbose >= 2) {
+				fprintf(stderr, "%s: file has a compressed chunk that's larger than the original chunk; -L to compress\n",
+						compressor->inFile);
+			}
+			return false;
+		}
+		storeRawChunk(compressor, cursor, len, cmpedsize);
+	}
+	return true;
+}
+
+/**
+ * the chunks of a file seen so far, by the hash of their content (uncompressed or compressed):
+ * an open-addressing table of (hash, chunk) pairs. Chunks with the same hash are told apart
+ * by the caller, who compares their content.
+ */
+class ChunkIndex
+{
+public:
+	ChunkIndex()
+		: mask(0)
+		, count(0)
+	{}
+	void init(unsigned int numBlocks)
+	{
+		size_t size = 16;
+		while (size < 2 * (size_t) numBlocks) {
+			size *= 2;
+		}
+		slots.assign(size, Slot());
+		mask = size - 1;
+		count = 0;
+	}
+	inline bool isValid() const
+	{
+		return !slots.empty();
+	}
+	// find a chunk with hash <hash> for which <same(chunk)> returns true
+	template <class Pred> bool find(UInt64 hash, Pred same, unsigned int *blockNr) const
+	{
+		for (size_t i = hash & mask ; slots[i].used ; i = (i + 1) & mask) {
+			if (slots[i].hash == hash && same(slots[i].blockNr)) {
+				*blockNr = slots[i].blockNr;
+				return true;
+			}
+		}
+		return false;
+	}
+	void add(UInt64 hash, unsigned int blockNr)
+	{
+		// init() sized the table so that it can never fill up
+		size_t i = hash & mask;
+		while (slots[i].used) {
+			i = (i + 1) & mask;
+		}
+		slots[i].hash = hash;
+		slots[i].blockNr = blockNr;
+		slots[i].used = true;
+		count += 1;
+	}
+private:
+	struct Slot {
+		UInt64 hash;
+		unsigned int blockNr;
+		bool used;
+		Slot() : hash(0), blockNr(0), used(false) {}
+	};
+	std::vector<Slot> slots;
+	size_t mask, count;
+};
+
+// chunk sources: provide compressed chunk <blockNr>, in order. Sources that have the file's
+// whole content at hand can also recognise chunks identical to an earlier one before compressing them.
+
+// compresses the chunks on demand
+template <int T> class CompressingSource
+{
+public:
+	CompressingSource(chunk_compressor *compressor, const void *inBuf, off_t filesize, unsigned int numBlocks)
+		: compressor(compressor)
+		, inBuf((const char*) inBuf)
+		, filesize(filesize)
+		, numBlocks(numBlocks)
+	{}
+	inline bool chunk(unsigned int blockNr, const void **cmpedChunk, unsigned long *cmpedsize)
+	{
+		off_t inBufPos = (off_t) blockNr * DECMPFS_CHUNK_SIZE;
+		uLong bytesAfterCursor = ((filesize - inBufPos) > DECMPFS_CHUNK_SIZE) ? DECMPFS_CHUNK_SIZE : filesize - inBufPos;
+		if (!compressChunkWith<T>(compressor, inBuf + inBufPos, bytesAfterCursor, blockNr, numBlocks, cmpedsize)) {
+			return false;
+		}
+		*cmpedChunk = compressor->outBufBlock;
+		return true;
+	}
+	// is chunk <blockNr> identical to an earlier chunk (returned in <original>)?
+	bool duplicate(unsigned int blockNr, unsigned int *original)
+	{
+		if (!index.isValid()) {
+			index.init(numBlocks);
+		}
+		const char *data = inBuf + (off_t) blockNr * DECMPFS_CHUNK_SIZE;
+		const size_t len = chunkLength(blockNr);
+		const UInt64 hash = checksum64(data, len);
+		if (index.find(hash, [&](unsigned int other) {
+				return chunkLength(other) == len
+					&& memcmp(inBuf + (off_t) other * DECMPFS_CHUNK_SIZE, data, len) == 0;
+			}, original)) {
+			return true;
+		}
+		index.add(hash, blockNr);
+		return false;
+	}
+private:
+	inline size_t chunkLength(unsigned int blockNr) const
+	{
+		off_t inBufPos = (off_t) blockNr * DECMPFS_CHUNK_SIZE;
+		return ((filesize - inBufPos) > DECMPFS_CHUNK_SIZE) ? DECMPFS_CHUNK_SIZE : filesize - inBufPos;
+	}
+	chunk_compressor *compressor;
+	const char *inBuf;
+	const off_t filesize;
+	const unsigned int numBlocks;
+	ChunkIndex index;
+};
+
+// picks up the chunks compressed beforehand, numbered from <firstBlock>
+class PrecompressedSource
+{
+public:
+	PrecompressedSource(const precompressed_chunks *chunks, unsigned int firstBlock = 0)
+		: chunks(chunks)
+		, firstBlock(firstBlock)
+		, rangeOffset(0)
+	{}
+	inline bool chunk(unsigned int blockNr, const void **cmpedChunk, unsigned long *cmpedsize)
+	{
+		blockNr -= firstBlock;
+		if (blockNr % chunks->rangeBlocks == 0) {
+			rangeOffset = 0;
+		}
+		*cmpedChunk = (const char*) chunks->ranges[blockNr / chunks->rangeBlocks].buf + rangeOffset;
+		*cmpedsize = chunks->chunkSizes[blockNr];
+		rangeOffset += *cmpedsize;
+		return true;
+	}
+	inline bool isValid() const
+	{
+		return chunks != NULL;
+	}
+	inline bool duplicate(unsigned int, unsigned int *)
+	{
+		return false;
+	}
+private:
+	const precompressed_chunks *chunks;
+	unsigned int firstBlock;
+	size_t rangeOffset;
+};
+
+// reads the file window by window, compressing the chunks on demand
+// unless the window came with its chunks compressed.
+template <int T> class StreamingSource
+{
+public:
+	StreamingSource(chunk_stream *stream, chunk_compressor *compressor)
+		: stream(stream)
+		, compressor(compressor)
+		, precompressed(NULL)
+	{}
+	inline bool chunk(unsigned int blockNr, const void **cmpedChunk, unsigned long *cmpedsize)
+	{
+		if (blockNr < stream->windowStart || blockNr >= stream->windowStart + stream->windowBlocks) {
+			const precompressed_chunks *chunks = NULL;
+			if (stream->loadWindow) {
+				if (!stream->loadWindow(stream, blockNr, &chunks)) {
+					return false;
+				}
+			} else if (!readChunkWindow(stream, blockNr)) {
+				return false;
+			}
+			precompressed = PrecompressedSource(chunks, blockNr);
+		}
+		if (precompressed.isValid()) {
+			return precompressed.chunk(blockNr, cmpedChunk, cmpedsize);
+		}
+		size_t offset = (size_t) (blockNr - stream->windowStart) * DECMPFS_CHUNK_SIZE;
+		uLong len = MIN(DECMPFS_CHUNK_SIZE, stream->windowLength - offset);
+		if (!compressChunkWith<T>(compressor, (const char*) stream->window + offset, len,
+								  blockNr, stream->numBlocks, cmpedsize)) {
+			return false;
+		}
+		*cmpedChunk = compressor->outBufBlock;
+		return true;
+	}
+	// earlier chunks may no longer be in the window
+	inline bool duplicate(unsigned int, unsigned int *)
+	{
+		return false;
+	}
+private:
+	chunk_stream *stream;
+	chunk_compressor *compressor;
+	PrecompressedSource precompressed;
+};
+
+// the drivers, per storage mode.
+template <int T, StorageMode S> struct ChunkDriver;
+
+// a single chunk stored directly in the decmpfs attribute, after its header.
+template <int T> struct ChunkDriver<T, DECMPFS_XATTR>
+{
+	static inline bool fits(const compressed_image *image, unsigned long cmpedsize)
+	{
+		return image->decmpfsSize + cmpedsize <= MAX_DECMPFS_XATTR_SIZE;
+	}
+	static bool store(compressed_image *image, const void *cmpedChunk, unsigned long cmpedsize)
+	{
+		decmpfs_disk_header *decmpfsAttr = (decmpfs_disk_header*) image->decmpfsBuf;
+		decmpfsAttr->compression_type = OSSwapHostToLittleInt32(Codec<T>::xattrType);
+		memcpy((char*) image->decmpfsBuf + image->decmpfsSize, cmpedChunk, cmpedsize);
+		image->decmpfsSize += cmpedsize;
+		return true;
+	}
+};
+
+// the chunks stored in the resource fork, which grows as needed.
+template <int T> struct ChunkDriver<T, RESOURCE_FORK>
+{
+	// <firstChunk> is chunk 0 when the caller already obtained it.
+	template <class Source>
+	static bool build(compressed_image *image, Source &source, const char *inFile, unsigned int numBlocks,
+					  buffer_arena *arena, const void *firstChunk, unsigned long firstSize)
+	{
+		size_t outBufSize = Codec<T>::headerSize(numBlocks);
+		char *outBuf = (char*) arenaReserve(arena, ARENA_OUTBUF, outBufSize + DECMPFS_CHUNK_SIZE);
+		if (!outBuf) {
+			fprintf(stderr, "%s: malloc error, unable to allocate output buffer of %lu bytes (%s)\n",
+					inFile, (unsigned long) outBufSize, strerror(errno));
+			return false;
+		}
+		Codec<T>::initHeader(outBuf, numBlocks);
+		// the compressed chunks stored so far, when identical chunks are to be stored only once
+		ChunkIndex stored;
+		const bool share = Codec<T>::supportsSharedChunks && image->shareChunks;
+		if (share) {
+			stored.init(numBlocks);
+		}
+		image->sharedChunks = 0;
+		for (unsigned int blockNr = 0 ; blockNr < numBlocks ; ++blockNr) {
+			const void *cmpedChunk;
+			unsigned long cmpedsize;
+			unsigned int original;
+			if (share && source.duplicate(blockNr, &original)) {
+				// no need to compress what we've seen before
+				Codec<T>::shareChunk(outBuf, blockNr, original);
+				image->sharedChunks += 1;
+				continue;
+			}
+			if (blockNr == 0 && firstChunk) {
+				cmpedChunk = firstChunk, cmpedsize = firstSize;
+			} else if (!source.chunk(blockNr, &cmpedChunk, &cmpedsize)) {
+				return false;
+			}
+			if (share) {
+				// identical compressed chunks have identical content
+				const UInt64 hash = checksum64(cmpedChunk, cmpedsize);
+				if (stored.find(hash, [&](unsigned int other) {
+						size_t otherOffset, otherSize;
+						Codec<T>::chunkAt(outBuf, other, &otherOffset, &otherSize);
+						return otherSize == cmpedsize && memcmp(outBuf + otherOffset, cmpedChunk, cmpedsize) == 0;
+					}, &original)) {
+					Codec<T>::shareChunk(outBuf, blockNr, original);
+					image->sharedChunks += 1;
+					continue;
+				}
+				stored.add(hash, blockNr);
+			}
+			const size_t required = outBufSize + cmpedsize + Codec<T>::trailerSize;
+			if (!(outBuf = (char*) arenaReserve(arena, ARENA_OUTBUF, required))) {
+				fprintf(stderr, "%s: malloc error, unable to increase output buffer to %lu bytes (%s)\n",
+						inFile, (unsigned long) required, strerror(errno));
+				return false;
+			}
+			memcpy(outBuf + outBufSize, cmpedChunk, cmpedsize);
+			Codec<T>::addChunk(outBuf, blockNr, outBufSize, cmpedsize);
+			outBufSize += cmpedsize;
+			if (image->sizeLimit
+				&& outBufSize + Codec<T>::trailerSize + image->decmpfsSize >= image->sizeLimit) {
+				// the image can only grow, so it will never be small enough.
+				image->aborted = true;
+				image->processedBlocks = blockNr + 1;
+				return false;
+			}
+		}
+		Codec<T>::finish(outBuf, outBufSize);
+		image->resourceFork = outBuf;
+		image->resourceForkSize = outBufSize + Codec<T>::trailerSize;
+		return true;
+	}
+};
+
+template <int T, class Source>
+bool buildImage(compressed_image *image, Source &source, const char *inFile, off_t filesize,
+				unsigned int numBlocks, buffer_arena *arena)
+{
+	// The header of the decmpfs attribute (16 bytes):
+	decmpfs_disk_header *decmpfsAttr = (decmpfs_disk_header*) image->decmpfsBuf;
+	// compression magic number
+	decmpfsAttr->compression_magic = OSSwapHostToLittleInt32(DECMPFS_MAGIC);
+	// the compression type: data in the resource fork unless it fits in the attribute.
+	// FWIW, libarchive has the following comment in archive_write_disk_posix.c :
+	//* If the compressed size is smaller than MAX_DECMPFS_XATTR_SIZE [3802]
+	//* and the block count in the file is only one, store compressed
+	//* data to decmpfs xattr instead of the resource fork.
+	// We do the same.
+	decmpfsAttr->compression_type = OSSwapHostToLittleInt32(Codec<T>::resourceForkType);
+	// the uncompressed filesize
+	decmpfsAttr->uncompressed_size = OSSwapHostToLittleInt64(filesize);
+	image->decmpfsSize = sizeof(decmpfs_disk_header);
+	image->resourceFork = NULL;
+	image->resourceForkSize = 0;
+	image->aborted = false;
+
+	if (numBlocks <= 1) {
+		const void *cmpedChunk;
+		unsigned long cmpedsize;
+		if (!source.chunk(0, &cmpedChunk, &cmpedsize)) {
+			return false;
+		}
+		if (ChunkDriver<T, DECMPFS_XATTR>::fits(image, cmpedsize)) {
+			return ChunkDriver<T, DECMPFS_XATTR>::store(image, cmpedChunk, cmpedsize);
+		}
+		return ChunkDriver<T, RESOURCE_FORK>::build(image, source, inFile, numBlocks, arena, cmpedChunk, cmpedsize);
+	}
+	return ChunkDriver<T, RESOURCE_FORK>::build(image, source, inFile, numBlocks, arena, NULL, 0);
+}
+
+template <int T>
+bool buildImageWith(compressed_image *image, const char *inFile, const void *inBuf, off_t filesize,
+					chunk_compressor *compressor, const precompressed_chunks *precompressed, buffer_arena *arena)
+{
+	const unsigned int numBlocks = (filesize + DECMPFS_CHUNK_SIZE - 1) / DECMPFS_CHUNK_SIZE;
+	if (precompressed) {
+		PrecompressedSource source(precompressed);
+		return buildImage<T>(image, source, inFile, filesize, numBlocks, arena);
+	} else {
+		CompressingSource<T> source(compressor, inBuf, filesize, numBlocks);
+		return buildImage<T>(image, source, inFile, filesize, numBlocks, arena);
+	}
+}
+
+template <int T>
+bool checkHeaderWith(const compressed_image *image, off_t filesize)
+{
+	const decmpfs_disk_header *decmpfsAttr = (const decmpfs_disk_header*) image->decmpfsBuf;
+	const unsigned int numBlocks = (filesize + DECMPFS_CHUNK_SIZE - 1) / DECMPFS_CHUNK_SIZE;
+	if (image->decmpfsSize < sizeof(decmpfs_disk_header)
+		|| OSSwapLittleToHostInt32(decmpfsAttr->compression_magic) != DECMPFS_MAGIC
+		|| (off_t) OSSwapLittleToHostInt64(decmpfsAttr->uncompressed_size) != filesize) {
+		return false;
+	}
+	if (image->resourceFork) {
+		return OSSwapLittleToHostInt32(decmpfsAttr->compression_type) == Codec<T>::resourceForkType
+			&& image->resourceForkSize >= Codec<T>::headerSize(numBlocks);
+	}
+	return OSSwapLittleToHostInt32(decmpfsAttr->compression_type) == Codec<T>::xattrType && numBlocks <= 1;
+}
+
+template <int T>
+ssize_t decodeChunkWith(codec_state *state, const compressed_image *image, unsigned int blockNr, void *outBuf)
+{
+	const char *cmpedChunk;
+	size_t cmpedsize;
+	if (image->resourceFork) {
+		// the image may come from elsewhere (the image store): check that the table entry
+		// and the chunk it points to lie within the resource fork, without overflowing.
+		const size_t size = image->resourceForkSize;
+		size_t offset;
+		if (Codec<T>::headerSize(blockNr + 1) > size) {
+			return -1;
+		}
+		Codec<T>::chunkAt((const char*) image->resourceFork, blockNr, &offset, &cmpedsize);
+		if (offset > size || cmpedsize > size - offset) {
+			return -1;
+		}
+		cmpedChunk = (const char*) image->resourceFork + offset;
+	} else if (blockNr == 0 && image->decmpfsSize >= sizeof(decmpfs_disk_header)) {
+		cmpedChunk = (const char*) image->decmpfsBuf + sizeof(decmpfs_disk_header);
+		cmpedsize = image->decmpfsSize - sizeof(decmpfs_disk_header);
+	} else {
+		return -1;
+	}
+	return Codec<T>::decompress(state, cmpedChunk, cmpedsize, outBuf);
+}
+
+} // namespace
+
+bool compressChunk(chunk_compressor *compressor, const void *cursor, uLong len,
+				   int blockNr, unsigned int numBlocks, unsigned long *cmpedsize)
+{
+	switch (compressor->comptype) {
+		case ZLIB:
+			return compressChunkWith<ZLIB>(compressor, cursor, len, blockNr, numBlocks, cmpedsize);
+#ifdef HAS_LZVN
+		case LZVN:
+			return compressChunkWith<LZVN>(compressor, cursor, len, blockNr, numBlocks, cmpedsize);
+#endif
+#ifdef HAS_LZFSE
+		case LZFSE:
+			return compressChunkWith<LZFSE>(compressor, cursor, len, blockNr, numBlocks, cmpedsize);
+#endif
+		default:
+			return false;
+	}
+}
+
+bool buildCompressedImage(compressed_image *image, const char *inFile, const void *inBuf, off_t filesize, int comptype,
+						  chunk_compressor *compressor, const precompressed_chunks *precompressed,
+						  buffer_arena *arena)
+{
+	image->decmpfsBuf = arenaBuffer(arena, ARENA_DECMPFS, MAX_DECMPFS_XATTR_SIZE);
+	if (image->decmpfsBuf == NULL)
+	{
+		fprintf(stderr, "%s: malloc error, unable to allocate xattr buffer (%d bytes; %s)\n",
+				inFile, MAX_DECMPFS_XATTR_SIZE, strerror(errno));
+		return false;
+	}
+	switch (comptype) {
+		case ZLIB:
+			return buildImageWith<ZLIB>(image, inFile, inBuf, filesize, compressor, precompressed, arena);
+#ifdef HAS_LZVN
+		case LZVN:
+			return buildImageWith<LZVN>(image, inFile, inBuf, filesize, compressor, precompressed, arena);
+#endif
+#ifdef HAS_LZFSE
+		case LZFSE:
+			return buildImageWith<LZFSE>(image, inFile, inBuf, filesize, compressor, precompressed, arena);
+#endif
+		default:
+			fprintf(stderr, "%s: unsupported compression type %d (%s)\n",
+					inFile, comptype, compressionTypeName(comptype));
+			return false;
+	}
+}
+
+bool buildStreamedImage(compressed_image *image, chunk_stream *stream, int comptype,
+						chunk_compressor *compressor, buffer_arena *arena)
+{
+	image->decmpfsBuf = arenaBuffer(arena, ARENA_DECMPFS, MAX_DECMPFS_XATTR_SIZE);
+	if (image->decmpfsBuf == NULL)
+	{
+		fprintf(stderr, "%s: malloc error, unable to allocate xattr buffer (%d bytes; %s)\n",
+				stream->inFile, MAX_DECMPFS_XATTR_SIZE, strerror(errno));
+		return false;
+	}
+	switch (comptype) {
+		case ZLIB: {
+			StreamingSource<ZLIB> source(stream, compressor);
+			return buildImage<ZLIB>(image, source, stream->inFile, stream->filesize, stream->numBlocks, arena);
+		}
+#ifdef HAS_LZVN
+		case LZVN: {
+			StreamingSource<LZVN> source(stream, compressor);
+			return buildImage<LZVN>(image, source, stream->inFile, stream->filesize, stream->numBlocks, arena);
+		}
+#endif
+#ifdef HAS_LZFSE
+		case LZFSE: {
+			StreamingSource<LZFSE> source(stream, compressor);
+			return buildImage<LZFSE>(image, source, stream->inFile, stream->filesize, stream->numBlocks, arena);
+		}
+#endif
+		default:
+			fprintf(stderr, "%s: unsupported compression type %d (%s)\n",
+					stream->inFile, comptype, compressionTypeName(comptype));
+			return false;
+	}
+}
+
+bool checkImageHeader(const compressed_image *image, int comptype, off_t filesize)
+{
+	switch (comptype) {
+		case ZLIB:
+			return checkHeaderWith<ZLIB>(image, filesize);
+#ifdef HAS_LZVN
+		case LZVN:
+			return checkHeaderWith<LZVN>(image, filesize);
+#endif
+#ifdef HAS_LZFSE
+		case LZFSE:
+			return checkHeaderWith<LZFSE>(image, filesize);
+#endif
+		default:
+			return false;
+	}
+}
+
+ssize_t decodeImageChunk(codec_state *state, const compressed_image *image, int comptype,
+						 unsigned int blockNr, void *outBuf)
+{
+	switch (comptype) {
+		case ZLIB:
+			return decodeChunkWith<ZLIB>(state, image, blockNr, outBuf);
+#ifdef HAS_LZVN
+		case LZVN:
+			return decodeChunkWith<LZVN>(state, image, blockNr, outBuf);
+#endif
+#ifdef HAS_LZFSE
+		case LZFSE:
+			return decodeChunkWith<LZFSE>(state, image, blockNr, outBuf);
+#endif
+		default:
+			return -1;
+	}
+}
+
+unsigned int checkImageChunks(const compressed_image *image, int comptype, off_t filesize,
+							  const void *inBuf, const UInt64 *checksums,
+							  unsigned int first, unsigned int last, void *chunkBuf,
+							  buffer_arena *arena)
+{
+	codec_state *state = arenaCodecState(arena);
+	if (first == 0 && !checkImageHeader(image, comptype, filesize)) {
+		return first;
+	}
+	for (unsigned int blockNr = first ; blockNr < last ; ++blockNr) {
+		const off_t offset = (off_t) blockNr * DECMPFS_CHUNK_SIZE;
+		const ssize_t expected = MIN(DECMPFS_CHUNK_SIZE, filesize - offset);
+		if (decodeImageChunk(state, image, comptype, blockNr, chunkBuf) != expected
+			|| (inBuf && memcmp(chunkBuf, (const char*) inBuf + offset, expected) != 0)
+			|| (!inBuf && (!checksums || checksum64(chunkBuf, expected) != checksums[blockNr]))) {
+			return blockNr;
+		}
+	}
+	return last;
+}
+
+bool writeDecodedImage(const compressed_image *image, int comptype, int fd, const char *inFile)
+{
+	const decmpfs_disk_header *decmpfsAttr = (const decmpfs_disk_header*) image->decmpfsBuf;
+	if (image->decmpfsSize < sizeof(decmpfs_disk_header)) {
+		fprintf(stderr, "%s: the compressed data has no valid header\n", inFile);
+		return false;
+	}
+	const off_t filesize = OSSwapLittleToHostInt64(decmpfsAttr->uncompressed_size);
+	const unsigned int numBlocks = (filesize + DECMPFS_CHUNK_SIZE - 1) / DECMPFS_CHUNK_SIZE;
+	char *outBuf = (char*) malloc(DECMPFS_CHUNK_SIZE);
+	bool ok = outBuf != NULL;
+
+	if (!outBuf) {
+		fprintf(stderr, "%s: malloc error, unable to allocate decoding buffer (%s)\n", inFile, strerror(errno));
+	}
+	for (unsigned int blockNr = 0 ; ok && blockNr < numBlocks ; ++blockNr) {
+		// (a rare fallback, for which setting up decoder state is not worth it)
+		ssize_t len = decodeImageChunk(NULL, image, comptype, blockNr, outBuf);
+		if (len < 0) {
+			fprintf(stderr, "%s: failure decoding chunk #%u of the compressed data\n", inFile, blockNr);
+			ok = false;
+			break;
+		}
+		for (char *c = outBuf ; len > 0 ; ) {
+			ssize_t written = write(fd, c, len);
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				fprintf(stderr, "%s: Error restoring file (chunk #%u; %s)\n", inFile, blockNr, strerror(errno));
+				ok = false;
+				break;
+			}
+			c += written;
+			len -= written;
+		}
+	}
+	free(outBuf);
+	return ok;
+}
@@ -0,0 +1,548 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file codecs.c
+ * Copyright "brkirch" (https://brkirch.wordpress.com/afsctool/)
+ * Parallel processing modifications and other tweaks (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#ifdef HAS_LIBDEFLATE
+#	include <libdeflate.h>
+#endif
+#ifdef HAS_LZVN
+#	include "private/lzfse/src/lzfse_internal.h"
+#endif
+#ifdef HAS_LZFSE
+#	include "private/lzfse/src/lzfse.h"
+#endif
+
+#ifndef __APPLE__
+#	include <bsd/stdlib.h>
+#endif
+
+#include "codecs.h"
+
+#define xfree(x)		if((x)){free((x)); (x)=NULL;}
+
+/**
+ * codec state that is expensive to set up, and that is thus kept for the lifetime of
+ * a buffer_arena (i.e. of a worker thread) instead of being recreated for every chunk.
+ */
+struct codec_state {
+	// deflate stream, reset between chunks
+	z_stream zstream;
+	// the level zstream is currently set up for, or -1 when not initialised
+	int zlibLevel;
+#ifdef HAS_LIBDEFLATE
+	// libdeflate compressors for each level, created when first used. When available they
+	// replace zstream: they produce the same format, considerably faster.
+	struct libdeflate_compressor *deflater[10];
+	// the decompressor used to check the compressed chunks, created when first used
+	struct libdeflate_decompressor *inflater;
+#endif
+};
+
+static codec_state *createCodecState()
+{
+	codec_state *state = calloc(1, sizeof(codec_state));
+	if (state) {
+		state->zlibLevel = -1;
+	}
+	return state;
+}
+
+static void releaseCodecState(void *context)
+{
+	codec_state *state = (codec_state*) context;
+	if (state) {
+		if (state->zlibLevel != -1) {
+			deflateEnd(&state->zstream);
+		}
+#ifdef HAS_LIBDEFLATE
+		for (int i = 0 ; i < 10 ; ++i) {
+			if (state->deflater[i]) {
+				libdeflate_free_compressor(state->deflater[i]);
+			}
+		}
+		if (state->inflater) {
+			libdeflate_free_decompressor(state->inflater);
+		}
+#endif
+		free(state);
+	}
+}
+
+codec_state *arenaCodecState(buffer_arena *arena)
+{
+	if (!arena) {
+		return NULL;
+	}
+	if (!arena->context) {
+		arena->context = createCodecState();
+		arena->releaseContext = releaseCodecState;
+	}
+	return arena->context;
+}
+
+void releaseChunkCompressor(chunk_compressor *compressor)
+{
+	if (compressor->arena) {
+		// the buffers remain in the arena
+		compressor->outBufBlock = NULL;
+#if defined HAS_LZVN || defined HAS_LZFSE
+		compressor->lz_WorkSpace = NULL;
+#endif
+	} else {
+		xfree(compressor->outBufBlock);
+#if defined HAS_LZVN || defined HAS_LZFSE
+		xfree(compressor->lz_WorkSpace);
+#endif
+		releaseCodecState(compressor->state);
+	}
+	compressor->state = NULL;
+}
+
+static void *compressorBuffer(chunk_compressor *compressor, int slot, size_t size)
+{
+	return (compressor->arena)? arenaBuffer(compressor->arena, slot, size) : malloc(size);
+}
+
+bool initChunkCompressor(chunk_compressor *compressor, const char *inFile, buffer_arena *arena,
+								int comptype, int compressionlevel, bool allowLargeBlocks)
+{
+	memset(compressor, 0, sizeof(*compressor));
+	compressor->arena = arena;
+	compressor->inFile = inFile;
+	compressor->comptype = comptype;
+	compressor->compressionlevel = compressionlevel;
+	compressor->allowLargeBlocks = allowLargeBlocks;
+	if (arena) {
+		compressor->state = arenaCodecState(arena);
+	} else {
+		compressor->state = createCodecState();
+	}
+	if (!compressor->state) {
+		fprintf(stderr, "%s: malloc error, unable to allocate the compressor state (%s)\n", inFile, strerror(errno));
+		return false;
+	}
+	switch (comptype) {
+		case ZLIB: {
+			codec_state *state = compressor->state;
+			compressor->outBufBlockSize = compressBound(DECMPFS_CHUNK_SIZE);
+#ifdef HAS_LIBDEFLATE
+			if (compressionlevel >= 1 && compressionlevel <= 9) {
+				if (!state->deflater[compressionlevel]) {
+					state->deflater[compressionlevel] = libdeflate_alloc_compressor(compressionlevel);
+				}
+				if (state->deflater[compressionlevel]) {
+					size_t bound = libdeflate_zlib_compress_bound(state->deflater[compressionlevel], DECMPFS_CHUNK_SIZE);
+					compressor->outBufBlockSize = MAX(compressor->outBufBlockSize, bound);
+					break;
+				}
+				// fall back to zlib
+			}
+#endif
+			// the deflate stream is set up once and then only adapted when the level changes
+			int ret = Z_OK;
+			if (state->zlibLevel == -1) {
+				memset(&state->zstream, 0, sizeof(state->zstream));
+				ret = deflateInit(&state->zstream, compressionlevel);
+			} else if (state->zlibLevel != compressionlevel) {
+				if ((ret = deflateReset(&state->zstream)) == Z_OK) {
+					ret = deflateParams(&state->zstream, compressionlevel, Z_DEFAULT_STRATEGY);
+				}
+			}
+			if (ret != Z_OK) {
+				fprintf(stderr, "%s: failure setting up the deflate stream (level %d; %s)\n",
+						inFile, compressionlevel, (state->zstream.msg)? state->zstream.msg : zError(ret));
+				if (state->zlibLevel != -1) {
+					deflateEnd(&state->zstream);
+				}
+				state->zlibLevel = -1;
+				releaseChunkCompressor(compressor);
+				return false;
+			}
+			state->zlibLevel = compressionlevel;
+			break;
+		}
+#ifdef HAS_LZVN
+		case LZVN:
+			compressor->outBufBlockSize = MAX(lzvn_encode_scratch_size(), DECMPFS_CHUNK_SIZE);
+			compressor->lz_WorkSpace = compressorBuffer(compressor, ARENA_WORKSPACE, compressor->outBufBlockSize);
+			if (!compressor->lz_WorkSpace) {
+				fprintf(stderr, "%s: malloc error, unable to allocate %lu bytes for lzvn workspace (%s)\n",
+						inFile, compressor->outBufBlockSize, strerror(errno));
+				return false;
+			}
+			break;
+#endif
+#ifdef HAS_LZFSE
+		case LZFSE: {
+			size_t scratchSize = lzfse_encode_scratch_size();
+			compressor->outBufBlockSize = MAX(scratchSize, DECMPFS_CHUNK_SIZE);
+			compressor->lz_WorkSpace = scratchSize ?
+				compressorBuffer(compressor, ARENA_WORKSPACE, compressor->outBufBlockSize) : NULL;
+			if (!compressor->lz_WorkSpace && scratchSize) {
+				fprintf(stderr, "%s: malloc error, unable to allocate %lu bytes for lzfse workspace (%s)\n",
+						inFile, compressor->outBufBlockSize, strerror(errno));
+				return false;
+			}
+			break;
+		}
+#endif
+		default:
+			fprintf(stderr, "%s: unsupported compression type %d (%s)\n",
+					inFile, comptype, compressionTypeName(comptype));
+			return false;
+	}
+	compressor->outBufBlock = compressorBuffer(compressor, ARENA_CHUNK, compressor->outBufBlockSize);
+	if (compressor->outBufBlock == NULL) {
+		fprintf(stderr, "%s: malloc error, unable to allocate compression buffer of %lu bytes (%s)\n",
+				inFile, compressor->outBufBlockSize, strerror(errno));
+		releaseChunkCompressor(compressor);
+		return false;
+	}
+	return true;
+}
+
+bool zlibCompressChunk(chunk_compressor *compressor, const void *cursor, uLong len,
+					   int blockNr, unsigned int numBlocks, unsigned long *cmpedsize)
+{
+#ifdef HAS_LIBDEFLATE
+	int level = compressor->compressionlevel;
+	if (level >= 1 && level <= 9 && compressor->state->deflater[level]) {
+		// the buffer is large enough for the worst case, so this can only fail on a bug.
+		*cmpedsize = libdeflate_zlib_compress(compressor->state->deflater[level], cursor, len,
+											  compressor->outBufBlock, compressor->outBufBlockSize);
+		return *cmpedsize != 0;
+	}
+#endif
+	// this is what compress2() does, minus the expensive (de)allocation of the deflate state.
+	z_stream *strm = &compressor->state->zstream;
+	if (deflateReset(strm) != Z_OK)
+	{
+		return false;
+	}
+	strm->next_in = (Bytef*) cursor;
+	strm->avail_in = len;
+	strm->next_out = compressor->outBufBlock;
+	strm->avail_out = compressor->outBufBlockSize;
+	if (deflate(strm, Z_FINISH) != Z_STREAM_END)
+	{
+		return false;
+	}
+	*cmpedsize = strm->total_out;
+	return true;
+}
+
+#ifdef HAS_LZVN
+bool lzvnCompressChunk(chunk_compressor *compressor, const void *cursor, uLong len,
+					   int blockNr, unsigned int numBlocks, unsigned long *cmpedsize)
+{
+	*cmpedsize = lzvn_encode_buffer(compressor->outBufBlock, compressor->outBufBlockSize,
+									cursor, len, compressor->lz_WorkSpace);
+	if (*cmpedsize <= 0)
+	{
+		fprintf( stderr, "%s: lzvn compression failed on chunk #%d (of %u; %lu bytes)\n",
+				 compressor->inFile, blockNr, numBlocks, len);
+		return false;
+	}
+	return true;
+}
+#endif
+
+#ifdef HAS_LZFSE
+bool lzfseCompressChunk(chunk_compressor *compressor, const void *cursor, uLong len,
+						int blockNr, unsigned int numBlocks, unsigned long *cmpedsize)
+{
+	while (1) {
+		*cmpedsize = lzfse_encode_buffer(compressor->outBufBlock, compressor->outBufBlockSize,
+										 cursor, len, compressor->lz_WorkSpace);
+		// If output buffer was too small, grow and retry.
+		if (*cmpedsize == 0) {
+			compressor->outBufBlockSize <<= 1;
+			if (compressor->arena) {
+				compressor->outBufBlock =
+					arenaBuffer(compressor->arena, ARENA_CHUNK, compressor->outBufBlockSize);
+			} else {
+				compressor->outBufBlock = reallocf(compressor->outBufBlock, compressor->outBufBlockSize);
+			}
+			if (!compressor->outBufBlock) {
+				fprintf(stderr, "%s: malloc error, unable to increase output buffer to %lu bytes (%s)\n",
+						compressor->inFile, compressor->outBufBlockSize, strerror(errno));
+				return false;
+			}
+			continue;
+		}
+		break;
+	}
+	return true;
+}
+#endif
+
+ssize_t zlibDecompressChunk(codec_state *state, const void *cmpedChunk, size_t cmpedsize, void *outBuf)
+{
+#ifdef HAS_LIBDEFLATE
+	if (state && !state->inflater) {
+		state->inflater = libdeflate_alloc_decompressor();
+	}
+	if (state && state->inflater) {
+		size_t len;
+		enum libdeflate_result ret = libdeflate_zlib_decompress(state->inflater, cmpedChunk, cmpedsize,
+																outBuf, DECMPFS_CHUNK_SIZE, &len);
+		return (ret == LIBDEFLATE_SUCCESS)? (ssize_t) len : -1;
+	}
+#else
+	(void) state;
+#endif
+	uLongf len = DECMPFS_CHUNK_SIZE;
+	return (uncompress(outBuf, &len, cmpedChunk, cmpedsize) == Z_OK)? (ssize_t) len : -1;
+}
+
+#ifdef HAS_LZVN
+ssize_t lzvnDecompressChunk(codec_state *state, const void *cmpedChunk, size_t cmpedsize, void *outBuf)
+{
+	size_t len = lzvn_decode_buffer(outBuf, DECMPFS_CHUNK_SIZE, cmpedChunk, cmpedsize);
+	return (len > 0)? (ssize_t) len : -1;
+}
+#endif
+
+#ifdef HAS_LZFSE
+ssize_t lzfseDecompressChunk(codec_state *state, const void *cmpedChunk, size_t cmpedsize, void *outBuf)
+{
+	// (lzfse allocates the scratch buffer itself when we don't provide one)
+	size_t len = lzfse_decode_buffer(outBuf, DECMPFS_CHUNK_SIZE, cmpedChunk, cmpedsize, NULL);
+	return (len > 0)? (ssize_t) len : -1;
+}
+#endif
+
+/**
+ * the sum of the squared byte counts of the <len> bytes at <data>. The bytes are counted in
+ * 4 interleaved histograms so that runs of identical bytes don't serialise on a single
+ * counter; that's what limits the speed, not the width of the arithmetic.
+ */
+static UInt64 byteSumOfSquares(const unsigned char *data, size_t len)
+{
+	UInt32 hist[4][256];
+	UInt64 sum = 0;
+	size_t i = 0;
+	int b;
+
+	memset(hist, 0, sizeof(hist));
+	for ( ; i + 8 <= len ; i += 8) {
+		UInt64 w;
+		memcpy(&w, data + i, sizeof(w));
+		hist[0][w & 0xff] += 1;
+		hist[1][(w >> 8) & 0xff] += 1;
+		hist[2][(w >> 16) & 0xff] += 1;
+		hist[3][(w >> 24) & 0xff] += 1;
+		hist[0][(w >> 32) & 0xff] += 1;
+		hist[1][(w >> 40) & 0xff] += 1;
+		hist[2][(w >> 48) & 0xff] += 1;
+		hist[3][w >> 56] += 1;
+	}
+	for ( ; i < len ; ++i) {
+		hist[0][data[i]] += 1;
+	}
+	for (b = 0 ; b < 256 ; ++b) {
+		UInt64 count = (UInt64) hist[0][b] + hist[1][b] + hist[2][b] + hist[3][b];
+		sum += count * count;
+	}
+	return sum;
+}
+
+// The collision probability sum(p^2) is estimated as sum(count * (count - 1)) / (len * (len - 1)),
+// which unlike sum(count^2) / len^2 isn't biased upwards for short inputs.
+
+double byteEntropy(const void *data, size_t len)
+{
+	if (len < 2) {
+		return 0;
+	}
+	UInt64 collisions = byteSumOfSquares(data, len) - len;
+	if (collisions == 0) {
+		return 8;
+	}
+	double entropy = log2((double) len * (len - 1)) - log2((double) collisions);
+	return (entropy < 8)? entropy : 8;
+}
+
+bool chunkLooksIncompressible(const void *data, size_t len)
+{
+	// entropy >= INCOMPRESSIBLE_ENTROPY <=> collision probability <= 2^-INCOMPRESSIBLE_ENTROPY,
+	// evaluated in integers so that the decision is the same on every platform.
+	return len >= 2
+		&& (byteSumOfSquares(data, len) - len) * INCOMPRESSIBLE_COLLISION_RATIO <= (UInt64) len * (len - 1) * 100;
+}
+
+bool chunkIsConstant(const void *data, size_t len, unsigned char *byte)
+{
+	const unsigned char *bytes = (const unsigned char*) data;
+	size_t i = 0, j;
+	if (len == 0) {
+		return false;
+	}
+	const UInt64 pattern = bytes[0] * 0x0101010101010101ULL;
+	// compare in blocks of 256 bytes that the compiler can vectorise, bailing out
+	// after the first block with a difference (i.e. quickly for most data).
+	for ( ; i + 256 <= len ; i += 256) {
+		UInt64 diff = 0;
+		for (j = 0 ; j < 256 ; j += sizeof(UInt64)) {
+			UInt64 w;
+			memcpy(&w, bytes + i + j, sizeof(w));
+			diff |= w ^ pattern;
+		}
+		if (diff) {
+			return false;
+		}
+	}
+	for ( ; i < len ; ++i) {
+		if (bytes[i] != bytes[0]) {
+			return false;
+		}
+	}
+	*byte = bytes[0];
+	return true;
+}
+
+bool initChunkStream(chunk_stream *stream, const char *inFile, int fd, off_t filesize,
+					 size_t windowSize, bool checksums, buffer_arena *arena)
+{
+	memset(stream, 0, sizeof(*stream));
+	stream->inFile = inFile;
+	stream->fd = fd;
+	stream->filesize = filesize;
+	stream->numBlocks = (filesize + DECMPFS_CHUNK_SIZE - 1) / DECMPFS_CHUNK_SIZE;
+	stream->maxWindowBlocks = MAX(windowSize / DECMPFS_CHUNK_SIZE, 1);
+	if (stream->maxWindowBlocks > stream->numBlocks) {
+		stream->maxWindowBlocks = stream->numBlocks;
+	}
+	// no window has been read yet
+	stream->windowStart = stream->numBlocks;
+	stream->window = arenaBuffer(arena, ARENA_INBUF, (size_t) stream->maxWindowBlocks * DECMPFS_CHUNK_SIZE);
+	if (!stream->window) {
+		fprintf(stderr, "%s: malloc error, unable to allocate a read window of %lu bytes (%s)\n",
+				inFile, (unsigned long) stream->maxWindowBlocks * DECMPFS_CHUNK_SIZE, strerror(errno));
+		return false;
+	}
+	if (checksums && !(stream->checksums = calloc(stream->numBlocks, sizeof(UInt64)))) {
+		fprintf(stderr, "%s: malloc error, unable to allocate checksums for %u chunks (%s)\n",
+				inFile, stream->numBlocks, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+void releaseChunkStream(chunk_stream *stream)
+{
+	// the window remains in the arena
+	stream->window = NULL;
+	xfree(stream->checksums);
+}
+
+// pread() <len> bytes in as many calls as required
+static bool preadFully(int fd, void *buf, size_t len, off_t offset)
+{
+	while (len > 0) {
+		ssize_t n = pread(fd, buf, len, offset);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf = (char*) buf + n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+bool readChunkWindow(chunk_stream *stream, unsigned int blockNr)
+{
+	off_t offset = (off_t) blockNr * DECMPFS_CHUNK_SIZE;
+	unsigned int i;
+	stream->windowStart = blockNr;
+	stream->windowBlocks = MIN(stream->maxWindowBlocks, stream->numBlocks - blockNr);
+	stream->windowLength = MIN((off_t) stream->windowBlocks * DECMPFS_CHUNK_SIZE, stream->filesize - offset);
+	if (!preadFully(stream->fd, stream->window, stream->windowLength, offset)) {
+		fprintf(stderr, "%s: Error reading file (%lu bytes at offset %lld; %s)\n", stream->inFile,
+				(unsigned long) stream->windowLength, (long long) offset, strerror(errno));
+		return false;
+	}
+	if (stream->checksums) {
+		for (i = 0 ; i < stream->windowBlocks ; ++i) {
+			size_t len = MIN(DECMPFS_CHUNK_SIZE, stream->windowLength - (size_t) i * DECMPFS_CHUNK_SIZE);
+			stream->checksums[blockNr + i] = checksum64((char*) stream->window + (size_t) i * DECMPFS_CHUNK_SIZE, len);
+		}
+	}
+	return true;
+}
+
+bool verifyChunkStream(chunk_stream *stream, int fd, int referenceFd, bool *readFailure)
+{
+	unsigned int blockNr, i;
+	void *reference = NULL;
+	// don't let readChunkWindow() overwrite the checksums we verify against
+	UInt64 *checksums = stream->checksums;
+	bool ok = true;
+
+	*readFailure = false;
+	if (referenceFd < 0 && !checksums) {
+		fprintf(stderr, "%s: no reference to verify the file against\n", stream->inFile);
+		return false;
+	}
+	if (referenceFd >= 0 && !(reference = malloc(DECMPFS_CHUNK_SIZE))) {
+		fprintf(stderr, "%s: malloc error, unable to allocate verification buffer (%s)\n",
+				stream->inFile, strerror(errno));
+		return false;
+	}
+	stream->fd = fd;
+	stream->checksums = NULL;
+	for (blockNr = 0 ; ok && blockNr < stream->numBlocks ; blockNr += stream->windowBlocks) {
+		if (!readChunkWindow(stream, blockNr)) {
+			*readFailure = true;
+			ok = false;
+			break;
+		}
+		for (i = 0 ; ok && i < stream->windowBlocks ; ++i) {
+			const char *chunk = (char*) stream->window + (size_t) i * DECMPFS_CHUNK_SIZE;
+			size_t len = MIN(DECMPFS_CHUNK_SIZE, stream->windowLength - (size_t) i * DECMPFS_CHUNK_SIZE);
+			if (reference) {
+				if (!preadFully(referenceFd, reference, len, (off_t) (blockNr + i) * DECMPFS_CHUNK_SIZE)) {
+					*readFailure = true;
+					ok = false;
+				} else {
+					ok = memcmp(chunk, reference, len) == 0;
+				}
+			} else {
+				ok = checksum64(chunk, len) == checksums[blockNr + i];
+			}
+			if (!ok && !*readFailure && printVerbose > 1) {
+				fprintf(stderr, "%s: chunk #%u differs from the original\n", stream->inFile, blockNr + i);
+			}
+		}
+	}
+	stream->checksums = checksums;
+	xfree(reference);
+	return ok;
+}
+
+void chooseSampleChunks(unsigned int numBlocks, unsigned int seed, unsigned int *blockNr)
+{
+	blockNr[0] = 0;
+	blockNr[1] = numBlocks - 1;
+	for (int i = 2 ; i < PREFILTER_SAMPLES ; ++i) {
+		seed = seed * 1103515245 + 12345;
+		blockNr[i] = 1 + (seed >> 8) % (numBlocks - 2);
+	}
+}
@@ -0,0 +1,237 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+
+/*
+ * @file codecs.h
+ * @file codecs.c
+ * @file chunkdriver.cpp
+ * Copyright "brkirch" (https://brkirch.wordpress.com/afsctool/)
+ * This file created by and C++ sections (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * The HFS compression codecs and the drivers that build a file's compressed image with them.
+ * Adding a codec means adding its chunk compression function (codecs.c) and a Codec<>
+ * specialisation describing its resource fork layout (chunkdriver.cpp).
+ */
+
+#ifndef _CODECS_H
+
+#include <zlib.h>
+
+#include "afsctool.h"
+#include "utils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif //__cplusplus
+
+// 64Kb block size (HFS compression is "64K chunked")
+#define DECMPFS_CHUNK_SIZE	0x10000
+
+// the buffer_arena slots used during compression
+enum { ARENA_INBUF, ARENA_OUTBUF, ARENA_DECMPFS, ARENA_CHUNK, ARENA_WORKSPACE, ARENA_SAMPLE };
+
+// codec state that is kept for the lifetime of a buffer_arena
+typedef struct codec_state codec_state;
+
+/**
+ * the state required to compress individual chunks; every thread compressing
+ * chunks needs its own instance.
+ */
+typedef struct chunk_compressor {
+	const char *inFile;
+	int comptype, compressionlevel;
+	bool allowLargeBlocks;
+	// the arena providing the buffers below and the codec state, or NULL
+	buffer_arena *arena;
+	codec_state *state;
+	// the buffer receiving the compressed chunk
+	void *outBufBlock;
+	unsigned long outBufBlockSize;
+#if defined HAS_LZVN || defined HAS_LZFSE
+	void *lz_WorkSpace;
+#endif
+} chunk_compressor;
+
+extern bool initChunkCompressor(chunk_compressor *compressor, const char *inFile, buffer_arena *arena,
+								int comptype, int compressionlevel, bool allowLargeBlocks);
+extern void releaseChunkCompressor(chunk_compressor *compressor);
+// the codec state kept in <arena>, created when first requested; NULL if <arena> is NULL or out of memory
+extern codec_state *arenaCodecState(buffer_arena *arena);
+
+// The codec primitives: compress chunk <blockNr> (of <numBlocks>) of <len> bytes at <cursor>
+// into compressor->outBufBlock, returning the compressed size in <cmpedsize>.
+extern bool zlibCompressChunk(chunk_compressor *compressor, const void *cursor, uLong len,
+							  int blockNr, unsigned int numBlocks, unsigned long *cmpedsize);
+#ifdef HAS_LZVN
+extern bool lzvnCompressChunk(chunk_compressor *compressor, const void *cursor, uLong len,
+							  int blockNr, unsigned int numBlocks, unsigned long *cmpedsize);
+#endif
+#ifdef HAS_LZFSE
+extern bool lzfseCompressChunk(chunk_compressor *compressor, const void *cursor, uLong len,
+							   int blockNr, unsigned int numBlocks, unsigned long *cmpedsize);
+#endif
+
+// The decoding primitives: decode <cmpedsize> bytes at <cmpedChunk> into <outBuf> (which can hold
+// DECMPFS_CHUNK_SIZE bytes), returning the decoded size or -1 on failure. <state> holds the decoders
+// that are reused from one chunk to the next; it can be NULL.
+extern ssize_t zlibDecompressChunk(codec_state *state, const void *cmpedChunk, size_t cmpedsize, void *outBuf);
+#ifdef HAS_LZVN
+extern ssize_t lzvnDecompressChunk(codec_state *state, const void *cmpedChunk, size_t cmpedsize, void *outBuf);
+#endif
+#ifdef HAS_LZFSE
+extern ssize_t lzfseDecompressChunk(codec_state *state, const void *cmpedChunk, size_t cmpedsize, void *outBuf);
+#endif
+
+// chunks whose byte entropy (in bits per byte) reaches this value are not worth compressing.
+#define INCOMPRESSIBLE_ENTROPY	7.99
+// 100 * 2^INCOMPRESSIBLE_ENTROPY, for comparisons in integer arithmetic
+#define INCOMPRESSIBLE_COLLISION_RATIO	25423
+
+/**
+ * estimate the entropy of the <len> bytes at <data> (at most a chunk), in bits per byte (0 - 8).
+ * This is the collision (order 2 Rényi) entropy of the byte histogram, a lower bound of the
+ * Shannon entropy that can be evaluated without a logarithm per byte value.
+ */
+extern double byteEntropy(const void *data, size_t len);
+// whether the byte entropy of the <len> bytes at <data> (at most a chunk) reaches INCOMPRESSIBLE_ENTROPY
+extern bool chunkLooksIncompressible(const void *data, size_t len);
+// whether the <len> bytes at <data> all have the same value, which is then returned in <byte>
+extern bool chunkIsConstant(const void *data, size_t len, unsigned char *byte);
+
+// the compressibility prefilter samples files of at least PREFILTER_MIN_BLOCKS chunks
+#define PREFILTER_MIN_BLOCKS	16
+#define PREFILTER_SAMPLES		8
+/**
+ * choose the PREFILTER_SAMPLES chunks the prefilter samples of a file of <numBlocks> chunks: the first,
+ * the last and a few chosen at random in between, the same ones for a given <seed>.
+ */
+extern void chooseSampleChunks(unsigned int numBlocks, unsigned int seed, unsigned int *blockNr);
+
+/**
+ * compress a chunk with the primitive for compressor->comptype, storing it uncompressed
+ * when that is supported and compression doesn't gain anything (or won't, judging from
+ * the chunk's entropy).
+ * Returns false on failure (which includes not being allowed to store the chunk uncompressed).
+ */
+extern bool compressChunk(chunk_compressor *compressor, const void *cursor, uLong len,
+						  int blockNr, unsigned int numBlocks, unsigned long *cmpedsize);
+
+// the compressed chunks of a range, stored back-to-back
+typedef struct chunk_range_result {
+	void *buf;
+	// the size of the data, and the allocated size of buf
+	size_t size, capacity;
+} chunk_range_result;
+
+// a file's chunks compressed beforehand (e.g. by parallel chunk tasks), in ranges of <rangeBlocks>
+typedef struct precompressed_chunks {
+	unsigned int rangeBlocks;
+	const chunk_range_result *ranges;
+	// the compressed size of each chunk
+	const unsigned long *chunkSizes;
+} precompressed_chunks;
+
+/**
+ * the compressed representation of a file: the content of the decmpfs xattr and,
+ * unless the data fits in that xattr, of the resource fork. The buffers belong to
+ * the arena the image was built in.
+ */
+typedef struct compressed_image {
+	void *decmpfsBuf;
+	unsigned int decmpfsSize;
+	// NULL when the compressed data is stored in the decmpfs xattr
+	void *resourceFork;
+	size_t resourceForkSize;
+	// set by the caller: building the resource fork is abandoned as soon as the image
+	// reaches this size (0 = no limit). <aborted> is then set, and <processedBlocks>
+	// tells how many chunks had been compressed.
+	size_t sizeLimit;
+	bool aborted;
+	unsigned int processedBlocks;
+	// set by the caller: store identical chunks only once, pointing all their table entries to
+	// the same data (for codecs whose resource fork layout allows it). <sharedChunks> returns
+	// the number of chunks that didn't need to be stored.
+	bool shareChunks;
+	unsigned int sharedChunks;
+} compressed_image;
+
+/**
+ * build the compressed image of the <filesize> bytes at <inBuf>, taking the compressed chunks
+ * from <precompressed>, or compressing them with <compressor> when <precompressed> is NULL.
+ */
+extern bool buildCompressedImage(compressed_image *image, const char *inFile, const void *inBuf, off_t filesize,
+								 int comptype, chunk_compressor *compressor, const precompressed_chunks *precompressed,
+								 buffer_arena *arena);
+
+/**
+ * a file that is read with pread() in a sliding window of chunks instead of being loaded
+ * as a whole, so that compressing it requires only the window and the compressed image.
+ */
+typedef struct chunk_stream {
+	const char *inFile;
+	int fd;
+	off_t filesize;
+	unsigned int numBlocks;
+	// the window holds chunks [windowStart, windowStart + windowBlocks), windowLength bytes
+	void *window;
+	unsigned int windowStart, windowBlocks, maxWindowBlocks;
+	size_t windowLength;
+	// the checksum of every chunk, recorded as it is read; NULL if not required.
+	UInt64 *checksums;
+	// optional replacement for readChunkWindow() that can also return the chunks of the
+	// window compressed beforehand, numbered from windowStart.
+	bool (*loadWindow)(struct chunk_stream *stream, unsigned int blockNr, const precompressed_chunks **precompressed);
+	void *context;
+} chunk_stream;
+
+// set up <stream> for reading <fd> in windows of (at most) <windowSize> bytes, taken from <arena>.
+extern bool initChunkStream(chunk_stream *stream, const char *inFile, int fd, off_t filesize,
+							size_t windowSize, bool checksums, buffer_arena *arena);
+extern void releaseChunkStream(chunk_stream *stream);
+// read the window starting at chunk <blockNr>
+extern bool readChunkWindow(chunk_stream *stream, unsigned int blockNr);
+/**
+ * verify the file content read from <fd> against the checksums recorded in <stream>, or against
+ * the content of <referenceFd> when that is a valid file descriptor. Uses the stream's window.
+ * <readFailure> is set when the data could not be read.
+ */
+extern bool verifyChunkStream(chunk_stream *stream, int fd, int referenceFd, bool *readFailure);
+
+// build the compressed image of the file read through <stream>
+extern bool buildStreamedImage(compressed_image *image, chunk_stream *stream, int comptype,
+							   chunk_compressor *compressor, buffer_arena *arena);
+
+/**
+ * check that the decmpfs header of a compressed image describes a file of <filesize> bytes
+ * compressed with <comptype> and stored the way the image is, and that its resource fork
+ * (if any) can hold the chunk table.
+ */
+extern bool checkImageHeader(const compressed_image *image, int comptype, off_t filesize);
+/**
+ * decode chunk <blockNr> of a compressed image into <outBuf> which must hold at least
+ * DECMPFS_CHUNK_SIZE bytes, using the decoders in <state> (which can be NULL).
+ * Returns the decoded size, or -1 on failure.
+ */
+extern ssize_t decodeImageChunk(codec_state *state, const compressed_image *image, int comptype,
+								unsigned int blockNr, void *outBuf);
+/**
+ * check that chunks <first> up to <last> (exclusive) of a compressed image of <filesize> bytes decode
+ * to the original data: the corresponding part of <inBuf>, or when that is NULL, the data whose
+ * chunk checksums (checksum64()) are in <checksums>. <chunkBuf> must hold DECMPFS_CHUNK_SIZE bytes.
+ * The decoders are kept in the codec state of <arena>, which can be NULL.
+ * Returns the number of the first chunk that doesn't match, or <last> if they all do.
+ */
+extern unsigned int checkImageChunks(const compressed_image *image, int comptype, off_t filesize,
+									 const void *inBuf, const UInt64 *checksums,
+									 unsigned int first, unsigned int last, void *chunkBuf,
+									 buffer_arena *arena);
+// write the decoded content of a compressed image to <fd>
+extern bool writeDecodedImage(const compressed_image *image, int comptype, int fd, const char *inFile);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#define _CODECS_H
+#endif //_CODECS_H
@@ -0,0 +1,154 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file deflatebench.c
+ * (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * Compares the deflate implementations afsctool can use for ZLIB compression, compressing
+ * the given files in 64Kb chunks like afsctool does, at every compression level. compress2()
+ * shows what a deflate stream set up for every chunk costs compared to one that is reset.
+ * The libdeflate output is checked to decode with zlib, i.e. to be usable in HFS compressed files.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <zlib.h>
+#ifdef HAS_LIBDEFLATE
+#	include <libdeflate.h>
+#endif
+
+#define CHUNK_SIZE	0x10000
+
+static double cpuTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, int level, size_t size, size_t compressed, double time, unsigned long failures)
+{
+	size_t chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	printf("%-12s %5d %10.1f %10.0f %9.2f%%", name, level, size / time / 1e6, chunks / time,
+		   (1.0 - (double) compressed / size) * 100);
+	if (failures) {
+		printf("  %lu chunks failed to decode!", failures);
+	}
+	printf("\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	char *data = NULL, *out, *check;
+	size_t size = 0, capacity = 0, outSize = compressBound(CHUNK_SIZE) + CHUNK_SIZE;
+	int i, level;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s file [file ...]\n", argv[0]);
+		return EINVAL;
+	}
+	for (i = 1 ; i < argc ; ++i) {
+		FILE *fp = fopen(argv[i], "r");
+		size_t n;
+		if (!fp) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			return errno;
+		}
+		do {
+			if (size + CHUNK_SIZE > capacity) {
+				capacity = (capacity) ? 2 * capacity : 16 * CHUNK_SIZE;
+				if (!(data = realloc(data, capacity))) {
+					fprintf(stderr, "malloc error, out of memory\n");
+					return ENOMEM;
+				}
+			}
+			n = fread(data + size, 1, CHUNK_SIZE, fp);
+			size += n;
+		} while (n > 0);
+		fclose(fp);
+	}
+	out = malloc(outSize);
+	check = malloc(CHUNK_SIZE);
+	if (!size || !out || !check) {
+		fprintf(stderr, "nothing to compress\n");
+		return EINVAL;
+	}
+	printf("%lu bytes in %lu chunks\n", (unsigned long) size, (unsigned long) ((size + CHUNK_SIZE - 1) / CHUNK_SIZE));
+	printf("%-12s %5s %10s %10s %10s\n", "codec", "level", "MB/s", "chunks/s", "savings");
+	for (level = 1 ; level <= 9 ; ++level) {
+		size_t offset, compressed = 0;
+		unsigned long failures = 0;
+		double start;
+		z_stream strm;
+
+		// a new deflate stream for every chunk
+		start = cpuTime();
+		for (offset = 0 ; offset < size ; offset += CHUNK_SIZE) {
+			size_t len = (size - offset > CHUNK_SIZE) ? CHUNK_SIZE : size - offset;
+			uLongf n = outSize;
+			if (compress2((Bytef*) out, &n, (Bytef*) data + offset, len, level) != Z_OK) {
+				failures += 1;
+			}
+			compressed += n;
+		}
+		report("compress2", level, size, compressed, cpuTime() - start, failures);
+		compressed = 0;
+		failures = 0;
+
+		// the way zlibCompressChunk() uses zlib
+		memset(&strm, 0, sizeof(strm));
+		if (deflateInit(&strm, level) != Z_OK) {
+			fprintf(stderr, "deflateInit(%d) failed\n", level);
+			return EINVAL;
+		}
+		start = cpuTime();
+		for (offset = 0 ; offset < size ; offset += CHUNK_SIZE) {
+			size_t len = (size - offset > CHUNK_SIZE) ? CHUNK_SIZE : size - offset;
+			deflateReset(&strm);
+			strm.next_in = (Bytef*) data + offset;
+			strm.avail_in = len;
+			strm.next_out = (Bytef*) out;
+			strm.avail_out = outSize;
+			if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+				failures += 1;
+			}
+			compressed += strm.total_out;
+		}
+		report("zlib", level, size, compressed, cpuTime() - start, failures);
+		deflateEnd(&strm);
+
+#ifdef HAS_LIBDEFLATE
+		struct libdeflate_compressor *deflater = libdeflate_alloc_compressor(level);
+		if (!deflater) {
+			fprintf(stderr, "libdeflate_alloc_compressor(%d) failed\n", level);
+			return EINVAL;
+		}
+		double time = 0;
+		compressed = 0;
+		for (offset = 0 ; offset < size ; offset += CHUNK_SIZE) {
+			size_t len = (size - offset > CHUNK_SIZE) ? CHUNK_SIZE : size - offset, n;
+			uLongf checkLen = CHUNK_SIZE;
+			start = cpuTime();
+			n = libdeflate_zlib_compress(deflater, data + offset, len, out, outSize);
+			time += cpuTime() - start;
+			compressed += n;
+			if (!n || uncompress((Bytef*) check, &checkLen, (Bytef*) out, n) != Z_OK
+				|| checkLen != len || memcmp(check, data + offset, len) != 0) {
+				failures += 1;
+			}
+		}
+		report("libdeflate", level, size, compressed, time, failures);
+		libdeflate_free_compressor(deflater);
+#endif
+	}
+	free(data);
+	free(out);
+	free(check);
+	return 0;
+}
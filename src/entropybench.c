@@ -0,0 +1,276 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file entropybench.c
+ * (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * Compares ways to compute the byte histogram statistic behind byteEntropy() on 64Kb chunks:
+ * a single histogram, the 4 interleaved histograms codecs.c uses, and those with the final
+ * reduction done with the vector instructions of the host (SSE2 and AVX2 on x86-64, NEON on arm64).
+ * Without arguments it uses generated data (zeros, random bytes and text), otherwise the given files.
+ * All variants must give the same result; a mismatch is reported.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#	include <immintrin.h>
+#elif defined(__aarch64__)
+#	include <arm_neon.h>
+#endif
+
+#define CHUNK_SIZE	0x10000
+// the generated samples are this many chunks
+#define SAMPLE_CHUNKS	64
+
+static double cpuTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void countBytes4(const unsigned char *data, size_t len, uint32_t hist[4][256])
+{
+	size_t i = 0;
+
+	memset(hist, 0, 4 * 256 * sizeof(uint32_t));
+	for ( ; i + 8 <= len ; i += 8) {
+		uint64_t w;
+		memcpy(&w, data + i, sizeof(w));
+		hist[0][w & 0xff] += 1;
+		hist[1][(w >> 8) & 0xff] += 1;
+		hist[2][(w >> 16) & 0xff] += 1;
+		hist[3][(w >> 24) & 0xff] += 1;
+		hist[0][(w >> 32) & 0xff] += 1;
+		hist[1][(w >> 40) & 0xff] += 1;
+		hist[2][(w >> 48) & 0xff] += 1;
+		hist[3][w >> 56] += 1;
+	}
+	for ( ; i < len ; ++i) {
+		hist[0][data[i]] += 1;
+	}
+}
+
+// a single histogram: runs of identical bytes serialise on one counter
+static uint64_t sumOfSquares1(const unsigned char *data, size_t len)
+{
+	uint32_t hist[256];
+	uint64_t sum = 0;
+	size_t i;
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 0 ; i < len ; ++i) {
+		hist[data[i]] += 1;
+	}
+	for (i = 0 ; i < 256 ; ++i) {
+		sum += (uint64_t) hist[i] * hist[i];
+	}
+	return sum;
+}
+
+// byteSumOfSquares() as in codecs.c
+static uint64_t sumOfSquares4(const unsigned char *data, size_t len)
+{
+	uint32_t hist[4][256];
+	uint64_t sum = 0;
+	int b;
+
+	countBytes4(data, len, hist);
+	for (b = 0 ; b < 256 ; ++b) {
+		uint64_t count = (uint64_t) hist[0][b] + hist[1][b] + hist[2][b] + hist[3][b];
+		sum += count * count;
+	}
+	return sum;
+}
+
+#if defined(__x86_64__)
+static uint64_t sumOfSquares4SSE2(const unsigned char *data, size_t len)
+{
+	uint32_t hist[4][256];
+	__m128i sum = _mm_setzero_si128();
+	uint64_t lanes[2];
+	int b;
+
+	countBytes4(data, len, hist);
+	for (b = 0 ; b < 256 ; b += 4) {
+		// (the counts of a chunk fit in 32 bits, their squares don't)
+		__m128i count = _mm_add_epi32(
+			_mm_add_epi32(_mm_loadu_si128((const __m128i*) &hist[0][b]), _mm_loadu_si128((const __m128i*) &hist[1][b])),
+			_mm_add_epi32(_mm_loadu_si128((const __m128i*) &hist[2][b]), _mm_loadu_si128((const __m128i*) &hist[3][b])));
+		__m128i odd = _mm_srli_epi64(count, 32);
+		sum = _mm_add_epi64(sum, _mm_add_epi64(_mm_mul_epu32(count, count), _mm_mul_epu32(odd, odd)));
+	}
+	_mm_storeu_si128((__m128i*) lanes, sum);
+	return lanes[0] + lanes[1];
+}
+
+__attribute__((target("avx2")))
+static uint64_t sumOfSquares4AVX2(const unsigned char *data, size_t len)
+{
+	uint32_t hist[4][256];
+	__m256i sum = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	int b;
+
+	countBytes4(data, len, hist);
+	for (b = 0 ; b < 256 ; b += 8) {
+		__m256i count = _mm256_add_epi32(
+			_mm256_add_epi32(_mm256_loadu_si256((const __m256i*) &hist[0][b]), _mm256_loadu_si256((const __m256i*) &hist[1][b])),
+			_mm256_add_epi32(_mm256_loadu_si256((const __m256i*) &hist[2][b]), _mm256_loadu_si256((const __m256i*) &hist[3][b])));
+		__m256i odd = _mm256_srli_epi64(count, 32);
+		sum = _mm256_add_epi64(sum, _mm256_add_epi64(_mm256_mul_epu32(count, count), _mm256_mul_epu32(odd, odd)));
+	}
+	_mm256_storeu_si256((__m256i*) lanes, sum);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+#elif defined(__aarch64__)
+static uint64_t sumOfSquares4NEON(const unsigned char *data, size_t len)
+{
+	uint32_t hist[4][256];
+	uint64x2_t sum = vdupq_n_u64(0);
+	int b;
+
+	countBytes4(data, len, hist);
+	for (b = 0 ; b < 256 ; b += 4) {
+		uint32x4_t count = vaddq_u32(vaddq_u32(vld1q_u32(&hist[0][b]), vld1q_u32(&hist[1][b])),
+									 vaddq_u32(vld1q_u32(&hist[2][b]), vld1q_u32(&hist[3][b])));
+		sum = vmlal_u32(sum, vget_low_u32(count), vget_low_u32(count));
+		sum = vmlal_high_u32(sum, count, count);
+	}
+	return vaddvq_u64(sum);
+}
+#endif
+
+typedef struct kernel {
+	const char *name;
+	uint64_t (*sumOfSquares)(const unsigned char *data, size_t len);
+} kernel;
+
+// run <k> over the chunks of <data> for at least a fifth of a second; returns false on a mismatch with <reference>
+static bool bench(const kernel *k, const char *what, const unsigned char *data, size_t size, const uint64_t *reference)
+{
+	const size_t chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	double start = cpuTime(), time;
+	size_t passes = 0, c;
+	bool ok = true;
+
+	do {
+		for (c = 0 ; c < chunks ; ++c) {
+			size_t offset = c * CHUNK_SIZE, len = (size - offset > CHUNK_SIZE) ? CHUNK_SIZE : size - offset;
+			uint64_t sum = k->sumOfSquares(data + offset, len);
+			if (sum != reference[c]) {
+				ok = false;
+			}
+		}
+		passes += 1;
+		time = cpuTime() - start;
+	} while (time < 0.2);
+	printf("%-10s %-16s %10.1f %10.0f%s\n", what, k->name, passes * size / time / 1e6, passes * chunks / time,
+		   ok ? "" : "  result differs!");
+	return ok;
+}
+
+static int benchData(const char *what, const unsigned char *data, size_t size, const kernel *kernels, int nKernels)
+{
+	const size_t chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	uint64_t *reference = malloc(chunks * sizeof(uint64_t));
+	int failures = 0, i;
+	size_t c;
+
+	if (!reference) {
+		fprintf(stderr, "malloc error, out of memory\n");
+		return 1;
+	}
+	for (c = 0 ; c < chunks ; ++c) {
+		size_t offset = c * CHUNK_SIZE;
+		reference[c] = sumOfSquares1(data + offset, (size - offset > CHUNK_SIZE) ? CHUNK_SIZE : size - offset);
+	}
+	for (i = 0 ; i < nKernels ; ++i) {
+		if (!bench(&kernels[i], what, data, size, reference)) {
+			failures += 1;
+		}
+	}
+	free(reference);
+	return failures;
+}
+
+int main(int argc, const char *argv[])
+{
+	kernel kernels[4] = {
+		{ "1 table", sumOfSquares1 },
+		{ "4 tables", sumOfSquares4 },
+	};
+	int nKernels = 2, failures = 0, i;
+	unsigned char *data = NULL;
+	size_t size = 0, capacity = 0;
+
+#if defined(__x86_64__)
+	kernels[nKernels++] = (kernel) { "4 tables+SSE2", sumOfSquares4SSE2 };
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernels[nKernels++] = (kernel) { "4 tables+AVX2", sumOfSquares4AVX2 };
+	}
+#elif defined(__aarch64__)
+	kernels[nKernels++] = (kernel) { "4 tables+NEON", sumOfSquares4NEON };
+#endif
+
+	printf("%-10s %-16s %10s %10s\n", "data", "kernel", "MB/s", "chunks/s");
+	if (argc < 2) {
+		const size_t sampleSize = SAMPLE_CHUNKS * CHUNK_SIZE;
+		const char *text = "the quick brown fox jumps over the lazy dog; ";
+		const size_t textLen = strlen(text);
+		uint64_t seed = 0x9e3779b97f4a7c15ULL;
+		size_t j;
+		if (!(data = malloc(sampleSize))) {
+			fprintf(stderr, "malloc error, out of memory\n");
+			return ENOMEM;
+		}
+		memset(data, 0, sampleSize);
+		failures += benchData("zeros", data, sampleSize, kernels, nKernels);
+		for (j = 0 ; j < sampleSize ; ++j) {
+			seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+			data[j] = (unsigned char) seed;
+		}
+		failures += benchData("random", data, sampleSize, kernels, nKernels);
+		for (j = 0 ; j < sampleSize ; ++j) {
+			data[j] = text[j % textLen];
+		}
+		failures += benchData("text", data, sampleSize, kernels, nKernels);
+	} else {
+		for (i = 1 ; i < argc ; ++i) {
+			FILE *fp = fopen(argv[i], "r");
+			size_t n;
+			if (!fp) {
+				fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+				return errno;
+			}
+			do {
+				if (size + CHUNK_SIZE > capacity) {
+					capacity = (capacity) ? 2 * capacity : 16 * CHUNK_SIZE;
+					if (!(data = realloc(data, capacity))) {
+						fprintf(stderr, "malloc error, out of memory\n");
+						return ENOMEM;
+					}
+				}
+				n = fread(data + size, 1, CHUNK_SIZE, fp);
+				size += n;
+			} while (n > 0);
+			fclose(fp);
+		}
+		if (!size) {
+			fprintf(stderr, "nothing to analyse\n");
+			return EINVAL;
+		}
+		failures += benchData("files", data, size, kernels, nKernels);
+	}
+	free(data);
+	return (failures) ? 1 : 0;
+}
@@ -39,16 +39,30 @@ struct folder_info
 	long long int num_folders;
 	long long int num_hard_link_folders;
 	long long int maxSize;
+	// files larger than this are read and compressed in a window of this size (0: never)
+	long long int streamWindow;
 	// set by compressFile():
 	long long int data_compressed_size;
 	int print_info;
 	compression_type compressiontype;
 	int compressionlevel;
+	// choose the compression type and level per file, spending at most <cpuBudget>
+	// CPU seconds per Gb (afsctool -T auto)
+	bool autoCompression;
+	double cpuBudget;
 	double minSavings;
 	bool print_files;
 	bool compress_files;
 	bool allowLargeBlocks;
+	// store identical chunks of a file only once (ZLIB only)
+	bool shareChunks;
 	bool check_files;
+	// verify files by reading them back after compressing them, not only by decoding
+	// the compressed data in memory before writing it (afsctool -P)
+	bool check_on_disk;
+	// when reading files back, check only this many randomly chosen 64Kb blocks
+	// of files that have more (0: check everything)
+	size_t check_samples;
 	bool check_hard_links;
 	bool follow_sym_links;
 	struct filetype_info *filetypes;
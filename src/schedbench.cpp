@@ -0,0 +1,218 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file schedbench.cpp
+ * (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * Measures how the hand-out of queued items scales with the number of workers, on a large
+ * number of tiny items (a path and a struct stat, like a FileEntry) that take almost no work:
+ * the std::deque popped under the list lock that ParallelProcessor used to have, compared with
+ * the lock-free claims (batches and stealing) of ParallelProcessor::claimItem().
+ * Every run also checks that each item was handed out exactly once.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <thread>
+#include <vector>
+
+#include "ParallelProcess_p.hpp"
+
+struct BenchItem {
+	std::string path;
+	struct stat fileInfo;
+	size_t index;
+};
+
+// the way ParallelProcessor handed out items before the claims: a copy popped under the lock
+class LockedQueue
+{
+public:
+	LockedQueue()
+		: listLock(4000)
+	{}
+	bool getFront(BenchItem &value)
+	{ bool wasLocked = listLock.IsLocked();
+		CRITSECTLOCK::Scope scope(listLock);
+		if( wasLocked ){
+			listLock.lockCounter += 1;
+		}
+		if( itemList.empty() ){
+			return false;
+		}
+		value = itemList.front();
+		itemList.pop_front();
+		return true;
+	}
+	bool getBack(BenchItem &value)
+	{ bool wasLocked = listLock.IsLocked();
+		CRITSECTLOCK::Scope scope(listLock);
+		if( wasLocked ){
+			listLock.lockCounter += 1;
+		}
+		if( itemList.empty() ){
+			return false;
+		}
+		value = itemList.back();
+		itemList.pop_back();
+		return true;
+	}
+	std::deque<BenchItem> itemList;
+	CRITSECTLOCK listLock;
+};
+
+class ClaimQueue : public ParallelProcessor<BenchItem>
+{
+};
+
+static void fillItems(std::deque<BenchItem> &items, size_t nItems)
+{
+	BenchItem item;
+	memset(&item.fileInfo, 0, sizeof(item.fileInfo));
+	for( size_t i = 0 ; i < nItems ; ++i ){
+	 char name[64];
+		snprintf( name, sizeof(name), "/some/directory/file-%lu.txt", (unsigned long) i );
+		item.path = name;
+		item.fileInfo.st_size = i;
+		item.index = i;
+		items.push_back(item);
+	}
+}
+
+// the work done on an item: note which one it was (in the worker's own list, so the workers
+// don't share cache lines), with just enough use of the item that this can't be optimised away
+static inline void processItem(const BenchItem &item, std::vector<size_t> &handled, unsigned long long &work)
+{
+	handled.push_back(item.index);
+	work += item.fileInfo.st_size + item.path.size();
+}
+
+static bool allHandledOnce(size_t nItems, const std::vector<std::vector<size_t>> &handled)
+{
+ std::vector<unsigned char> seen(nItems, 0);
+	for( const auto &list : handled ){
+		for( size_t index : list ){
+			seen[index] += 1;
+		}
+	}
+	for( unsigned char count : seen ){
+		if( count != 1 ){
+			return false;
+		}
+	}
+	return true;
+}
+
+// run <nJobs> workers of which <nReverse> take from the rear; returns the items per second
+static double runLocked(size_t nItems, int nJobs, int nReverse, unsigned long &conflicts, bool &ok)
+{
+ LockedQueue queue;
+ std::vector<std::vector<size_t>> handled(nJobs);
+ std::vector<std::thread> workers;
+ std::vector<unsigned long long> work(nJobs, 0);
+	fillItems(queue.itemList, nItems);
+	const double start = HRTime_Time();
+	for( int i = 0 ; i < nJobs ; ++i ){
+		workers.emplace_back( [&, i]() {
+		 BenchItem item;
+		 const bool fromRear = i >= nJobs - nReverse;
+		 unsigned long long total = 0;
+			while( fromRear ? queue.getBack(item) : queue.getFront(item) ){
+				processItem( item, handled[i], total );
+			}
+			work[i] = total;
+		} );
+	}
+	for( auto &worker : workers ){
+		worker.join();
+	}
+	const double elapsed = HRTime_Time() - start;
+	conflicts = queue.listLock.lockCounter;
+	ok = allHandledOnce(nItems, handled);
+	return nItems / elapsed;
+}
+
+static double runClaims(size_t nItems, int nJobs, int nReverse, unsigned long &stolen, unsigned long &conflicts, bool &ok)
+{
+ ClaimQueue queue;
+ std::vector<std::vector<size_t>> handled(nJobs);
+ std::vector<std::thread> workers;
+ std::vector<unsigned long long> work(nJobs, 0);
+	fillItems(queue.items(), nItems);
+	queue.startClaiming(nJobs);
+	const double start = HRTime_Time();
+	for( int i = 0 ; i < nJobs ; ++i ){
+		workers.emplace_back( [&, i]() {
+		 const bool fromRear = i >= nJobs - nReverse;
+		 BenchItem *item;
+		 unsigned long long total = 0;
+			while( (item = queue.claimItem(i, fromRear)) ){
+				processItem( *item, handled[i], total );
+			}
+			work[i] = total;
+		} );
+	}
+	for( auto &worker : workers ){
+		worker.join();
+	}
+	const double elapsed = HRTime_Time() - start;
+	stolen = queue.stolenItemCount();
+	conflicts = queue.claimConflictCount();
+	ok = allHandledOnce(nItems, handled);
+	return nItems / elapsed;
+}
+
+static bool benchWorkers(size_t nItems, int nJobs, int nReverse)
+{
+ unsigned long lockConflicts, stolen, claimConflicts;
+ bool lockedOk, claimsOk;
+ char label[32];
+	const double locked = runLocked(nItems, nJobs, nReverse, lockConflicts, lockedOk);
+	const double claims = runClaims(nItems, nJobs, nReverse, stolen, claimConflicts, claimsOk);
+	if( nReverse ){
+		snprintf( label, sizeof(label), "%d (%d -R)", nJobs, nReverse );
+	}
+	else{
+		snprintf( label, sizeof(label), "%d", nJobs );
+	}
+	printf( "%-10s %12.2f %10lu %12.2f %8lu %9lu%s\n", label, locked / 1e6, lockConflicts,
+		claims / 1e6, stolen, claimConflicts, (lockedOk && claimsOk)? "" : "  items lost or handed out twice!" );
+	return lockedOk && claimsOk;
+}
+
+int main(int argc, const char *argv[])
+{
+ size_t nItems = 1000000;
+ int maxJobs = 64;
+ bool ok = true;
+	if( argc > 3 ){
+		fprintf( stderr, "Usage: %s [items [maximum workers]]\n", argv[0] );
+		return EINVAL;
+	}
+	if( argc > 1 ){
+		nItems = strtoul( argv[1], NULL, 10 );
+	}
+	if( argc > 2 ){
+		maxJobs = atoi(argv[2]);
+	}
+	if( nItems == 0 || nItems >= 0xffffffffUL || maxJobs < 1 ){
+		fprintf( stderr, "%s: the number of items must be between 1 and 2^32-1, that of the workers at least 1\n", argv[0] );
+		return EINVAL;
+	}
+	init_HRTime();
+	printf( "%lu items, %u CPUs online\n", (unsigned long) nItems, std::thread::hardware_concurrency() );
+	printf( "%-10s %12s %10s %12s %8s %9s\n", "workers", "locked Mi/s", "conflicts", "claims Mi/s", "stolen", "retries" );
+	for( int nJobs = 1 ; nJobs <= maxJobs ; nJobs *= 2 ){
+		ok = benchWorkers(nItems, nJobs, 0) && ok;
+	}
+	if( maxJobs >= 8 ){
+		// forward and reverse workers, as with -S -R
+		ok = benchWorkers(nItems, 8, 4) && ok;
+	}
+	return (ok)? 0 : 1;
+}
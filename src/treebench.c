@@ -0,0 +1,164 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file treebench.c
+ * (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * Measures the per-file cost of a compression run on a tree of many small files: it creates
+ * (once) a tree of text files of 150 to 12000 bytes, 1000 per directory, then runs the given
+ * command on it and reports the wall, user and system time and the files per second.
+ * The tree is the same for a given number of files, so runs with different builds compare.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MIN_FILE_SIZE	150
+#define MAX_FILE_SIZE	12000
+#define FILES_PER_DIR	1000
+
+static uint64_t nextRandom(uint64_t *state)
+{
+	*state ^= *state << 13, *state ^= *state >> 7, *state ^= *state << 17;
+	return *state;
+}
+
+// words from a small vocabulary, so that the files compress like text
+static void generateText(char *buf, size_t len, uint64_t *state)
+{
+	static const char *words[] = {
+		"the", "file", "compressed", "of", "a", "chunk", "and", "data", "to", "is", "in", "attribute",
+		"resource", "fork", "size", "with", "for", "block", "table", "written", "read", "each", "new"
+	};
+	const size_t nWords = sizeof(words) / sizeof(words[0]);
+	size_t i = 0;
+	while (i < len) {
+		const uint64_t r = nextRandom(state);
+		const char *word = words[r % nWords];
+		for ( ; *word && i < len ; ++word) {
+			buf[i++] = *word;
+		}
+		if (i < len) {
+			buf[i++] = ((r >> 8) % 12 == 0)? '\n' : ' ';
+		}
+	}
+}
+
+// create the tree of <nFiles> files under <root>, unless a previous run did already
+static bool createTree(const char *root, unsigned long nFiles)
+{
+	char path[1024], marker[1024], *buf = malloc(MAX_FILE_SIZE);
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	FILE *fp;
+
+	snprintf(marker, sizeof(marker), "%s/.treebench-%lu", root, nFiles);
+	if (access(marker, F_OK) == 0) {
+		free(buf);
+		return true;
+	}
+	if (!buf) {
+		fprintf(stderr, "malloc error, out of memory\n");
+		return false;
+	}
+	if (mkdir(root, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "%s: %s\n", root, strerror(errno));
+		free(buf);
+		return false;
+	}
+	fprintf(stderr, "creating %lu files under %s...\n", nFiles, root);
+	for (unsigned long i = 0 ; i < nFiles ; ++i) {
+		const size_t size = MIN_FILE_SIZE + nextRandom(&state) % (MAX_FILE_SIZE - MIN_FILE_SIZE + 1);
+		if (i % FILES_PER_DIR == 0) {
+			snprintf(path, sizeof(path), "%s/d%05lu", root, i / FILES_PER_DIR);
+			if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+				fprintf(stderr, "%s: %s\n", path, strerror(errno));
+				free(buf);
+				return false;
+			}
+		}
+		snprintf(path, sizeof(path), "%s/d%05lu/f%03lu.txt", root, i / FILES_PER_DIR, i % FILES_PER_DIR);
+		generateText(buf, size, &state);
+		if (!(fp = fopen(path, "w")) || fwrite(buf, size, 1, fp) != 1 || fclose(fp) != 0) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			free(buf);
+			return false;
+		}
+	}
+	free(buf);
+	// (marks the tree as complete)
+	if (!(fp = fopen(marker, "w")) || fclose(fp) != 0) {
+		fprintf(stderr, "%s: %s\n", marker, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static double wallTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long nFiles;
+	char **command;
+	struct rusage usage;
+	double start, wall;
+	pid_t pid;
+	int status;
+
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s directory files command [argument ...]\n"
+				"\tcreates <files> files under <directory> (once) and runs <command> <argument>... <directory>\n"
+				"\tfor instance: %s /tmp/tree 1000000 ./afsctool -c -j1\n", argv[0], argv[0]);
+		return EINVAL;
+	}
+	nFiles = strtoul(argv[2], NULL, 10);
+	if (nFiles == 0) {
+		fprintf(stderr, "%s: the number of files must be at least 1\n", argv[0]);
+		return EINVAL;
+	}
+	if (!createTree(argv[1], nFiles)) {
+		return EIO;
+	}
+	// the command's arguments followed by the tree
+	if (!(command = calloc(argc - 1, sizeof(char*)))) {
+		fprintf(stderr, "malloc error, out of memory\n");
+		return ENOMEM;
+	}
+	memcpy(command, argv + 3, (argc - 3) * sizeof(char*));
+	command[argc - 3] = argv[1];
+	start = wallTime();
+	if ((pid = fork()) == 0) {
+		execvp(command[0], command);
+		fprintf(stderr, "%s: %s\n", command[0], strerror(errno));
+		_exit(127);
+	} else if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+		fprintf(stderr, "%s: cannot run %s (%s)\n", argv[0], command[0], strerror(errno));
+		free(command);
+		return EIO;
+	}
+	wall = wallTime() - start;
+	getrusage(RUSAGE_CHILDREN, &usage);
+	printf("%lu files: %.1fs wall (%.1fs user, %.1fs sys)  %.0f files/s\n", nFiles, wall,
+		   usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6,
+		   usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6, nFiles / wall);
+	free(command);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s: %s failed\n", argv[0], argv[3]);
+		return 1;
+	}
+	return 0;
+}
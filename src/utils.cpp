@@ -8,9 +8,24 @@
  */
 
 #include <string>
+#include <cstdlib>
+#include <cstring>
 #include <sparsehash/dense_hash_map>
+#include <cerrno>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if defined(linux)
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/sysmacros.h>
+#endif
+#include <map>
+#include <vector>
+
+#undef MUTEXEX_CAN_TIMEOUT
+#include "CritSectEx/CritSectEx.h"
 
 #include "utils.h"
 
@@ -52,3 +67,525 @@ bool checkForHardLink(const char *filepath, const struct stat *fileInfo, const s
 	return ret;
 }
 
+
+void initBufferArena(buffer_arena *arena, size_t maxRetained)
+{
+	memset(arena, 0, sizeof(*arena));
+	arena->maxRetained = maxRetained;
+}
+
+static void *arenaGrow(buffer_arena *arena, int slot, size_t size, bool preserve)
+{
+	auto s = &arena->slot[slot];
+	if (s->buf && s->size >= size) {
+		arena->allocationsAvoided += 1;
+		if (!preserve) {
+			// growing a buffer in place doesn't count as recycling it
+			arena->bytesRecycled += size;
+		}
+		return s->buf;
+	}
+	size_t newSize = s->size ? s->size : 0x10000;
+	while (newSize < size) {
+		newSize *= 2;
+	}
+	void *buf;
+	if (preserve) {
+		buf = realloc(s->buf, newSize);
+	} else {
+		// no need to copy anything
+		free(s->buf);
+		buf = malloc(newSize);
+	}
+	if (!buf) {
+		if (preserve) {
+			free(s->buf);
+		}
+		s->buf = NULL;
+		s->size = 0;
+		return NULL;
+	}
+	if (arena->firstTouch) {
+		// when preserving, the pages holding the old content have been touched already
+		static const size_t pageSize = sysconf(_SC_PAGESIZE);
+		for (size_t offset = preserve ? s->size : 0 ; offset < newSize ; offset += pageSize) {
+			((volatile char*) buf)[offset] = 0;
+		}
+	}
+	s->buf = buf;
+	s->size = newSize;
+	return buf;
+}
+
+void *arenaBuffer(buffer_arena *arena, int slot, size_t size)
+{
+	return arenaGrow(arena, slot, size, false);
+}
+
+void *arenaReserve(buffer_arena *arena, int slot, size_t size)
+{
+	return arenaGrow(arena, slot, size, true);
+}
+
+void trimBufferArena(buffer_arena *arena)
+{
+	for (int i = 0 ; i < BUFFER_ARENA_SLOTS ; ++i) {
+		if (arena->slot[i].size > arena->maxRetained) {
+			free(arena->slot[i].buf);
+			arena->slot[i].buf = NULL;
+			arena->slot[i].size = 0;
+		}
+	}
+}
+
+void releaseBufferArena(buffer_arena *arena)
+{
+	for (int i = 0 ; i < BUFFER_ARENA_SLOTS ; ++i) {
+		free(arena->slot[i].buf);
+		arena->slot[i].buf = NULL;
+		arena->slot[i].size = 0;
+	}
+	if (arena->context && arena->releaseContext) {
+		(*arena->releaseContext)(arena->context);
+	}
+	arena->context = NULL;
+	arena->releaseContext = NULL;
+}
+
+// the XXH64 round and avalanche functions
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static const uint64_t P64_1 = 0x9E3779B185EBCA87ULL, P64_2 = 0xC2B2AE3D27D4EB4FULL,
+	P64_3 = 0x165667B19E3779F9ULL, P64_4 = 0x85EBCA77C2B2AE63ULL, P64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t checksumRound(uint64_t acc, uint64_t input)
+{
+	return rotl64(acc + input * P64_2, 31) * P64_1;
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint64_t checksum64(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char*) data, *end = p + len;
+	uint64_t h;
+	if (len >= 32) {
+		// 4 independent lanes so the multiplications can overlap
+		uint64_t v1 = P64_1 + P64_2, v2 = P64_2, v3 = 0, v4 = 0 - P64_1;
+		do {
+			v1 = checksumRound(v1, read64(p));
+			v2 = checksumRound(v2, read64(p + 8));
+			v3 = checksumRound(v3, read64(p + 16));
+			v4 = checksumRound(v4, read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = (h ^ checksumRound(0, v1)) * P64_1 + P64_4;
+		h = (h ^ checksumRound(0, v2)) * P64_1 + P64_4;
+		h = (h ^ checksumRound(0, v3)) * P64_1 + P64_4;
+		h = (h ^ checksumRound(0, v4)) * P64_1 + P64_4;
+	} else {
+		h = P64_5;
+	}
+	h += len;
+	for ( ; p + 8 <= end ; p += 8) {
+		h = rotl64(h ^ checksumRound(0, read64(p)), 27) * P64_1 + P64_4;
+	}
+	for ( ; p < end ; ++p) {
+		h = rotl64(h ^ (*p * P64_5), 11) * P64_1;
+	}
+	h ^= h >> 33;
+	h *= P64_2;
+	h ^= h >> 29;
+	h *= P64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+namespace {
+struct ClassTally {
+	unsigned int count[CLASS_CHOICES];
+};
+google::dense_hash_map<string,ClassTally> *classTallies = nullptr;
+MutexEx classTallyLock(4000);
+}
+
+void tallyClassChoice(const char *className, int choice)
+{
+	if (choice < 0 || choice >= CLASS_CHOICES) {
+		return;
+	}
+	MutexEx::Scope scope(classTallyLock);
+	if (!classTallies) {
+		classTallies = new google::dense_hash_map<string,ClassTally>;
+		// '/' cannot occur in a file name (extension)
+		classTallies->set_empty_key(string("/"));
+	}
+	auto it = classTallies->find(className);
+	if (it == classTallies->end()) {
+		ClassTally tally = {{0}};
+		it = classTallies->insert(make_pair(string(className), tally)).first;
+	}
+	it->second.count[choice] += 1;
+}
+
+int classChoice(const char *className, unsigned int *tally)
+{
+	MutexEx::Scope scope(classTallyLock);
+	int choice = -1;
+	*tally = 0;
+	if (classTallies) {
+		auto it = classTallies->find(className);
+		if (it != classTallies->end()) {
+			for (int i = 0 ; i < CLASS_CHOICES ; ++i) {
+				*tally += it->second.count[i];
+				if (it->second.count[i] && (choice < 0 || it->second.count[i] > it->second.count[choice])) {
+					choice = i;
+				}
+			}
+		}
+	}
+	return choice;
+}
+
+bool initFileChecksums(file_checksums *checksums, off_t filesize)
+{
+	checksums->filesize = filesize;
+	checksums->numBlocks = (filesize + CHECKSUM_BLOCK_SIZE - 1) / CHECKSUM_BLOCK_SIZE;
+	checksums->sums = (uint64_t*) calloc(checksums->numBlocks ? checksums->numBlocks : 1, sizeof(uint64_t));
+	return checksums->sums != NULL;
+}
+
+void releaseFileChecksums(file_checksums *checksums)
+{
+	free(checksums->sums);
+	checksums->sums = NULL;
+	checksums->numBlocks = 0;
+}
+
+// the length of block <blockNr> of a file of <filesize> bytes
+static inline size_t blockLength(off_t filesize, size_t blockNr)
+{
+	const off_t start = (off_t) blockNr * CHECKSUM_BLOCK_SIZE;
+	return (filesize - start > CHECKSUM_BLOCK_SIZE) ? CHECKSUM_BLOCK_SIZE : filesize - start;
+}
+
+void addFileChecksums(file_checksums *checksums, const void *data, size_t len, off_t offset)
+{
+	size_t blockNr = offset / CHECKSUM_BLOCK_SIZE, last = (offset + len) / CHECKSUM_BLOCK_SIZE;
+	if ((off_t) (offset + len) == checksums->filesize) {
+		last = checksums->numBlocks;
+	}
+	for (const char *block = (const char*) data ; blockNr < last ; ++blockNr, block += CHECKSUM_BLOCK_SIZE) {
+		checksums->sums[blockNr] = checksum64(block, blockLength(checksums->filesize, blockNr));
+	}
+}
+
+ssize_t readChecksummed(int fd, void *buf, size_t len, off_t offset, file_checksums *checksums)
+{
+	if (!checksums) {
+		return read(fd, buf, len);
+	}
+	// read in windows of a few Mb, checksumming each window right after reading it
+	const size_t window = 64 * CHECKSUM_BLOCK_SIZE;
+	char *cursor = (char*) buf;
+	size_t done = 0, checked = 0;
+	while (done < len) {
+		const size_t want = (len - done > window) ? window : len - done;
+		ssize_t n = read(fd, cursor + done, want);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return (done) ? (ssize_t) done : n;
+		}
+		done += n;
+		// the blocks completed so far, including the file's last one
+		const size_t end = ((off_t) (offset + done) == checksums->filesize) ? done
+			: done / CHECKSUM_BLOCK_SIZE * CHECKSUM_BLOCK_SIZE;
+		if (end > checked) {
+			addFileChecksums(checksums, cursor + checked, end - checked, offset + checked);
+			checked = end;
+		}
+	}
+	return done;
+}
+
+uint64_t fileChecksumsHash(const file_checksums *checksums)
+{
+	return checksum64(checksums->sums, checksums->numBlocks * sizeof(uint64_t));
+}
+
+size_t verifyChecksummedFile(const file_checksums *checksums, int fd, size_t sampleBlocks,
+							 void *buf, bool *readFailure)
+{
+	const size_t numBlocks = checksums->numBlocks;
+	const bool sampling = sampleBlocks && numBlocks > sampleBlocks;
+	// when sampling, one block is picked at random from each of <sampleBlocks> equal strata,
+	// so that the whole file is covered and it is still read front to back.
+	const size_t nChecks = (sampling) ? sampleBlocks : numBlocks;
+	*readFailure = false;
+	for (size_t i = 0 ; i < nChecks ; ++i) {
+		size_t blockNr = i;
+		if (sampling) {
+			const size_t stratum = numBlocks / sampleBlocks;
+			blockNr = (i == nChecks - 1) ? numBlocks - 1 : i * stratum + (size_t) random() % stratum;
+		}
+		const size_t len = blockLength(checksums->filesize, blockNr);
+		const off_t offset = (off_t) blockNr * CHECKSUM_BLOCK_SIZE;
+		ssize_t n;
+		do {
+			n = pread(fd, buf, len, offset);
+		} while (n < 0 && errno == EINTR);
+		if (n != (ssize_t) len) {
+			*readFailure = true;
+			return blockNr;
+		}
+		if (checksum64(buf, len) != checksums->sums[blockNr]) {
+			return blockNr;
+		}
+	}
+	return numBlocks;
+}
+
+#if defined(linux)
+// read the first line of the (sysfs or cgroupfs) file <path>
+static bool readLine(const string &path, string &line)
+{
+	FILE *fp = fopen(path.c_str(), "r");
+	if (!fp) {
+		return false;
+	}
+	char buf[256];
+	const bool ok = fgets(buf, sizeof(buf), fp) != nullptr;
+	fclose(fp);
+	if (ok) {
+		line = buf;
+		while (!line.empty() && (line.back() == '\n' || line.back() == ' ')) {
+			line.pop_back();
+		}
+	}
+	return ok;
+}
+
+// the cgroup v2 directory of this process (the "0::" entry), or an empty string
+static string cgroupDir()
+{
+	FILE *fp = fopen("/proc/self/cgroup", "r");
+	string dir;
+	if (fp) {
+		char buf[1024];
+		while (fgets(buf, sizeof(buf), fp)) {
+			if (strncmp(buf, "0::", 3) == 0) {
+				dir = buf + 3;
+				while (!dir.empty() && dir.back() == '\n') {
+					dir.pop_back();
+				}
+				break;
+			}
+		}
+		fclose(fp);
+	}
+	return dir;
+}
+#endif
+
+void getSystemResources(system_resources *resources)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	resources->nCPUs = (n > 0) ? (int) n : 0;
+	resources->memory = (unsigned long long) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	resources->cpuLimited = resources->memoryLimited = false;
+#if defined(linux)
+	cpu_set_t cpus;
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) > 0
+			&& CPU_COUNT(&cpus) < resources->nCPUs) {
+		resources->nCPUs = CPU_COUNT(&cpus);
+		resources->cpuLimited = true;
+	}
+	// the limits of all the cgroups up to the root apply: take the lowest
+	string dir = cgroupDir();
+	if (dir.empty() || dir[0] != '/') {
+		return;
+	}
+	for (;;) {
+		const string cgroup = "/sys/fs/cgroup" + (dir == "/" ? string() : dir);
+		string line;
+		if (readLine(cgroup + "/cpu.max", line)) {
+			// "<quota> <period>" in microseconds, or "max <period>"
+			long long quota, period;
+			if (sscanf(line.c_str(), "%lld %lld", &quota, &period) == 2 && quota > 0 && period > 0) {
+				const int nCPUs = (int) ((quota + period - 1) / period);
+				if (nCPUs < resources->nCPUs) {
+					resources->nCPUs = nCPUs;
+					resources->cpuLimited = true;
+				}
+			}
+		}
+		if (readLine(cgroup + "/memory.max", line)) {
+			unsigned long long memory;
+			if (sscanf(line.c_str(), "%llu", &memory) == 1 && memory < resources->memory) {
+				resources->memory = memory;
+				resources->memoryLimited = true;
+			}
+		}
+		if (dir == "/") {
+			break;
+		}
+		const size_t slash = dir.rfind('/');
+		dir = (slash == 0 || slash == string::npos) ? "/" : dir.substr(0, slash);
+	}
+#endif
+}
+
+bool getDeviceInfo(dev_t dev, device_info *info)
+{
+	info->rotational = -1;
+	info->queueDepth = 0;
+#if defined(linux)
+	if (major(dev) == 0) {
+		// an anonymous device: ZFS, NFS, tmpfs, overlayfs, ...
+		return false;
+	}
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+	string device = path, line;
+	// a partition has no queue of its own; it uses the queue of the disk (its parent)
+	struct stat st;
+	if (stat((device + "/partition").c_str(), &st) == 0) {
+		device += "/..";
+	}
+	if (!readLine(device + "/queue/rotational", line)) {
+		return false;
+	}
+	info->rotational = atoi(line.c_str()) ? 1 : 0;
+	// the depth of the device's own command queue (SCSI/SATA) when known,
+	// otherwise the number of requests the block layer will queue for it
+	if (readLine(device + "/device/queue_depth", line) || readLine(device + "/queue/nr_requests", line)) {
+		info->queueDepth = atoi(line.c_str());
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+#if defined(linux)
+// parse a list of CPUs in the kernel's format ("0-3,8,10-11") into <cpus>;
+// CPUs that don't fit in a cpu_set_t are rejected.
+static bool parseCPUList(const char *list, vector<int> &cpus)
+{
+	while (*list && *list != '\n') {
+		char *end;
+		const long first = strtol(list, &end, 10);
+		long last = first;
+		if (end == list || first < 0 || first >= CPU_SETSIZE) {
+			return false;
+		}
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list || last < first || last >= CPU_SETSIZE) {
+				return false;
+			}
+		}
+		for (long cpu = first ; cpu <= last ; ++cpu) {
+			cpus.push_back((int) cpu);
+		}
+		list = (*end == ',') ? end + 1 : end;
+		if (*end && *end != ',' && *end != '\n') {
+			return false;
+		}
+	}
+	return true;
+}
+#endif
+
+int numaCPUPlacement(const char *cpuList, int *cpus, int *nodes, int maxCPUs)
+{
+#if defined(linux)
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		return 0;
+	}
+	vector<int> requested;
+	if (cpuList && *cpuList) {
+		if (!parseCPUList(cpuList, requested)) {
+			return 0;
+		}
+	} else {
+		for (int cpu = 0 ; cpu < CPU_SETSIZE ; ++cpu) {
+			if (CPU_ISSET(cpu, &allowed)) {
+				requested.push_back(cpu);
+			}
+		}
+	}
+	// the node of each CPU; CPUs not listed under any node (no NUMA support) are on node 0
+	map<int,int> nodeForCPU;
+	if (DIR *dir = opendir("/sys/devices/system/node")) {
+		while (struct dirent *entry = readdir(dir)) {
+			int node;
+			string line;
+			if (sscanf(entry->d_name, "node%d", &node) == 1
+					&& readLine(string("/sys/devices/system/node/") + entry->d_name + "/cpulist", line)) {
+				vector<int> nodeCPUs;
+				if (parseCPUList(line.c_str(), nodeCPUs)) {
+					for (int cpu : nodeCPUs) {
+						nodeForCPU[cpu] = node;
+					}
+				}
+			}
+		}
+		closedir(dir);
+	}
+	// the usable CPUs per node, in ascending order
+	map<int,vector<int> > cpusOnNode;
+	for (int cpu : requested) {
+		if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+			auto it = nodeForCPU.find(cpu);
+			cpusOnNode[(it != nodeForCPU.end()) ? it->second : 0].push_back(cpu);
+		}
+	}
+	// take a CPU from each node in turn
+	int n = 0;
+	for (size_t i = 0 ; n < maxCPUs ; ++i) {
+		bool added = false;
+		for (auto &node : cpusOnNode) {
+			if (i < node.second.size() && n < maxCPUs) {
+				cpus[n] = node.second[i];
+				nodes[n] = node.first;
+				n += 1;
+				added = true;
+			}
+		}
+		if (!added) {
+			break;
+		}
+	}
+	return n;
+#else
+	// macOS only has affinity hints, which Apple Silicon ignores
+	return 0;
+#endif
+}
+
+bool pinThreadToCPU(int cpu)
+{
+#if defined(linux)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	// pthread functions return the error instead of setting errno
+	errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	return errno == 0;
+#else
+	return false;
+#endif
+}
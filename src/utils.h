@@ -9,6 +9,8 @@
 
 #ifndef _UTILS_H
 
+#include <stdint.h>
+
 #include "fsctool.h"
 
 #ifdef __cplusplus
@@ -17,6 +19,130 @@ extern "C" {
 
 extern bool checkForHardLink(const char *filepath, const struct stat *fileInfo, const struct folder_info *folderinfo);
 
+#define BUFFER_ARENA_SLOTS	6
+// the default size above which arena buffers are not kept for reuse
+#define BUFFER_ARENA_MAX_RETAINED	(16 * 1024 * 1024)
+/**
+ * a set of buffers that are reused from one file to the next instead of being
+ * allocated and freed for each file. Each slot holds a single buffer, its content
+ * belonging to whoever requested it last. An arena is not thread-safe: every thread
+ * should use its own.
+ */
+typedef struct buffer_arena {
+	struct buffer_arena_slot {
+		void *buf;
+		size_t size;
+	} slot[BUFFER_ARENA_SLOTS];
+	// buffers larger than this are released by trimBufferArena()
+	size_t maxRetained;
+	// an object that lives as long as the arena (e.g. compressor state),
+	// and the function that releases it
+	void *context;
+	void (*releaseContext)(void *context);
+	// touch the pages of new buffers as soon as they are allocated, so that they are placed on
+	// the NUMA node of the (pinned) thread owning the arena, and not on that of the first thread
+	// to write to them (e.g. another worker compressing chunks into them).
+	bool firstTouch;
+	// statistics
+	unsigned long long bytesRecycled, allocationsAvoided;
+} buffer_arena;
+
+extern void initBufferArena(buffer_arena *arena, size_t maxRetained);
+// return the buffer in <slot>, guaranteed to be at least <size> bytes large.
+// Its content is undefined.
+extern void *arenaBuffer(buffer_arena *arena, int slot, size_t size);
+// like arenaBuffer(), but preserving the current content and growing the buffer
+// geometrically if it needs to grow.
+extern void *arenaReserve(buffer_arena *arena, int slot, size_t size);
+// release the buffers that are larger than arena->maxRetained
+extern void trimBufferArena(buffer_arena *arena);
+// release all buffers and the context object
+extern void releaseBufferArena(buffer_arena *arena);
+
+// a fast 64-bit checksum of <len> bytes, for detecting data corruption (not tampering!)
+extern uint64_t checksum64(const void *data, size_t len);
+
+// files are checksummed for verification in blocks of this size
+#define CHECKSUM_BLOCK_SIZE	0x10000
+/**
+ * the checksums of a file's blocks, recorded while the file is first read so that after
+ * rewriting it the file can be verified in a single streaming pass, without keeping
+ * a second copy of the data in memory.
+ */
+typedef struct file_checksums {
+    off_t filesize;
+    size_t numBlocks;
+    uint64_t *sums;
+} file_checksums;
+
+// set up <checksums> for a file of <filesize> bytes; returns false if out of memory
+extern bool initFileChecksums(file_checksums *checksums, off_t filesize);
+extern void releaseFileChecksums(file_checksums *checksums);
+// record the checksums of the blocks in the <len> bytes at <data>, which were read from <offset>
+// in the file (a block boundary). A partial block is only checksummed when it ends the file.
+extern void addFileChecksums(file_checksums *checksums, const void *data, size_t len, off_t offset);
+/**
+ * read <len> bytes from <fd> into <buf> as read() would, recording the checksums of the
+ * blocks read in <checksums> (which may be NULL) while the data is still in the cache.
+ * The data must start at a block boundary (<offset>) of the file.
+ */
+extern ssize_t readChecksummed(int fd, void *buf, size_t len, off_t offset, file_checksums *checksums);
+// a hash of the whole file, computed from its block <checksums>
+extern uint64_t fileChecksumsHash(const file_checksums *checksums);
+/**
+ * read the file back from <fd> and compare it with <checksums>: all of its blocks, or when
+ * <sampleBlocks> is not 0 and the file has more blocks than that, <sampleBlocks> randomly
+ * chosen ones (including the last one). <buf> must hold CHECKSUM_BLOCK_SIZE bytes.
+ * Returns the number of the first block that differs or couldn't be read (setting <readFailure>),
+ * or checksums->numBlocks when all checked blocks are intact.
+ */
+extern size_t verifyChecksummedFile(const file_checksums *checksums, int fd, size_t sampleBlocks,
+                                    void *buf, bool *readFailure);
+
+// the number of different choices tallyClassChoice() can record
+#define CLASS_CHOICES	8
+/**
+ * record that <choice> (0 <= choice < CLASS_CHOICES) was made for an item of class <className>
+ * (e.g. a file extension). Safe to use from multiple threads.
+ */
+extern void tallyClassChoice(const char *className, int choice);
+// the choice made most often for <className> (-1 if none), with the total number of choices in <tally>
+extern int classChoice(const char *className, unsigned int *tally);
+
+/**
+ * what the system, or the container we're running in, lets us use: the number of CPUs
+ * we may run on (the affinity mask, limited by the cgroup v2 cpu.max quota) and the memory
+ * (the physical memory, limited by the cgroup v2 memory.max). 0 when unknown.
+ */
+typedef struct system_resources {
+	int nCPUs;
+	unsigned long long memory;
+	// whether the cgroup limits are lower than what the hardware offers
+	bool cpuLimited, memoryLimited;
+} system_resources;
+extern void getSystemResources(system_resources *resources);
+
+// the properties of a block device that matter for the number of concurrent requests
+typedef struct device_info {
+	// 1 for a spinning disk, 0 otherwise, -1 if unknown (e.g. not a block device)
+	int rotational;
+	// the number of requests the device queues, 0 if unknown
+	int queueDepth;
+} device_info;
+// look up the properties of the device <dev>, as found in a file's st_dev; returns
+// false when they're unknown (which is the case for ZFS, network and virtual filesystems).
+extern bool getDeviceInfo(dev_t dev, device_info *info);
+
+/**
+ * list the CPUs in <cpuList> (like "0-7,16-23"; NULL or "" for all the CPUs we may run on)
+ * in <cpus>, ordered such that consecutive CPUs are on different NUMA nodes whenever possible,
+ * with the node of each CPU in <nodes>. Returns the number of CPUs listed (at most <maxCPUs>),
+ * 0 if the list is invalid or threads can't be pinned to CPUs on this platform.
+ */
+extern int numaCPUPlacement(const char *cpuList, int *cpus, int *nodes, int maxCPUs);
+// pin the calling thread to <cpu>; returns a success value
+extern bool pinThreadToCPU(int cpu);
+
 #ifdef __cplusplus
 }
 #endif //__cplusplus
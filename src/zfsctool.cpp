@@ -886,6 +886,9 @@ static ZFSDataSetCompressionInfo *fileIsCompressable(const char *inFile,
 						knownDataSet = PP->z_dataSet(properties[0]);
 						auto unknownDataSet = knownDataSet? knownDataSet : new ZFSDataSetCompressionInfo(properties);
 						PP->z_addDataSet(inFile, unknownDataSet);
+						// the datasets of a pool share its disks, and thus its I/O tokens
+						PP->setIODeviceGroup(inFileInfo->st_dev,
+							"pool " + dynamic_cast<ZFSDataSetCompressionInfo*>(unknownDataSet)->poolName);
 						gZFSDataSetCompressionForFSId[fsId] = unknownDataSet;
 						knownDataSet = unknownDataSet;
 					} else {
@@ -928,6 +931,7 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 	bool backupFile = folderinfo->backup_file;
 
 	void *inBuf = NULL, *outBuf = NULL;
+	file_checksums checksums = {};
 	off_t filesize = inFileInfo->st_size;
 	mode_t orig_mode;
 	struct timeval times[2];
@@ -1011,14 +1015,25 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 		return;
 	}
 	madvise(inBuf, filesize, MADV_SEQUENTIAL);
+	if (checkFiles && !initFileChecksums(&checksums, filesize)) {
+		fprintf(stderr, "%s: malloc error, unable to allocate the checksums for verification (%s)\n",
+				inFile, strerror(errno));
+		xclose(fdIn);
+		utimes(inFile, times);
+		free(inBuf);
+		return;
+	}
 	{
-		const ssize_t inRead = read(fdIn, inBuf, filesize);
+		// the checksums of the original data are recorded as it is read; the rewritten
+		// file will be verified against them.
+		const ssize_t inRead = readChecksummed(fdIn, inBuf, filesize, 0, (checkFiles)? &checksums : NULL);
 		if (inRead != filesize) {
 			fprintf(stderr, "%s: Error reading file; read %zd of %jd bytes (%s)\n",
 					inFile, inRead, (intmax_t)filesize, strerror(errno));
 			xclose(fdIn);
 			utimes(inFile, times);
 			free(inBuf);
+			releaseFileChecksums(&checksums);
 			return;
 		}
 	}
@@ -1130,8 +1145,7 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 	}
 	if (checkFiles) {
 		bool sizeMismatch = inFileInfo->st_size != filesize, readFailure = false, contentMismatch = false;
-		ssize_t checkRead = -2;
-		bool outBufMMapped = false;
+		size_t badBlock = checksums.numBlocks;
 		errno = 0;
 		fdIn = open(inFile, O_RDONLY | O_EXLOCK);
 		if (fdIn == -1) {
@@ -1140,39 +1154,24 @@ void compressFile(const char *inFile, struct stat *inFileInfo, struct folder_inf
 			goto fail;
 		}
 		if (!sizeMismatch) {
-#ifndef NO_USE_MMAP
-			outBuf = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE | MAP_NOCACHE, fdIn, 0);
-			outBufMMapped = true;
-#else
-			outBuf = malloc(outBuf, filesize);
-#endif
+			// read the file back block by block rather than mapping all of it next to inBuf
+			outBuf = malloc(CHECKSUM_BLOCK_SIZE);
 			if (!outBuf) {
 				xclose(fdIn);
-				fprintf(stderr, "%s: failure reallocating buffer for validation; %s\n", inFile, strerror(errno));
+				fprintf(stderr, "%s: failure allocating buffer for validation; %s\n", inFile, strerror(errno));
 				goto fail;
 			}
-			// this should be appropriate for simply reading into and comparing:
-			madvise(inBuf, filesize, MADV_SEQUENTIAL);
-			madvise(outBuf, filesize, MADV_SEQUENTIAL);
-			if (!outBufMMapped) {
-				errno = 0;
-				readFailure = (checkRead = read(fdIn, outBuf, filesize)) != filesize;
-			} else {
-				readFailure = false;
-				checkRead = filesize;
-			}
+			errno = 0;
+			badBlock = verifyChecksummedFile(&checksums, fdIn, folderinfo->check_samples, outBuf, &readFailure);
+			contentMismatch = badBlock < checksums.numBlocks && !readFailure;
 		}
 		xclose(fdIn);
-		if (sizeMismatch || readFailure
-				|| (contentMismatch = memcmp(outBuf, inBuf, filesize) != 0)) {
-			fprintf(stderr, "\tsize mismatch=%d read=%zd failure=%d content mismatch=%d (%s)\n",
-					sizeMismatch, checkRead, readFailure, contentMismatch, strerror(errno));
+		if (sizeMismatch || readFailure || contentMismatch) {
+			fprintf(stderr, "\tsize mismatch=%d failure=%d content mismatch=%d block=%zu (%s)\n",
+					sizeMismatch, readFailure, contentMismatch, badBlock, strerror(errno));
 fail:
 			;
 			printf("%s: Compressed file check failed, trying to rewrite a second time\n", inFile);
-			if (outBufMMapped) {
-				xmunmap(outBuf, filesize);
-			}
 			if (backupName) {
 				fprintf(stderr, "\tin case of further failures, a backup will be available as %s\n", backupName);
 			}
@@ -1190,9 +1189,6 @@ fail:
 			}
 			fclose(in);
 		}
-		if (outBufMMapped) {
-			xmunmap(outBuf, filesize);
-		}
 	}
 
 	if (!testing) {
@@ -1242,6 +1238,7 @@ bail:
 	}
 	xfree(inBuf);
 	xfree(outBuf);
+	releaseFileChecksums(&checksums);
 }
 
 #if 0
@@ -1515,7 +1512,7 @@ void process_folder(FTS *currfolder, struct folder_info *folderinfo)
 						if (PP) {
 							if (fileIsCompressable(currfile->fts_path, currfile->fts_statp, folderinfo, PP)) {
 								addFileToParallelProcessor(PP, currfile->fts_path, currfile->fts_statp, folderinfo, false);
-							} else {
+							} else if (!parallelProcessorIsStreaming(PP)) {
 								process_file_info(currfile->fts_path, NULL, currfile->fts_statp, getParallelProcessorJobInfo(PP));
 							}
 						} else {
@@ -1541,7 +1538,7 @@ void process_folder(FTS *currfolder, struct folder_info *folderinfo)
 void printUsage()
 {
 	printf(ZFSCTOOL_PROG_NAME " %s\n"
-	   "Apply compression to file or folder: " ZFSCTOOL_PROG_NAME " -c[nlfFLvv[v]b] [-q] [-jN|-JN] [-S [-RM] ] [-<level>] [-m <size>] [-T compressor] file[s]/folder[s]\n\n"
+	   "Apply compression to file or folder: " ZFSCTOOL_PROG_NAME " -c[nlfFLvv[v]b] [-PN] [-q] [-jN|-JN] [-S [-RM] ] [-<level>] [-m <size>] [-T compressor] file[s]/folder[s]\n\n"
 	   "Options:\n"
 	   "-v Increase verbosity level\n"
 	   "-F allow (re)compression to the dataset's current compression type (a.k.a. undo mode)\n"
@@ -1549,12 +1546,27 @@ void printUsage()
 	   "-L follow symbolic links; compress the target if it is a regular file.\n"
 	   "-l List files which fail to compress\n"
 	   "-n Do not verify files after compression (not recommended)\n"
+	   "-PN Verify only <N> randomly chosen 64Kb blocks of files that have more (default: verify all)\n"
 	   "-m <size> Largest file size to compress, in bytes\n"
 	   "-b make a backup of files before compressing them\n"
 	   "-jN compress (only compressable) files using <N> threads (disk IO is exclusive)\n"
 	   "-JN read, compress and write files (only compressable ones) using <N> threads (everything is concurrent)\n"
+	   "-jauto use a thread per available CPU (taking cgroup limits into account), with exclusive disk IO\n"
+	   "       (the devices of a ZFS pool can't be identified; use -IW for concurrent IO) and a -M budget of half the memory\n"
 	   "-S sort the item list by file size (leaving the largest files to the end may be beneficial if the target volume is almost full)\n"
+	   "   The workers start while the files are still being found, so only the files waiting to be\n"
+	   "   processed are sorted, unless -SS is used\n"
 	   "-RM <M> of the <N> workers will work the item list (must be sorted!) in reverse order, starting with the largest files\n"
+	   "-SS schedule the item list by estimated processing time: all workers take the largest file left,\n"
+	   "    the small files filling in at the end so that the workers finish together (ignores -R)\n"
+	   "-A adapt the number of active workers to the measured throughput, up to <N> (default: twice the\n"
+	   "   number of CPUs). Workers are parked when adding them no longer makes things go faster\n"
+	   "-IW <W> workers can read or write files in the same ZFS pool at the same time (default 1);\n"
+	   "    workers doing I/O in different pools never wait for each other\n"
+	   "-N[cpulist] pin the workers to the CPUs in <cpulist> (e.g. 0-7,16-23; default: all available CPUs),\n"
+	   "            alternating between the NUMA nodes, with their buffers allocated on their node (Linux only)\n"
+	   "-MN limit the memory used by the files being rewritten to <N> Mb together (-jauto: half the available memory;\n"
+	   "    -M0: no limit). Files that don't fit wait, or are set aside while a worker takes a smaller one\n"
 	   "-T <compression> Compression codec to use, chosen from the supported ZFS compression types:\n"
 	   "                 " COMPRESSIONNAMES "\n"
 	   "                 or 'test' to perform a dry-run.\n"
@@ -1575,8 +1587,11 @@ int zfsctool(int argc, const char *argv[])
 	bool printDir = FALSE, applycomp = FALSE,
 		 fileCheck = TRUE, argIsFile, hardLinkCheck = FALSE, free_src = FALSE, free_dst = FALSE,
 		 backupFile = FALSE, follow_sym_links = FALSE;
-	int nJobs = 0, nReverse = 0;
-	bool sortQueue = false;
+	int nJobs = 0, nReverse = 0, ioWidth = 0;
+	const char *cpuPlacement = nullptr;
+	long long memoryBudget = -1;
+	long checkSamples = 0;
+	bool sortQueue = false, sortByCost = false, autoScale = false, autoJobs = false;
 	std::string codec = "test";
 
 	if (argc < 2) {
@@ -1678,6 +1693,8 @@ int zfsctool(int argc, const char *argv[])
 							fprintf(stderr, "Warning: reverse jobs must be a positive number (%s)\n", argv[i]);
 							nReverse = 0;
 						}
+					} else if (strcasecmp(&argv[i][j + 1], "auto") == 0) {
+						autoJobs = true;
 					} else {
 						nJobs = atoi(&argv[i][j + 1]);
 						if (nJobs <= 0) {
@@ -1687,12 +1704,64 @@ int zfsctool(int argc, const char *argv[])
 					}
 					goto next_arg;
 					break;
+				case 'P':
+					checkSamples = atol(&argv[i][j + 1]);
+					if (checkSamples <= 0) {
+						fprintf(stderr, "Warning: the number of blocks to verify must be positive (%s)\n", argv[i]);
+						checkSamples = 0;
+					}
+					goto next_arg;
+					break;
 				case 'S':
 					if (!applycomp) {
 						printUsage();
 						return(EINVAL);
 					}
 					sortQueue = true;
+					if (argv[i][j + 1] == 'S') {
+						sortByCost = true;
+					}
+					goto next_arg;
+					break;
+				case 'A':
+					if (!applycomp) {
+						printUsage();
+						return(EINVAL);
+					}
+					autoScale = true;
+					break;
+				case 'I':
+					if (!applycomp) {
+						printUsage();
+						return(EINVAL);
+					}
+					ioWidth = atoi(&argv[i][j + 1]);
+					if (ioWidth <= 0) {
+						fprintf(stderr, "Warning: the number of concurrent I/O workers must be a positive number (%s)\n", argv[i]);
+						ioWidth = 0;
+					}
+					goto next_arg;
+					break;
+				case 'N':
+					if (!applycomp) {
+						printUsage();
+						return(EINVAL);
+					}
+					cpuPlacement = &argv[i][j + 1];
+					goto next_arg;
+					break;
+				case 'M':
+					if (!applycomp) {
+						printUsage();
+						return(EINVAL);
+					}
+					memoryBudget = atoll(&argv[i][j + 1]);
+					if (memoryBudget < 0) {
+						fprintf(stderr, "Warning: the memory budget cannot be negative (%s)\n", argv[i]);
+						memoryBudget = -1;
+					} else {
+						memoryBudget *= 1024 * 1024;
+					}
 					goto next_arg;
 					break;
 				case 'q':
@@ -1728,6 +1797,26 @@ next_arg:
 	gZFSDataSetCompressionForFSId.set_empty_key(0);
 	gZFSDataSetCompressionForFSId.clear();
 
+	if (autoJobs) {
+		system_resources resources;
+		getSystemResources(&resources);
+		nJobs = (resources.nCPUs > 0) ? resources.nCPUs : 1;
+		if (autoScale) {
+			nJobs *= 2;
+		}
+		// the I/O tokens of each pool are set according to the type of its device instead
+		exclusive_io = true;
+		if (memoryBudget < 0) {
+			memoryBudget = resources.memory / 2;
+		}
+		fprintf(stderr, "Automatic mode: %d workers for %d%s CPUs, %lld Mb in flight at most\n",
+				nJobs, resources.nCPUs, resources.cpuLimited ? " available" : "", memoryBudget / (1024 * 1024));
+	}
+	if (autoScale && nJobs == 0) {
+		// leave the autoscaler room to grow beyond a worker per CPU
+		long nCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+		nJobs = (nCPUs > 0) ? 2 * nCPUs : 2;
+	}
 	if (backupFile) {
 		if (nJobs) {
 			fprintf(stderr, "Warning: using backup files imposes single-threaded processing!\n");
@@ -1739,8 +1828,24 @@ next_arg:
 		if (nReverse && !sortQueue) {
 			fprintf(stderr, "Warning: reverse jobs are ignored when the item list is not sorted (-S)\n");
 			nReverse = 0;
+		} else if (nReverse && sortByCost) {
+			fprintf(stderr, "Warning: reverse jobs are ignored when scheduling by cost (-SS)\n");
+			nReverse = 0;
 		}
 		PP = createParallelProcessor(nJobs, nReverse, printVerbose);
+		if (PP && autoScale) {
+			setParallelProcessorAutoScaling(PP, true);
+		}
+		if (PP && (ioWidth || autoJobs)) {
+			// 0: according to the device type
+			setParallelProcessorIOWidth(PP, ioWidth);
+		}
+		if (PP && cpuPlacement && !setParallelProcessorCPUPlacement(PP, cpuPlacement)) {
+			fprintf(stderr, "Warning: cannot pin the workers to CPUs \"%s\"\n", cpuPlacement);
+		}
+		if (PP && memoryBudget > 0) {
+			setParallelProcessorMemoryBudget(PP, memoryBudget);
+		}
 	}
 
 	// ignore signals due to exceeding CPU or file size limits
@@ -1752,6 +1857,36 @@ next_arg:
 	signal(SIGBUS, signal_handler);
 	signal(SIGSEGV, signal_handler);
 
+	// the settings for the files and folders to process; the statistics are reset for each argument
+	folderinfo.print_info = (nJobs) ? false : printVerbose;
+	folderinfo.print_files = (nJobs == 0) ? printDir : 0;
+	folderinfo.compress_files = applycomp;
+	folderinfo.check_files = fileCheck;
+	folderinfo.check_samples = checkSamples;
+	folderinfo.z_compression = &codec;
+	folderinfo.minSavings = minSavings;
+	folderinfo.maxSize = maxSize;
+	folderinfo.check_hard_links = hardLinkCheck;
+	folderinfo.follow_sym_links = follow_sym_links;
+	folderinfo.backup_file = backupFile;
+
+	// unless the whole list is needed to schedule it, process the files while the scan is finding them
+	if (PP && !sortByCost) {
+		struct folder_info *fi = getParallelProcessorJobInfo(PP);
+		memcpy(fi, &folderinfo, sizeof(*fi));
+		fi->num_files = fi->num_folders = 0;
+		fi->num_compressed = 0;
+		fi->num_hard_link_files = fi->num_hard_link_folders = 0;
+		fi->uncompressed_size = fi->uncompressed_size_rounded = 0;
+		fi->compressed_size = fi->compressed_size_rounded = 0;
+		fi->compattr_size = 0;
+		fi->total_size = 0;
+		if (startParallelProcessor(PP, sortQueue, PARALLEL_QUEUE_LIMIT)) {
+			fprintf(stderr, "Started %d worker thread(s) to (re)compress the files as they are found with compression '%s'\n",
+					nJobs, codec.c_str());
+		}
+	}
+
 	int N, step, n;
 	N = argc;
 	step = 1;
@@ -1808,16 +1943,6 @@ next_arg:
 		folderinfo.num_hard_link_files = 0;
 		folderinfo.num_folders = 0;
 		folderinfo.num_hard_link_folders = 0;
-		folderinfo.print_info = (nJobs) ? false : printVerbose;
-		folderinfo.print_files = (nJobs == 0) ? printDir : 0;
-		folderinfo.compress_files = applycomp;
-		folderinfo.check_files = fileCheck;
-		folderinfo.z_compression = &codec;
-		folderinfo.minSavings = minSavings;
-		folderinfo.maxSize = maxSize;
-		folderinfo.check_hard_links = hardLinkCheck;
-		folderinfo.follow_sym_links = follow_sym_links;
-		folderinfo.backup_file = backupFile;
 
 		if (applycomp && argIsFile) {
 			// this used to use a private folder_info struct with a settings subset:
@@ -1830,7 +1955,8 @@ next_arg:
 			if (PP) {
 				if (fileIsCompressable(fullpath, &fileinfo, &folderinfo, PP)) {
 					addFileToParallelProcessor(PP, fullpath, &fileinfo, &folderinfo, true);
-				} else {
+				} else if (!parallelProcessorIsStreaming(PP)) {
+					// (the workers account for the files they process in the job info)
 					process_file_info(fullpath, NULL, &fileinfo, getParallelProcessorJobInfo(PP));
 				}
 			} else {
@@ -1873,7 +1999,7 @@ next_arg:
 					}
 				}
 			}
-			if (PP && nJobs > 0) {
+			if (PP && nJobs > 0 && !parallelProcessorIsStreaming(PP)) {
 				struct folder_info *fi = getParallelProcessorJobInfo(PP);
 				memcpy(fi, &folderinfo, sizeof(*fi));
  				// reset certain fields
@@ -1909,21 +2035,30 @@ next_arg:
 				fi->total_size = 0;
 			}
 		}
-		if (sortQueue) {
+		if (sortByCost) {
+			sortFilesInParallelProcessorByCost(PP);
+		} else if (sortQueue && !parallelProcessorIsStreaming(PP)) {
 			sortFilesInParallelProcessorBySize(PP);
 		}
-		if (size_t nFiles = filesInParallelProcessor(PP)) {
-			if (nJobs > nFiles) {
-				nJobs = nFiles;
-				if (nJobs < nReverse) {
-					// user asked a certain amount of reverse jobs;
-					// respect that as well if we can
-					nReverse = nJobs;
+		const size_t nFiles = filesInParallelProcessor(PP);
+		const bool streaming = parallelProcessorIsStreaming(PP);
+		if (nFiles || streaming) {
+			if (streaming) {
+				// the workers are already running
+				fprintf(stderr, "Found %lu file(s), waiting for the workers to finish\n", nFiles);
+			} else {
+				if ((size_t) nJobs > nFiles) {
+					nJobs = nFiles;
+					if (nJobs < nReverse) {
+						// user asked a certain amount of reverse jobs;
+						// respect that as well if we can
+						nReverse = nJobs;
+					}
+					changeParallelProcessorJobs(PP, nJobs, nReverse);
 				}
-				changeParallelProcessorJobs(PP, nJobs, nReverse);
+				fprintf(stderr, "Starting %d worker thread(s) to (re)compress %lu file(s) with compression '%s'\n",
+						nJobs, nFiles, codec.c_str());
 			}
-			fprintf(stderr, "Starting %d worker thread(s) to (re)compress %lu file(s) with compression '%s'\n",
-					nJobs, nFiles, codec.c_str());
 			int processed = runParallelProcessor(PP);
 			fprintf(stderr, "Processed %d entries, applying new compression '%s'\n", processed, codec.c_str());
 			if (printVerbose > 0) {
@@ -0,0 +1,499 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file golden_images.c
+ * (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * Checks that the chunk drivers build the same compressed images as afsctool did before the
+ * codecs were moved out of compressFile(), through each of the ways an image can be built:
+ * compressing the chunks on the fly, from chunks compressed beforehand (by the chunk tasks),
+ * and streaming the file through a window.
+ *
+ * The ZLIB reference hashes were made by running the afsctool of that time on the test files
+ * (`golden_images -w <dir>` writes them), printing the 64-bit FNV-1a hash of the decmpfs
+ * attribute and the resource fork that its dry-run mode would have written. They are for
+ * zlib's deflate; libdeflate produces different (but equally valid) data.
+ * The LZVN and LZFSE images are compared with images assembled here the way compressFile()
+ * assembled them, from the output of the LZFSE library's encoders.
+ *
+ * The reference images are built without -D; with -D (identical chunks stored once) the ZLIB
+ * images are checked by decoding them, since they are expected to differ.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAS_LZVN
+#	include "private/lzfse/src/lzfse_internal.h"
+#endif
+#ifdef HAS_LZFSE
+#	include "private/lzfse/src/lzfse.h"
+#endif
+
+#include "testdata.h"
+
+static const test_file testFiles[] = {
+	{ "tiny", 150, "t" },
+	{ "small", 3000, "t" },
+	{ "onechunk", 65536, "t" },
+	{ "partial", 100000, "tt" },
+	{ "text", 5 * 65536 + 1234, "tttttt" },
+	{ "mixed", 6 * 65536 - 777, "tzrtzr" },
+	{ "zeros", 4 * 65536 + 10, "zzzzz" },
+	{ "repeated", 6 * 65536, "ABABzA" },
+	// the short last chunk is the start of the 'A' chunks, but not identical to them
+	{ "tail", 3 * 65536 + 1000, "AzAA" },
+};
+#define N_TEST_FILES	(sizeof(testFiles) / sizeof(testFiles[0]))
+
+typedef struct golden_image {
+	const char *file;
+	// the afsctool options: -c<level>[L]
+	int compressionlevel;
+	bool allowLargeBlocks;
+	unsigned int decmpfsSize;
+	UInt64 decmpfsHash;
+	size_t resourceForkSize;
+	UInt64 resourceForkHash;
+} golden_image;
+
+static const golden_image zlibImages[] = {
+	{ "tiny", 5, false, 122, 0xe8927898e6e20106ULL, 0, 0 },
+	{ "tiny", 9, false, 122, 0x07c063cb7988affaULL, 0, 0 },
+	{ "tiny", 1, true, 122, 0x5e1bf60ebee6bc45ULL, 0, 0 },
+	{ "small", 5, false, 1114, 0xba1516c7bf0a3705ULL, 0, 0 },
+	{ "small", 9, false, 1114, 0x336d20e4a352c309ULL, 0, 0 },
+	{ "small", 1, true, 1185, 0x97c67a9b81d51a74ULL, 0, 0 },
+	{ "onechunk", 5, false, 16, 0x03e8bc960e98b5feULL, 20257, 0x27d5708d974621beULL },
+	{ "onechunk", 9, false, 16, 0x03e8bc960e98b5feULL, 19077, 0x354147f8a847b979ULL },
+	{ "onechunk", 1, true, 16, 0x03e8bc960e98b5feULL, 23387, 0x04c0a64acc114d98ULL },
+	{ "partial", 5, false, 16, 0x2cc265ff5695f768ULL, 30923, 0xe9998b916881c40cULL },
+	{ "partial", 9, false, 16, 0x2cc265ff5695f768ULL, 29341, 0x15312cf54369176aULL },
+	{ "partial", 1, true, 16, 0x2cc265ff5695f768ULL, 35655, 0xfc3ace4b4384551dULL },
+	{ "text", 5, false, 16, 0xf20822d8760fd564ULL, 100420, 0x3f25ddd9e2430b63ULL },
+	{ "text", 9, false, 16, 0xf20822d8760fd564ULL, 94423, 0x0c7a7cd4a72756a6ULL },
+	{ "text", 1, true, 16, 0xf20822d8760fd564ULL, 116206, 0x898cb7013fb11a88ULL },
+	// (the random chunks need -L)
+	{ "mixed", 1, true, 16, 0x0d181fddaac3dd49ULL, 177423, 0xb24fc294d916b1a4ULL },
+	{ "zeros", 5, false, 16, 0x28063a33865f2019ULL, 701, 0xef28b286bd66b943ULL },
+	{ "zeros", 9, false, 16, 0x28063a33865f2019ULL, 701, 0x48c8a47dbd5929b3ULL },
+	{ "zeros", 1, true, 16, 0x28063a33865f2019ULL, 1593, 0x514b0af334e86c17ULL },
+	{ "repeated", 5, false, 16, 0xb4f8c79768dfd6e1ULL, 100391, 0xf23e215b05958680ULL },
+	{ "repeated", 9, false, 16, 0xb4f8c79768dfd6e1ULL, 94197, 0x11f5781165bd857dULL },
+	{ "repeated", 1, true, 16, 0xb4f8c79768dfd6e1ULL, 116190, 0xaf8f5a7348b3604eULL },
+};
+
+// the chunks of the precompressed images are compressed in ranges of this many chunks,
+// and the streamed images are read in windows of this many chunks
+#define TEST_RANGE_BLOCKS	2
+
+static const test_file *findTestFile(const char *name)
+{
+	for (size_t i = 0 ; i < N_TEST_FILES ; ++i) {
+		if (strcmp(testFiles[i].name, name) == 0) {
+			return &testFiles[i];
+		}
+	}
+	return NULL;
+}
+
+typedef enum build_mode { COMPRESSING, PRECOMPRESSED, STREAMED } build_mode;
+static const char *buildModeName[] = { "compressing", "precompressed", "streamed" };
+
+/**
+ * build the image of <file> in <mode>. The image is copied into <decmpfsCopy> and
+ * <resourceForkCopy> (which the caller frees) because it lives in the arena.
+ */
+static bool buildTestImage(const test_file *file, const void *data, build_mode mode, int comptype,
+						   int compressionlevel, bool allowLargeBlocks, bool shareChunks, compressed_image *image,
+						   void **decmpfsCopy, void **resourceForkCopy)
+{
+	buffer_arena arena;
+	chunk_compressor compressor;
+	const unsigned int numBlocks = (file->size + DECMPFS_CHUNK_SIZE - 1) / DECMPFS_CHUNK_SIZE;
+	const unsigned int nRanges = (numBlocks + TEST_RANGE_BLOCKS - 1) / TEST_RANGE_BLOCKS;
+	chunk_range_result *ranges = NULL;
+	unsigned long *chunkSizes = NULL;
+	precompressed_chunks precompressed;
+	chunk_stream stream;
+	FILE *fp = NULL;
+	bool ok = false;
+
+	initBufferArena(&arena, BUFFER_ARENA_MAX_RETAINED);
+	memset(image, 0, sizeof(*image));
+	image->shareChunks = shareChunks;
+	*decmpfsCopy = *resourceForkCopy = NULL;
+	if (!initChunkCompressor(&compressor, file->name, &arena, comptype, compressionlevel, allowLargeBlocks)) {
+		releaseBufferArena(&arena);
+		return false;
+	}
+	switch (mode) {
+		case COMPRESSING:
+			ok = buildCompressedImage(image, file->name, data, file->size, comptype, &compressor, NULL, &arena);
+			break;
+		case PRECOMPRESSED:
+			// like the chunk tasks do it, minus the parallelism
+			ranges = calloc(nRanges, sizeof(chunk_range_result));
+			chunkSizes = calloc(numBlocks, sizeof(unsigned long));
+			ok = ranges && chunkSizes;
+			for (unsigned int blockNr = 0 ; ok && blockNr < numBlocks ; ++blockNr) {
+				chunk_range_result *range = &ranges[blockNr / TEST_RANGE_BLOCKS];
+				off_t offset = (off_t) blockNr * DECMPFS_CHUNK_SIZE;
+				uLong len = (file->size - offset > DECMPFS_CHUNK_SIZE)? DECMPFS_CHUNK_SIZE : file->size - offset;
+				if (!range->buf) {
+					range->capacity = TEST_RANGE_BLOCKS * (DECMPFS_CHUNK_SIZE + 1024);
+					range->buf = malloc(range->capacity);
+				}
+				ok = range->buf && compressChunk(&compressor, (const char*) data + offset, len,
+												 blockNr, numBlocks, &chunkSizes[blockNr]);
+				if (ok) {
+					memcpy((char*) range->buf + range->size, compressor.outBufBlock, chunkSizes[blockNr]);
+					range->size += chunkSizes[blockNr];
+				}
+			}
+			if (ok) {
+				precompressed.rangeBlocks = TEST_RANGE_BLOCKS;
+				precompressed.ranges = ranges;
+				precompressed.chunkSizes = chunkSizes;
+				ok = buildCompressedImage(image, file->name, data, file->size, comptype, NULL, &precompressed, &arena);
+			}
+			break;
+		case STREAMED:
+			ok = (fp = tmpfile()) && fwrite(data, file->size, 1, fp) == 1 && fflush(fp) == 0
+				&& initChunkStream(&stream, file->name, fileno(fp), file->size,
+								   TEST_RANGE_BLOCKS * DECMPFS_CHUNK_SIZE, false, &arena);
+			if (ok) {
+				ok = buildStreamedImage(image, &stream, comptype, &compressor, &arena);
+				releaseChunkStream(&stream);
+			}
+			break;
+	}
+	if (ok) {
+		*decmpfsCopy = malloc(image->decmpfsSize);
+		memcpy(*decmpfsCopy, image->decmpfsBuf, image->decmpfsSize);
+		image->decmpfsBuf = *decmpfsCopy;
+		if (image->resourceFork) {
+			*resourceForkCopy = malloc(image->resourceForkSize);
+			memcpy(*resourceForkCopy, image->resourceFork, image->resourceForkSize);
+			image->resourceFork = *resourceForkCopy;
+		}
+	}
+	if (ranges) {
+		for (unsigned int i = 0 ; i < nRanges ; ++i) {
+			free(ranges[i].buf);
+		}
+		free(ranges);
+	}
+	free(chunkSizes);
+	if (fp) {
+		fclose(fp);
+	}
+	releaseChunkCompressor(&compressor);
+	releaseBufferArena(&arena);
+	return ok;
+}
+
+static bool checkImage(const char *what, const compressed_image *image, unsigned int decmpfsSize, UInt64 decmpfsHash,
+					   size_t resourceForkSize, UInt64 resourceForkHash)
+{
+	UInt64 dHash = fnv1a64(image->decmpfsBuf, image->decmpfsSize);
+	UInt64 rHash = (image->resourceFork)? fnv1a64(image->resourceFork, image->resourceForkSize) : 0;
+	size_t rSize = (image->resourceFork)? image->resourceForkSize : 0;
+	if (image->decmpfsSize != decmpfsSize || dHash != decmpfsHash || rSize != resourceForkSize || rHash != resourceForkHash) {
+		fprintf(stderr, "FAIL %s: decmpfs %u bytes %016llx, resource fork %lu bytes %016llx;"
+				" expected %u bytes %016llx, %lu bytes %016llx\n", what,
+				image->decmpfsSize, (unsigned long long) dHash, (unsigned long) rSize, (unsigned long long) rHash,
+				decmpfsSize, (unsigned long long) decmpfsHash, (unsigned long) resourceForkSize,
+				(unsigned long long) resourceForkHash);
+		return false;
+	}
+	return true;
+}
+
+static int checkZlibImages()
+{
+	int failures = 0;
+	for (size_t i = 0 ; i < sizeof(zlibImages) / sizeof(zlibImages[0]) ; ++i) {
+		const golden_image *golden = &zlibImages[i];
+		const test_file *file = findTestFile(golden->file);
+		void *data = generateTestFile(file);
+		for (int mode = COMPRESSING ; mode <= STREAMED ; ++mode) {
+			compressed_image image;
+			void *decmpfsCopy, *resourceForkCopy;
+			char what[128];
+			snprintf(what, sizeof(what), "%s -c%d%s, %s", file->name, golden->compressionlevel,
+					 (golden->allowLargeBlocks)? "L" : "", buildModeName[mode]);
+			if (!buildTestImage(file, data, mode, ZLIB, golden->compressionlevel, golden->allowLargeBlocks, false,
+								&image, &decmpfsCopy, &resourceForkCopy)) {
+				fprintf(stderr, "FAIL %s: the image could not be built\n", what);
+				failures += 1;
+				continue;
+			}
+			if (!checkImage(what, &image, golden->decmpfsSize, golden->decmpfsHash,
+							golden->resourceForkSize, golden->resourceForkHash)) {
+				failures += 1;
+			}
+			free(decmpfsCopy);
+			free(resourceForkCopy);
+		}
+		free(data);
+	}
+	return failures;
+}
+
+// the images built with -D, and the number of chunks they store only once
+typedef struct shared_image {
+	const char *file;
+	int compressionlevel;
+	bool allowLargeBlocks;
+	unsigned int sharedChunks;
+} shared_image;
+
+static const shared_image sharedImages[] = {
+	{ "text", 5, false, 0 },
+	{ "mixed", 1, true, 1 },
+	// (the short last chunk of these isn't shared with the full chunks it is the start of)
+	{ "zeros", 5, false, 3 },
+	{ "repeated", 5, false, 3 },
+	{ "repeated", 1, true, 3 },
+	{ "tail", 5, false, 1 },
+};
+
+// check that <image> decodes to the <file->size> bytes at <data>, verified and written out
+static bool checkDecodedImage(const char *what, const compressed_image *image, const test_file *file, const void *data)
+{
+	const unsigned int numBlocks = (file->size + DECMPFS_CHUNK_SIZE - 1) / DECMPFS_CHUNK_SIZE;
+	char *chunkBuf = malloc(DECMPFS_CHUNK_SIZE), *decoded = malloc(file->size);
+	FILE *fp = tmpfile();
+	unsigned int bad;
+	bool ok = false;
+
+	if (!chunkBuf || !decoded || !fp) {
+		fprintf(stderr, "FAIL %s: cannot set up the decoding (%s)\n", what, strerror(errno));
+	} else if ((bad = checkImageChunks(image, ZLIB, file->size, data, NULL, 0, numBlocks, chunkBuf, NULL)) != numBlocks) {
+		fprintf(stderr, "FAIL %s: chunk #%u doesn't decode to the original data\n", what, bad);
+	} else if (!writeDecodedImage(image, ZLIB, fileno(fp), what)) {
+		fprintf(stderr, "FAIL %s: the image could not be written out decoded\n", what);
+	} else if (fseek(fp, 0, SEEK_END) != 0 || ftell(fp) != file->size) {
+		fprintf(stderr, "FAIL %s: the decoded image is %ld bytes instead of %ld\n", what, ftell(fp), (long) file->size);
+	} else if (fseek(fp, 0, SEEK_SET) != 0 || fread(decoded, file->size, 1, fp) != 1
+			   || memcmp(decoded, data, file->size) != 0) {
+		fprintf(stderr, "FAIL %s: the decoded image differs from the original data\n", what);
+	} else {
+		ok = true;
+	}
+	if (fp) {
+		fclose(fp);
+	}
+	free(chunkBuf);
+	free(decoded);
+	return ok;
+}
+
+static int checkSharedImages()
+{
+	int failures = 0;
+	for (size_t i = 0 ; i < sizeof(sharedImages) / sizeof(sharedImages[0]) ; ++i) {
+		const shared_image *shared = &sharedImages[i];
+		const test_file *file = findTestFile(shared->file);
+		void *data = generateTestFile(file);
+		for (int mode = COMPRESSING ; mode <= STREAMED ; ++mode) {
+			compressed_image image, plain;
+			void *decmpfsCopy, *resourceForkCopy, *plainDecmpfs, *plainResourceFork;
+			char what[128];
+			snprintf(what, sizeof(what), "%s -c%d%sD, %s", file->name, shared->compressionlevel,
+					 (shared->allowLargeBlocks)? "L" : "", buildModeName[mode]);
+			if (!buildTestImage(file, data, mode, ZLIB, shared->compressionlevel, shared->allowLargeBlocks, true,
+								&image, &decmpfsCopy, &resourceForkCopy)
+				|| !buildTestImage(file, data, mode, ZLIB, shared->compressionlevel, shared->allowLargeBlocks, false,
+								   &plain, &plainDecmpfs, &plainResourceFork)) {
+				fprintf(stderr, "FAIL %s: the image could not be built\n", what);
+				failures += 1;
+				continue;
+			}
+			if (image.sharedChunks != shared->sharedChunks) {
+				fprintf(stderr, "FAIL %s: %u chunks stored once, expected %u\n", what, image.sharedChunks, shared->sharedChunks);
+				failures += 1;
+			} else if (!image.resourceFork || !plain.resourceFork
+					   || (image.sharedChunks && image.resourceForkSize >= plain.resourceForkSize)) {
+				fprintf(stderr, "FAIL %s: resource fork of %lu bytes, %lu without -D\n", what,
+						(unsigned long) image.resourceForkSize, (unsigned long) plain.resourceForkSize);
+				failures += 1;
+			} else if (!image.sharedChunks
+					   && !checkImage(what, &image, plain.decmpfsSize, fnv1a64(plain.decmpfsBuf, plain.decmpfsSize),
+									  plain.resourceForkSize, fnv1a64(plain.resourceFork, plain.resourceForkSize))) {
+				// without identical chunks, -D changes nothing
+				failures += 1;
+			} else if (!checkDecodedImage(what, &image, file, data)) {
+				failures += 1;
+			}
+			free(decmpfsCopy);
+			free(resourceForkCopy);
+			free(plainDecmpfs);
+			free(plainResourceFork);
+		}
+		free(data);
+	}
+	return failures;
+}
+
+#if defined HAS_LZVN || defined HAS_LZFSE
+/**
+ * the image compressFile() built for LZVN and LZFSE: a single chunk that fits goes into
+ * the decmpfs attribute, otherwise the resource fork holds the table of chunk offsets
+ * followed by the chunks.
+ */
+static bool lzReferenceImage(const test_file *file, const void *data, int comptype,
+							 unsigned char *decmpfsBuf, unsigned int *decmpfsSize,
+							 void **resourceFork, size_t *resourceForkSize)
+{
+	const unsigned int numBlocks = (file->size + DECMPFS_CHUNK_SIZE - 1) / DECMPFS_CHUNK_SIZE;
+	const size_t tableSize = (numBlocks + 1) * sizeof(lz_chunk_table);
+	// generous: the chunks of the test files never grow by more than a few bytes
+	const size_t chunkCapacity = 2 * DECMPFS_CHUNK_SIZE;
+	char *outBuf = malloc(tableSize + numBlocks * chunkCapacity), *chunk = malloc(chunkCapacity);
+	void *workSpace = NULL;
+	size_t workSpaceSize = 0, outBufSize = tableSize;
+	decmpfs_disk_header *header = (decmpfs_disk_header*) decmpfsBuf;
+	UInt32 xattrType = 0, resourceForkType = 0;
+
+	switch (comptype) {
+#ifdef HAS_LZVN
+		case LZVN:
+			workSpaceSize = lzvn_encode_scratch_size();
+			xattrType = CMP_LZVN_XATTR, resourceForkType = CMP_LZVN_RESOURCE_FORK;
+			break;
+#endif
+#ifdef HAS_LZFSE
+		case LZFSE:
+			workSpaceSize = lzfse_encode_scratch_size();
+			xattrType = CMP_LZFSE_XATTR, resourceForkType = CMP_LZFSE_RESOURCE_FORK;
+			break;
+#endif
+	}
+	if (workSpaceSize) {
+		workSpace = malloc(workSpaceSize);
+	}
+	if (!outBuf || !chunk || (!workSpace && workSpaceSize)) {
+		free(outBuf);
+		free(chunk);
+		free(workSpace);
+		return false;
+	}
+	header->compression_magic = OSSwapHostToLittleInt32(DECMPFS_MAGIC);
+	header->compression_type = OSSwapHostToLittleInt32(resourceForkType);
+	header->uncompressed_size = OSSwapHostToLittleInt64(file->size);
+	*decmpfsSize = sizeof(decmpfs_disk_header);
+	((lz_chunk_table*) outBuf)[0] = tableSize;
+	for (unsigned int blockNr = 0 ; blockNr < numBlocks ; ++blockNr) {
+		off_t offset = (off_t) blockNr * DECMPFS_CHUNK_SIZE;
+		size_t len = (file->size - offset > DECMPFS_CHUNK_SIZE)? DECMPFS_CHUNK_SIZE : file->size - offset;
+		size_t cmpedsize = 0;
+#ifdef HAS_LZVN
+		if (comptype == LZVN) {
+			cmpedsize = lzvn_encode_buffer(chunk, chunkCapacity, (const char*) data + offset, len, workSpace);
+		}
+#endif
+#ifdef HAS_LZFSE
+		if (comptype == LZFSE) {
+			cmpedsize = lzfse_encode_buffer((uint8_t*) chunk, chunkCapacity, (const uint8_t*) data + offset, len, workSpace);
+		}
+#endif
+		if (numBlocks == 1 && *decmpfsSize + cmpedsize <= MAX_DECMPFS_XATTR_SIZE) {
+			header->compression_type = OSSwapHostToLittleInt32(xattrType);
+			memcpy(decmpfsBuf + *decmpfsSize, chunk, cmpedsize);
+			*decmpfsSize += cmpedsize;
+			free(outBuf);
+			outBuf = NULL;
+			outBufSize = 0;
+			break;
+		}
+		memcpy(outBuf + outBufSize, chunk, cmpedsize);
+		outBufSize += cmpedsize;
+		((lz_chunk_table*) outBuf)[blockNr + 1] = outBufSize;
+	}
+	free(chunk);
+	free(workSpace);
+	*resourceFork = outBuf;
+	*resourceForkSize = outBufSize;
+	return true;
+}
+
+static int checkLZImages(int comptype)
+{
+	int failures = 0;
+	for (size_t i = 0 ; i < N_TEST_FILES ; ++i) {
+		const test_file *file = &testFiles[i];
+		void *data = generateTestFile(file), *reference;
+		unsigned char referenceDecmpfs[MAX_DECMPFS_XATTR_SIZE];
+		unsigned int referenceDecmpfsSize;
+		size_t referenceSize;
+		if (!lzReferenceImage(file, data, comptype, referenceDecmpfs, &referenceDecmpfsSize, &reference, &referenceSize)) {
+			fprintf(stderr, "FAIL %s %s: the reference image could not be built\n", file->name, compressionTypeName(comptype));
+			failures += 1;
+			free(data);
+			continue;
+		}
+		for (int mode = COMPRESSING ; mode <= STREAMED ; ++mode) {
+			compressed_image image;
+			void *decmpfsCopy, *resourceForkCopy;
+			char what[128];
+			snprintf(what, sizeof(what), "%s %s, %s", file->name, compressionTypeName(comptype), buildModeName[mode]);
+			if (!buildTestImage(file, data, mode, comptype, 5, false, false, &image, &decmpfsCopy, &resourceForkCopy)) {
+				fprintf(stderr, "FAIL %s: the image could not be built\n", what);
+				failures += 1;
+				continue;
+			}
+			if (!checkImage(what, &image, referenceDecmpfsSize, fnv1a64(referenceDecmpfs, referenceDecmpfsSize),
+							referenceSize, (reference)? fnv1a64(reference, referenceSize) : 0)) {
+				failures += 1;
+			}
+			free(decmpfsCopy);
+			free(resourceForkCopy);
+		}
+		free(reference);
+		free(data);
+	}
+	return failures;
+}
+#endif
+
+int main(int argc, const char *argv[])
+{
+	int failures = 0;
+
+	if (argc == 3 && strcmp(argv[1], "-w") == 0) {
+		for (size_t i = 0 ; i < N_TEST_FILES ; ++i) {
+			if (!writeTestFile(&testFiles[i], argv[2])) {
+				return EIO;
+			}
+		}
+		return 0;
+	} else if (argc > 1) {
+		fprintf(stderr, "Usage: %s [-w directory]\n", argv[0]);
+		return EINVAL;
+	}
+
+#ifdef HAS_LIBDEFLATE
+	fprintf(stderr, "SKIP ZLIB: built with libdeflate, whose output differs from the zlib reference images\n");
+#else
+	failures += checkZlibImages();
+	failures += checkSharedImages();
+#endif
+#ifdef HAS_LZVN
+	failures += checkLZImages(LZVN);
+#endif
+#ifdef HAS_LZFSE
+	failures += checkLZImages(LZFSE);
+#endif
+	if (failures) {
+		fprintf(stderr, "%d image(s) differ from the reference\n", failures);
+		return 1;
+	}
+	printf("all images are identical to the reference images\n");
+	return 0;
+}
@@ -0,0 +1,277 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file image_store.c
+ * (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * Checks that damaged files in the compressed image store (-C) are rejected and removed,
+ * without being decoded out of bounds: truncated files, inconsistent sizes, headers that
+ * don't match the file looked up, and chunk tables pointing outside the resource fork.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "blobcache.h"
+#include "testdata.h"
+
+static const test_file textFile = { "text", 5 * 65536 + 1234, "tttttt" };
+static const test_file smallFile = { "small", 3000, "t" };
+
+// the header of the store files, as in blobcache.cpp
+typedef struct store_header {
+	char magic[8];
+	UInt32 decmpfsSize;
+	UInt32 reserved;
+	UInt64 resourceForkSize;
+	UInt64 cpuUSec;
+} store_header;
+
+// a store file read into memory
+typedef struct store_file {
+	char path[1024];
+	char *data;
+	size_t size;
+} store_file;
+
+// the ways to damage a store file
+typedef enum damage {
+	TRUNCATED, HEADER_ONLY, SHORT_DECMPFS, LARGE_DECMPFS, HUGE_RESOURCE_FORK, WRONG_TYPE, WRONG_SIZE,
+	SHORT_TABLE, OFFSET_OUTSIDE, SIZE_OUTSIDE, LARGE_RAW_CHUNK, N_DAMAGES
+} damage;
+static const char *damageName[] = {
+	"truncated", "header only", "decmpfs shorter than its header", "decmpfs too large",
+	"huge resource fork", "wrong compression type", "wrong uncompressed size",
+	"resource fork shorter than the chunk table", "chunk offset outside the resource fork",
+	"chunk size outside the resource fork", "raw chunk larger than a chunk"
+};
+
+static bool findStoreFile(const char *dir, store_file *file)
+{
+	DIR *d = opendir(dir);
+	struct dirent *entry;
+	bool found = false;
+	if (!d) {
+		return false;
+	}
+	while (!found && (entry = readdir(d))) {
+		if (entry->d_name[0] != '.') {
+			snprintf(file->path, sizeof(file->path), "%s/%s", dir, entry->d_name);
+			found = true;
+		}
+	}
+	closedir(d);
+	return found;
+}
+
+static bool readStoreFile(const char *dir, store_file *file)
+{
+	struct stat st;
+	FILE *fp;
+	bool ok;
+	file->data = NULL;
+	if (!findStoreFile(dir, file) || stat(file->path, &st) != 0 || !(fp = fopen(file->path, "r"))) {
+		return false;
+	}
+	file->size = st.st_size;
+	ok = (file->data = malloc(file->size)) && fread(file->data, file->size, 1, fp) == 1;
+	fclose(fp);
+	return ok;
+}
+
+static bool writeStoreFile(const store_file *file)
+{
+	FILE *fp = fopen(file->path, "w");
+	bool ok = fp && fwrite(file->data, file->size, 1, fp) == 1;
+	if (fp && fclose(fp) != 0) {
+		ok = false;
+	}
+	return ok;
+}
+
+static inline void putLE32(char *p, UInt32 value)
+{
+	value = OSSwapHostToLittleInt32(value);
+	memcpy(p, &value, sizeof(value));
+}
+
+// the ZLIB table entry (offset, size) of chunk <blockNr> in the resource fork
+static inline char *zlibTableEntry(const store_file *file, unsigned int blockNr)
+{
+	const store_header *header = (const store_header*) file->data;
+	return file->data + sizeof(store_header) + header->decmpfsSize + 0x104 + blockNr * 8 + 4;
+}
+
+// apply <what> to <file>; returns false when it doesn't apply to the image in the file
+static bool damageStoreFile(store_file *file, damage what)
+{
+	store_header *header = (store_header*) file->data;
+	decmpfs_disk_header *decmpfsAttr = (decmpfs_disk_header*) (file->data + sizeof(store_header));
+	const bool hasResourceFork = header->resourceForkSize > 0;
+	switch (what) {
+		case TRUNCATED:
+			file->size -= 100;
+			break;
+		case HEADER_ONLY:
+			file->size = sizeof(store_header);
+			break;
+		case SHORT_DECMPFS:
+			// (the total size stays consistent)
+			header->resourceForkSize += header->decmpfsSize - 4;
+			header->decmpfsSize = 4;
+			break;
+		case LARGE_DECMPFS:
+			if (header->decmpfsSize + header->resourceForkSize <= MAX_DECMPFS_XATTR_SIZE) {
+				return false;
+			}
+			header->resourceForkSize -= MAX_DECMPFS_XATTR_SIZE + 1 - header->decmpfsSize;
+			header->decmpfsSize = MAX_DECMPFS_XATTR_SIZE + 1;
+			break;
+		case HUGE_RESOURCE_FORK:
+			header->resourceForkSize = (UInt64) -1;
+			break;
+		case WRONG_TYPE:
+			decmpfsAttr->compression_type = OSSwapHostToLittleInt32(hasResourceFork ? CMP_ZLIB_XATTR : CMP_ZLIB_RESOURCE_FORK);
+			break;
+		case WRONG_SIZE:
+			decmpfsAttr->uncompressed_size = OSSwapHostToLittleInt64(OSSwapLittleToHostInt64(decmpfsAttr->uncompressed_size) + 1);
+			break;
+		case SHORT_TABLE:
+			if (!hasResourceFork) {
+				return false;
+			}
+			header->resourceForkSize = 0x104 + 8;
+			file->size = sizeof(store_header) + header->decmpfsSize + header->resourceForkSize;
+			break;
+		case OFFSET_OUTSIDE:
+			if (!hasResourceFork) {
+				return false;
+			}
+			putLE32(zlibTableEntry(file, 2), 0xfffffff0);
+			break;
+		case SIZE_OUTSIDE:
+			if (!hasResourceFork) {
+				return false;
+			}
+			putLE32(zlibTableEntry(file, 2) + 4, 0xfffffff0);
+			break;
+		case LARGE_RAW_CHUNK: {
+			if (!hasResourceFork) {
+				return false;
+			}
+			// an uncompressed chunk of 0x100 bytes more than fit in the decoding buffer
+			char *entry = zlibTableEntry(file, 0);
+			UInt32 offset;
+			memcpy(&offset, entry, sizeof(offset));
+			file->data[sizeof(store_header) + header->decmpfsSize + 0x104 + OSSwapLittleToHostInt32(offset)] = (char) 0xFF;
+			putLE32(entry + 4, DECMPFS_CHUNK_SIZE + 0x101);
+			break;
+		}
+		default:
+			return false;
+	}
+	return true;
+}
+
+// store the image of <file>, damage the store file and look the image up again
+static int checkDamagedImages(const test_file *file, const char *dir)
+{
+	void *data = generateTestFile(file);
+	buffer_arena arena, lookupArena;
+	chunk_compressor compressor;
+	compressed_image image, found;
+	blob_cache_key key;
+	double cpuTime;
+	int failures = 0;
+
+	initBufferArena(&arena, BUFFER_ARENA_MAX_RETAINED);
+	initBufferArena(&lookupArena, BUFFER_ARENA_MAX_RETAINED);
+	memset(&image, 0, sizeof(image));
+	memset(&key, 0, sizeof(key));
+	key.contentHash = fnv1a64(data, file->size);
+	key.filesize = file->size;
+	key.comptype = ZLIB;
+	key.compressionlevel = 5;
+	if (!initChunkCompressor(&compressor, file->name, &arena, ZLIB, 5, false)) {
+		fprintf(stderr, "FAIL %s: the compressor could not be set up\n", file->name);
+		releaseBufferArena(&arena);
+		releaseBufferArena(&lookupArena);
+		free(data);
+		return 1;
+	}
+	if (!buildCompressedImage(&image, file->name, data, file->size, ZLIB, &compressor, NULL, &arena)) {
+		fprintf(stderr, "FAIL %s: the image could not be built\n", file->name);
+		failures += 1;
+		goto bail;
+	}
+	blobCacheStore(&key, &image, 1.0);
+	if (!blobCacheLookup(&key, data, &found, &lookupArena, &cpuTime)) {
+		fprintf(stderr, "FAIL %s: the intact image is not found in the store\n", file->name);
+		failures += 1;
+		goto bail;
+	}
+	for (int what = 0 ; what < N_DAMAGES ; ++what) {
+		store_file stored;
+		struct stat st;
+		blobCacheStore(&key, &image, 1.0);
+		if (!readStoreFile(dir, &stored)) {
+			fprintf(stderr, "FAIL %s: the image was not stored (%s)\n", file->name, strerror(errno));
+			failures += 1;
+			free(stored.data);
+			break;
+		}
+		if (damageStoreFile(&stored, what)) {
+			if (!writeStoreFile(&stored)) {
+				fprintf(stderr, "FAIL %s, %s: cannot write %s (%s)\n", file->name, damageName[what], stored.path, strerror(errno));
+				failures += 1;
+			} else if (blobCacheLookup(&key, data, &found, &lookupArena, &cpuTime)) {
+				fprintf(stderr, "FAIL %s, %s: the damaged image was accepted\n", file->name, damageName[what]);
+				failures += 1;
+			} else if (stat(stored.path, &st) == 0) {
+				fprintf(stderr, "FAIL %s, %s: the damaged image was not removed\n", file->name, damageName[what]);
+				failures += 1;
+			}
+		}
+		unlink(stored.path);
+		free(stored.data);
+	}
+bail:
+	releaseChunkCompressor(&compressor);
+	releaseBufferArena(&arena);
+	releaseBufferArena(&lookupArena);
+	free(data);
+	return failures;
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/image_store.XXXXXX";
+	int failures = 0;
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "cannot create a temporary directory (%s)\n", strerror(errno));
+		return EIO;
+	}
+	// (no images in memory, so that they are read from the store)
+	if (!initBlobCache(0, dir)) {
+		rmdir(dir);
+		return EIO;
+	}
+	failures += checkDamagedImages(&textFile, dir);
+	failures += checkDamagedImages(&smallFile, dir);
+	releaseBlobCache();
+	rmdir(dir);
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("damaged store files are rejected\n");
+	return 0;
+}
@@ -0,0 +1,61 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file prefilter_samples.c
+ * (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * Checks the chunks the compressibility prefilter samples: the first and the last chunk of the
+ * file and others in between, all within the file and the same ones each time for a given seed
+ * (so that a file rejected once is rejected again on the next run).
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "codecs.h"
+
+static int checkSamples(unsigned int numBlocks, unsigned int seed)
+{
+	unsigned int blockNr[PREFILTER_SAMPLES], again[PREFILTER_SAMPLES];
+	int failures = 0;
+
+	chooseSampleChunks(numBlocks, seed, blockNr);
+	if (blockNr[0] != 0 || blockNr[1] != numBlocks - 1) {
+		fprintf(stderr, "%u chunks, seed %u: sampled chunks %u and %u instead of the first and the last\n",
+				numBlocks, seed, blockNr[0], blockNr[1]);
+		++failures;
+	}
+	for (int i = 2 ; i < PREFILTER_SAMPLES ; ++i) {
+		if (blockNr[i] == 0 || blockNr[i] >= numBlocks - 1) {
+			fprintf(stderr, "%u chunks, seed %u: sample %d is chunk %u, not an inner chunk\n",
+					numBlocks, seed, i, blockNr[i]);
+			++failures;
+		}
+	}
+	chooseSampleChunks(numBlocks, seed, again);
+	if (memcmp(blockNr, again, sizeof(blockNr)) != 0) {
+		fprintf(stderr, "%u chunks, seed %u: a different choice of chunks the second time\n", numBlocks, seed);
+		++failures;
+	}
+	return failures;
+}
+
+int main(void)
+{
+	const unsigned int seeds[] = { 0, 1, 0x5a5a5a5a, 0xffffffff };
+	int failures = 0;
+
+	for (unsigned int numBlocks = PREFILTER_MIN_BLOCKS ; numBlocks <= 4 * PREFILTER_MIN_BLOCKS ; ++numBlocks) {
+		for (size_t i = 0 ; i < sizeof(seeds) / sizeof(seeds[0]) ; ++i) {
+			failures += checkSamples(numBlocks, seeds[i]);
+		}
+	}
+	failures += checkSamples(0x7fffffff, 12345);
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("the prefilter samples the expected chunks\n");
+	return 0;
+}
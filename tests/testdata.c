@@ -0,0 +1,132 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file testdata.c
+ * (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "testdata.h"
+
+// the globals that codecs.c shares with afsctool.c
+int printVerbose = 0;
+
+const char *compressionTypeName(int type)
+{
+	switch (type) {
+		case ZLIB:
+			return "ZLIB";
+		case LZVN:
+			return "LZVN";
+		case LZFSE:
+			return "LZFSE";
+		default:
+			return "unknown";
+	}
+}
+
+static const char *words[] = {
+	"the", "of", "and", "to", "in", "is", "file", "that", "compression", "for", "it", "with",
+	"as", "was", "on", "chunk", "be", "by", "this", "data", "are", "from", "at", "or", "resource",
+	"fork", "an", "which", "have", "not", "block", "one", "had", "all", "were", "they", "their",
+	"attribute", "when", "we", "there", "can", "been", "has", "more", "if", "will", "would",
+	"zlib", "so", "what", "out", "up", "who", "them", "some", "into", "time", "only", "other",
+	"decmpfs", "worker", "buffer", "size"
+};
+
+static inline UInt64 nextRandom(UInt64 *state)
+{
+	// a 64-bit LCG (Knuth's MMIX constants); the high bits are the useful ones
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return *state >> 24;
+}
+
+static void generateText(char *buf, size_t len, UInt64 seed)
+{
+	UInt64 state = seed;
+	size_t i = 0;
+	while (i < len) {
+		UInt64 r = nextRandom(&state);
+		const char *word = words[r % (sizeof(words) / sizeof(words[0]))];
+		for ( ; *word && i < len ; ++word) {
+			buf[i++] = *word;
+		}
+		if (i < len) {
+			buf[i++] = ((r >> 8) % 12 == 0)? '\n' : ' ';
+		}
+	}
+}
+
+static void generateRandom(char *buf, size_t len, UInt64 seed)
+{
+	UInt64 state = seed;
+	for (size_t i = 0 ; i < len ; ++i) {
+		buf[i] = (char) nextRandom(&state);
+	}
+}
+
+void *generateTestFile(const test_file *file)
+{
+	char *buf = malloc(file->size);
+	if (!buf) {
+		return NULL;
+	}
+	for (off_t offset = 0, blockNr = 0 ; offset < file->size ; offset += DECMPFS_CHUNK_SIZE, ++blockNr) {
+		size_t len = (file->size - offset > DECMPFS_CHUNK_SIZE)? DECMPFS_CHUNK_SIZE : file->size - offset;
+		switch (file->chunks[blockNr]) {
+			case 't':
+				generateText(buf + offset, len, 1000 + blockNr);
+				break;
+			case 'A':
+			case 'B':
+				generateText(buf + offset, len, file->chunks[blockNr]);
+				break;
+			case 'r':
+				generateRandom(buf + offset, len, 2000 + blockNr);
+				break;
+			case 'R':
+				generateRandom(buf + offset, len, 'R');
+				break;
+			case 'z':
+			default:
+				memset(buf + offset, 0, len);
+				break;
+		}
+	}
+	return buf;
+}
+
+bool writeTestFile(const test_file *file, const char *dir)
+{
+	char path[1024];
+	void *data = generateTestFile(file);
+	FILE *fp;
+	bool ok;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+	if (!data || !(fp = fopen(path, "w"))) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(data);
+		return false;
+	}
+	ok = fwrite(data, file->size, 1, fp) == 1;
+	ok = fclose(fp) == 0 && ok;
+	free(data);
+	return ok;
+}
+
+UInt64 fnv1a64(const void *data, size_t len)
+{
+	const unsigned char *c = (const unsigned char*) data;
+	UInt64 hash = 14695981039346656037ULL;
+	for (size_t i = 0 ; i < len ; ++i) {
+		hash ^= c[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
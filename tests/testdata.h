@@ -0,0 +1,57 @@
+// kate: auto-insert-doxygen true; backspace-indents true; indent-width 4; keep-extra-spaces true; replace-tabs false; tab-indents true; tab-width 4;
+/*
+ * @file testdata.h
+ * @file testdata.c
+ * (C) 2015-now René J.V. Bertin
+ * This code is made available under the GPL3 License
+ * (See License.txt)
+ *
+ * The synthetic files the tests compress. They are generated from a description so that
+ * the tests don't depend on data files, and are the same on every platform.
+ */
+
+#ifndef _TESTDATA_H
+
+#include "codecs.h"
+
+#ifndef __APPLE__
+#	include <endian.h>
+#	define OSSwapHostToLittleInt32(x)	htole32(x)
+#	define OSSwapHostToLittleInt64(x)	htole64(x)
+#	define OSSwapLittleToHostInt32(x)	le32toh(x)
+#	define OSSwapLittleToHostInt64(x)	le64toh(x)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif //__cplusplus
+
+/**
+ * a test file: <size> bytes made of 64Kb chunks whose content is given by a character each in <chunks>:
+ * 't'	text, different for each chunk
+ * 'A', 'B'	text, identical for all chunks with the same letter
+ * 'r'	random bytes, different for each chunk
+ * 'R'	random bytes, identical for all 'R' chunks
+ * 'z'	zeroes
+ * The last chunk is truncated to <size>.
+ */
+typedef struct test_file {
+	const char *name;
+	off_t size;
+	const char *chunks;
+} test_file;
+
+// generate the content of <file> in a newly allocated buffer
+extern void *generateTestFile(const test_file *file);
+// write the content of <file> as <dir>/<file->name>
+extern bool writeTestFile(const test_file *file, const char *dir);
+
+// the 64-bit FNV-1a hash of <len> bytes, used to compare compressed images with reference images
+extern UInt64 fnv1a64(const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#define _TESTDATA_H
+#endif //_TESTDATA_H